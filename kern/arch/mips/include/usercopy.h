@@ -0,0 +1,38 @@
+#ifndef _MIPS_USERCOPY_H_
+#define _MIPS_USERCOPY_H_
+
+/*
+ * Copy routines that touch user memory (see copy-mips1.S), used by
+ * copyin/copyout and friends in vm/copyinout.c. Every port provides
+ * ucopy, uzero, and ucopystr with these semantics in its
+ * <machine/usercopy.h>; the rest is private to the mips trap code.
+ *
+ * They return EFAULT instead of panicking if they take a fault that
+ * vm_fault can't handle. This works like an exception table: all of
+ * them live between mips_usercopy_start and mips_usercopy_end, and
+ * the trap code sends a fatal kernel-mode fault with the PC in that
+ * range to mips_usercopy_fault, which returns EFAULT to the caller.
+ * No setup is needed per call.
+ *
+ *   ucopy: copy LEN bytes from SRC to DEST; returns 0.
+ *
+ *   uzero: zero LEN bytes at DEST; returns 0.
+ *
+ *   ucopystr: copy a string of at most LEN bytes (including the
+ *        null) from SRC to DEST. Returns 0 and stores the length
+ *        (including the null) in *GOT, if GOT isn't NULL, or returns
+ *        ENAMETOOLONG if there was no null within LEN bytes.
+ */
+
+int ucopy(void *dest, const void *src, size_t len);
+int uzero(void *dest, size_t len);
+int ucopystr(char *dest, const char *src, size_t len, size_t *got);
+
+/* Bounds of the copy routines, and where their faults go; see trap.c */
+
+extern const char mips_usercopy_start[];
+extern const char mips_usercopy_end[];
+extern const char mips_usercopy_fault[];
+
+
+#endif /* _MIPS_USERCOPY_H_ */
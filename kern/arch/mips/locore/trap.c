@@ -32,6 +32,7 @@
 #include <lib.h>
 #include <mips/specialreg.h>
 #include <mips/trapframe.h>
+#include <mips/usercopy.h>
 #include <cpu.h>
 #include <spl.h>
 #include <thread.h>
@@ -278,24 +279,34 @@ mips_trap(struct trapframe *tf)
 	/*
 	 * Fatal fault in kernel mode.
 	 *
-	 * If pcb_badfaultfunc is set, we do not panic; badfaultfunc is
-	 * set by copyin/copyout and related functions to signify that
-	 * the addresses they're accessing are userlevel-supplied and
-	 * not trustable. What we actually want to do is resume
-	 * execution at the function pointed to by badfaultfunc. That's 
-	 * going to be "copyfail" (see copyinout.c), which longjmps 
-	 * back to copyin/copyout or wherever and returns EFAULT.
+	 * If the fault happened inside the user copy routines (between
+	 * mips_usercopy_start and mips_usercopy_end, see copy-mips1.S)
+	 * we do not panic: those routines are copyin/copyout and related
+	 * functions touching userlevel-supplied addresses that are not
+	 * trustable. What we actually want to do is resume execution at
+	 * mips_usercopy_fault, which returns EFAULT from the routine
+	 * that faulted. This works like an exception table, so copyin
+	 * and friends don't have to set anything up beforehand.
 	 *
-	 * Note that we do not just *call* this function, because that
+	 * Otherwise, if tm_badfaultfunc is set, resume execution at the
+	 * function it points to instead.
+	 *
+	 * Note that we do not just *call* these functions, because that
 	 * won't necessarily do anything. We want the control flow
 	 * that is currently executing in copyin (or whichever), and
 	 * is stopped while we process the exception, to *teleport* to
-	 * copyfail.
+	 * the recovery code.
 	 *
 	 * This is accomplished by changing tf->tf_epc and returning
 	 * from the exception handler.
 	 */
 
+	if (tf->tf_epc >= (vaddr_t) mips_usercopy_start &&
+	    tf->tf_epc < (vaddr_t) mips_usercopy_end) {
+		tf->tf_epc = (vaddr_t) mips_usercopy_fault;
+		goto done;
+	}
+
 	if (curthread != NULL &&
 	    curthread->t_machdep.tm_badfaultfunc != NULL) {
 		tf->tf_epc = (vaddr_t) curthread->t_machdep.tm_badfaultfunc;
@@ -38,6 +38,18 @@
 #include <proc.h>
 #include <addrspace.h>
 #include "opt-A2.h"
+#include "opt-schedstats.h"
+#include "opt-fdtable.h"
+#include "opt-mmap.h"
+#include "opt-syscallstats.h"
+#include "opt-aio.h"
+#include <endian.h>
+#include <copyinout.h>
+#include <clock.h>
+#if OPT_SYSCALLSTATS
+#include <kern/syscallstats.h>
+#include <spinlock.h>
+#endif
 /*
  * System call dispatcher.
  *
@@ -76,12 +88,451 @@
  * stack, starting at sp+16 to skip over the slots for the
  * registerized values, with copyin().
  */
+/*
+ * The system call table.
+ *
+ * Each entry, indexed by call number, gives the call's name, a
+ * descriptor for its arguments, and a handler. The descriptor has
+ * one character per argument: 'w' for a 32-bit word and 'd' for a
+ * 64-bit doubleword. syscall() uses it to fetch the arguments from
+ * the registers and the stack, per the conventions above, into
+ * sa_arg[]; the handler just hands them to the sys_ function.
+ *
+ * Handlers leave their return value in sa_retval (which starts out
+ * 0), or in sa_retval64 with sa_ret64 set for 64-bit values.
+ */
+
+#define SYSCALL_MAXARGS  6	/* arguments */
+#define SYSCALL_MAXWORDS 8	/* 32-bit argument slots, with padding */
+
+struct syscall_args {
+	struct trapframe *sa_tf;
+	uint64_t sa_arg[SYSCALL_MAXARGS];
+	int32_t sa_retval;
+	off_t sa_retval64;
+	bool sa_ret64;
+};
+
+struct syscall_desc {
+	const char *sd_name;
+	const char *sd_args;
+	int (*sd_handler)(struct syscall_args *sa);
+};
+
+static
+int
+sc_reboot(struct syscall_args *sa)
+{
+	return sys_reboot(sa->sa_arg[0]);
+}
+
+static
+int
+sc___time(struct syscall_args *sa)
+{
+	return sys___time((userptr_t)(vaddr_t)sa->sa_arg[0],
+			  (userptr_t)(vaddr_t)sa->sa_arg[1]);
+}
+
+#if OPT_SCHEDSTATS
+static
+int
+sc___schedstats(struct syscall_args *sa)
+{
+	return sys___schedstats(sa->sa_arg[0],
+				(userptr_t)(vaddr_t)sa->sa_arg[1],
+				&sa->sa_retval);
+}
+#endif
+
+#if OPT_SYSCALLSTATS
+static
+int
+sc___syscallstats(struct syscall_args *sa)
+{
+	return sys___syscallstats(sa->sa_arg[0],
+				  (userptr_t)(vaddr_t)sa->sa_arg[1],
+				  &sa->sa_retval);
+}
+#endif
+
+#ifdef UW
+static
+int
+sc_write(struct syscall_args *sa)
+{
+	return sys_write(sa->sa_arg[0], (userptr_t)(vaddr_t)sa->sa_arg[1],
+			 sa->sa_arg[2], &sa->sa_retval);
+}
+
+static
+int
+sc__exit(struct syscall_args *sa)
+{
+	DEBUG(DB_SYSCALL,"syscall: _exit()\n");
+	sys__exit(sa->sa_arg[0]);
+	/* sys__exit does not return, execution should not get here */
+	panic("unexpected return from sys__exit");
+	return 0;
+}
+
+static
+int
+sc_getpid(struct syscall_args *sa)
+{
+	return sys_getpid(&sa->sa_retval);
+}
+
+static
+int
+sc_waitpid(struct syscall_args *sa)
+{
+	return sys_waitpid(sa->sa_arg[0], (userptr_t)(vaddr_t)sa->sa_arg[1],
+			   sa->sa_arg[2], &sa->sa_retval);
+}
+#endif // UW
+
+#if OPT_FDTABLE
+static
+int
+sc_open(struct syscall_args *sa)
+{
+	return sys_open((userptr_t)(vaddr_t)sa->sa_arg[0], sa->sa_arg[1],
+			sa->sa_arg[2], &sa->sa_retval);
+}
+
+static
+int
+sc_read(struct syscall_args *sa)
+{
+	return sys_read(sa->sa_arg[0], (userptr_t)(vaddr_t)sa->sa_arg[1],
+			sa->sa_arg[2], &sa->sa_retval);
+}
+
+static
+int
+sc_readv(struct syscall_args *sa)
+{
+	return sys_readv(sa->sa_arg[0],
+			 (const_userptr_t)(vaddr_t)sa->sa_arg[1],
+			 sa->sa_arg[2], &sa->sa_retval);
+}
+
+static
+int
+sc_writev(struct syscall_args *sa)
+{
+	return sys_writev(sa->sa_arg[0],
+			  (const_userptr_t)(vaddr_t)sa->sa_arg[1],
+			  sa->sa_arg[2], &sa->sa_retval);
+}
+
+static
+int
+sc_pread(struct syscall_args *sa)
+{
+	return sys_pread(sa->sa_arg[0], (userptr_t)(vaddr_t)sa->sa_arg[1],
+			 sa->sa_arg[2], sa->sa_arg[3], &sa->sa_retval);
+}
+
+static
+int
+sc_pwrite(struct syscall_args *sa)
+{
+	return sys_pwrite(sa->sa_arg[0], (userptr_t)(vaddr_t)sa->sa_arg[1],
+			  sa->sa_arg[2], sa->sa_arg[3], &sa->sa_retval);
+}
+
+static
+int
+sc_lseek(struct syscall_args *sa)
+{
+	sa->sa_ret64 = true;
+	return sys_lseek(sa->sa_arg[0], sa->sa_arg[1], sa->sa_arg[2],
+			 &sa->sa_retval64);
+}
+
+static
+int
+sc_close(struct syscall_args *sa)
+{
+	return sys_close(sa->sa_arg[0]);
+}
+
+static
+int
+sc_dup2(struct syscall_args *sa)
+{
+	return sys_dup2(sa->sa_arg[0], sa->sa_arg[1], &sa->sa_retval);
+}
+
+static
+int
+sc_fsync(struct syscall_args *sa)
+{
+	return sys_fsync(sa->sa_arg[0]);
+}
+
+static
+int
+sc_sendfile(struct syscall_args *sa)
+{
+	return sys_sendfile(sa->sa_arg[0], sa->sa_arg[1],
+			    (userptr_t)(vaddr_t)sa->sa_arg[2], sa->sa_arg[3],
+			    &sa->sa_retval);
+}
+
+#if OPT_MMAP
+static
+int
+sc_mmap(struct syscall_args *sa)
+{
+	return sys_mmap((userptr_t)(vaddr_t)sa->sa_arg[0], sa->sa_arg[1],
+			sa->sa_arg[2], sa->sa_arg[3], sa->sa_arg[4],
+			sa->sa_arg[5], &sa->sa_retval);
+}
+
+static
+int
+sc_munmap(struct syscall_args *sa)
+{
+	return sys_munmap((userptr_t)(vaddr_t)sa->sa_arg[0], sa->sa_arg[1]);
+}
+#endif
+
+#if OPT_AIO
+static
+int
+sc_aio_submit(struct syscall_args *sa)
+{
+	return sys_aio_submit((const_userptr_t)(vaddr_t)sa->sa_arg[0],
+			      sa->sa_arg[1], &sa->sa_retval);
+}
+
+static
+int
+sc_aio_reap(struct syscall_args *sa)
+{
+	return sys_aio_reap((userptr_t)(vaddr_t)sa->sa_arg[0], sa->sa_arg[1],
+			    sa->sa_arg[2], &sa->sa_retval);
+}
+#endif
+#endif
+
+#if OPT_A2
+static
+int
+sc_fork(struct syscall_args *sa)
+{
+	return sys_fork(sa->sa_tf, &sa->sa_retval);
+}
+
+static
+int
+sc_execv(struct syscall_args *sa)
+{
+	return sys_execv((const_userptr_t)(vaddr_t)sa->sa_arg[0],
+			 (userptr_t)(vaddr_t)sa->sa_arg[1]);
+}
+#endif
+
+static const struct syscall_desc syscalls[] = {
+	[SYS_reboot] =		{ "reboot",	"w",	sc_reboot },
+	[SYS___time] =		{ "__time",	"ww",	sc___time },
+#if OPT_SCHEDSTATS
+	[SYS___schedstats] =	{ "__schedstats", "ww",	sc___schedstats },
+#endif
+#if OPT_SYSCALLSTATS
+	[SYS___syscallstats] =	{ "__syscallstats", "ww", sc___syscallstats },
+#endif
+#ifdef UW
+	[SYS_write] =		{ "write",	"www",	sc_write },
+	[SYS__exit] =		{ "_exit",	"w",	sc__exit },
+	[SYS_getpid] =		{ "getpid",	"",	sc_getpid },
+	[SYS_waitpid] =		{ "waitpid",	"www",	sc_waitpid },
+#endif
+#if OPT_FDTABLE
+	[SYS_open] =		{ "open",	"www",	sc_open },
+	[SYS_read] =		{ "read",	"www",	sc_read },
+	[SYS_readv] =		{ "readv",	"www",	sc_readv },
+	[SYS_writev] =		{ "writev",	"www",	sc_writev },
+	[SYS_pread] =		{ "pread",	"wwwd",	sc_pread },
+	[SYS_pwrite] =		{ "pwrite",	"wwwd",	sc_pwrite },
+	[SYS_lseek] =		{ "lseek",	"wdw",	sc_lseek },
+	[SYS_close] =		{ "close",	"w",	sc_close },
+	[SYS_dup2] =		{ "dup2",	"ww",	sc_dup2 },
+	[SYS_fsync] =		{ "fsync",	"w",	sc_fsync },
+	[SYS_sendfile] =	{ "sendfile",	"wwww",	sc_sendfile },
+#if OPT_MMAP
+	[SYS_mmap] =		{ "mmap",	"wwwwwd", sc_mmap },
+	[SYS_munmap] =		{ "munmap",	"ww",	sc_munmap },
+#endif
+#if OPT_AIO
+	[SYS_aio_submit] =	{ "aio_submit",	"ww",	sc_aio_submit },
+	[SYS_aio_reap] =	{ "aio_reap",	"www",	sc_aio_reap },
+#endif
+#endif
+#if OPT_A2
+	[SYS_fork] =		{ "fork",	"",	sc_fork },
+	[SYS_execv] =		{ "execv",	"ww",	sc_execv },
+#endif
+};
+
+#define NSYSCALLS (sizeof(syscalls) / sizeof(syscalls[0]))
+
+/*
+ * Look up a call number; returns NULL if there's no such call.
+ */
+static
+const struct syscall_desc *
+syscall_lookup(int callno)
+{
+	if (callno < 0 || (unsigned)callno >= NSYSCALLS ||
+	    syscalls[callno].sd_handler == NULL) {
+		return NULL;
+	}
+	return &syscalls[callno];
+}
+
+/*
+ * Fetch the arguments described by DESC into ARGS. Arguments go in
+ * 32-bit slots, with 64-bit ones in an aligned pair (high word
+ * first); slots 0-3 are a0-a3 and the rest are on the stack at
+ * sp+16, where we fetch them with one copyin.
+ */
+static
+int
+syscall_getargs(struct trapframe *tf, const char *desc, uint64_t *args)
+{
+	uint32_t words[SYSCALL_MAXWORDS];
+	unsigned slot, i;
+	int result;
+
+	/* Work out how many slots there are. */
+	slot = 0;
+	for (i=0; desc[i] != 0; i++) {
+		if (desc[i] == 'd') {
+			slot = (slot + 1) & ~1U;
+			slot++;
+		}
+		slot++;
+	}
+	KASSERT(i <= SYSCALL_MAXARGS);
+	KASSERT(slot <= SYSCALL_MAXWORDS);
+
+	words[0] = tf->tf_a0;
+	words[1] = tf->tf_a1;
+	words[2] = tf->tf_a2;
+	words[3] = tf->tf_a3;
+	if (slot > 4) {
+		result = copyin((const_userptr_t)(tf->tf_sp + 16), &words[4],
+				(slot - 4) * sizeof(words[0]));
+		if (result) {
+			return result;
+		}
+	}
+
+	slot = 0;
+	for (i=0; desc[i] != 0; i++) {
+		if (desc[i] == 'd') {
+			slot = (slot + 1) & ~1U;
+			join32to64(words[slot], words[slot+1], &args[i]);
+			slot += 2;
+		}
+		else {
+			args[i] = words[slot];
+			slot++;
+		}
+	}
+	return 0;
+}
+
+#if OPT_SYSCALLSTATS
+/*
+ * Per-syscall statistics. Calls that don't return (_exit, and execv
+ * when it succeeds) aren't counted.
+ */
+static struct syscallstat syscall_stats[NSYSCALLS];
+static struct spinlock syscall_statslock = SPINLOCK_INITIALIZER;
+
+static
+void
+syscall_record(int callno, int err, uint64_t nsecs)
+{
+	struct syscallstat *st = &syscall_stats[callno];
+
+	spinlock_acquire(&syscall_statslock);
+	st->sc_count++;
+	if (err) {
+		st->sc_errors++;
+	}
+	st->sc_lattotal += nsecs;
+	if (nsecs > st->sc_latmax) {
+		st->sc_latmax = nsecs;
+	}
+	spinlock_release(&syscall_statslock);
+}
+
+/*
+ * Copy out the statistics for one call number. Returns the number
+ * of call numbers, so userlevel can iterate over all of them.
+ */
+int
+syscall_getstats(int callno, struct syscallstat *st, unsigned *ncalls)
+{
+	if (callno < 0 || (unsigned)callno >= NSYSCALLS) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&syscall_statslock);
+	*st = syscall_stats[callno];
+	spinlock_release(&syscall_statslock);
+
+	*ncalls = NSYSCALLS;
+	return 0;
+}
+
+void
+syscall_resetstats(void)
+{
+	spinlock_acquire(&syscall_statslock);
+	bzero(syscall_stats, sizeof(syscall_stats));
+	spinlock_release(&syscall_statslock);
+}
+
+/*
+ * Print the statistics for every call that's been made.
+ */
+void
+syscall_printstats(void)
+{
+	struct syscallstat st;
+	unsigned i, n;
+
+	kprintf("%-16s %8s %8s %10s %10s\n", "syscall", "calls", "errors",
+		"avg (us)", "max (us)");
+	for (i=0; syscall_getstats(i, &st, &n) == 0; i++) {
+		if (st.sc_count == 0) {
+			continue;
+		}
+		kprintf("%-16s %8u %8u %10llu %10llu\n",
+			syscalls[i].sd_name, st.sc_count, st.sc_errors,
+			st.sc_lattotal / st.sc_count / 1000,
+			st.sc_latmax / 1000);
+	}
+}
+#endif
+
 void
 syscall(struct trapframe *tf)
 {
 	int callno;
-	int32_t retval;
+	const struct syscall_desc *sd;
+	struct syscall_args sa;
 	int err;
+#if OPT_SYSCALLSTATS
+	uint64_t start;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -98,55 +549,26 @@ syscall(struct trapframe *tf)
 	 * like write.
 	 */
 
-	retval = 0;
-
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
+	sa.sa_tf = tf;
+	sa.sa_retval = 0;
+	sa.sa_ret64 = false;
 
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-#ifdef UW
-	case SYS_write:
-	  err = sys_write((int)tf->tf_a0,
-			  (userptr_t)tf->tf_a1,
-			  (int)tf->tf_a2,
-			  (int *)(&retval));
-	  break;
-	case SYS__exit:
-	  DEBUG(DB_SYSCALL,"syscall: _exit()\n");
-	  sys__exit((int)tf->tf_a0);
-	  /* sys__exit does not return, execution should not get here */
-	  panic("unexpected return from sys__exit");
-	  break;
-	case SYS_getpid:
-	  err = sys_getpid((pid_t *)&retval);
-	  break;
-	case SYS_waitpid:
-	  err = sys_waitpid((pid_t)tf->tf_a0,
-			    (userptr_t)tf->tf_a1,
-			    (int)tf->tf_a2,
-			    (pid_t *)&retval);
-	  break;
-#endif // UW
-
-	    /* Add stuff here */
-#if OPT_A2
-	case SYS_fork:
-		err = sys_fork(tf, (pid_t *)&retval);
-		break;
-	case SYS_execv:
-		err = sys_execv((const_userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
-		break;
+	sd = syscall_lookup(callno);
+	if (sd == NULL) {
+		kprintf("Unknown syscall %d\n", callno);
+		err = ENOSYS;
+	}
+	else {
+#if OPT_SYSCALLSTATS
+		start = gettime_nsecs();
+#endif
+		err = syscall_getargs(tf, sd->sd_args, sa.sa_arg);
+		if (!err) {
+			err = sd->sd_handler(&sa);
+		}
+#if OPT_SYSCALLSTATS
+		syscall_record(callno, err, gettime_nsecs() - start);
 #endif
-	
-	default:
-	  kprintf("Unknown syscall %d\n", callno);
-	  err = ENOSYS;
-	  break;
 	}
 
 
@@ -159,9 +581,14 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+	else if (sa.sa_ret64) {
+		/* Success, with a 64-bit value in v0/v1. */
+		split64to32(sa.sa_retval64, &tf->tf_v0, &tf->tf_v1);
+		tf->tf_a3 = 0;      /* signal no error */
+	}
 	else {
 		/* Success. */
-		tf->tf_v0 = retval;
+		tf->tf_v0 = sa.sa_retval;
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 	
@@ -39,6 +39,10 @@
 #include <vm.h>
  #include <syscall.h>
 #include "opt-A3.h"
+#include "opt-mmap.h"
+#if OPT_MMAP
+#include <mmap.h>
+#endif
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground. You should replace all of this
@@ -190,6 +194,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
+#if OPT_MMAP
+	/* Pages of mmap()ed files are handled separately. */
+	int result;
+	if (mmap_fault(as, faulttype, faultaddress, &result)) {
+		return result;
+	}
+#endif
+
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 	    if (as->isLoaded)
@@ -366,7 +378,7 @@ void releasepages(paddr_t paddr)
 	KASSERT(coremap[i]->block_len != -1);
 	
 	for (j = 0; j < coremap[i]->block_len; j++) {
-		coremap[j]->used = 0;
+		coremap[i + j]->used = 0;
 	}
 	
 	coremap[i]->block_len = -1;
@@ -472,7 +484,7 @@ static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
 {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	fastzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
 int
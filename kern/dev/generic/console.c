@@ -48,6 +48,13 @@
  *
  * Note that we have no input buffering; characters typed too rapidly
  * will be lost.
+ *
+ * Output, on the other hand, is buffered: putch and console writes
+ * copy into a ring buffer (see <generic/console.h>) that the
+ * device's write-done interrupt drains, and return without waiting
+ * unless the buffer is full. Before printing by polling we drain the
+ * buffer first, so output stays in order and nothing queued is lost
+ * at shutdown or in a panic.
  */
 
 #include <types.h>
@@ -57,6 +64,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -122,6 +130,38 @@ putch_polled(struct con_softc *cs, int ch)
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
+/*
+ * Send everything still in the output buffer by polling.
+ *
+ * If the buffer lock is already ours we've come here from a panic
+ * inside the buffer code, so leave the buffer alone. If a character
+ * is in flight the device's interrupt is still pending and con_start
+ * will find the buffer empty.
+ */
+static
+void
+drain_polled(struct con_softc *cs)
+{
+	bool drained = false;
+
+	if (spinlock_do_i_hold(&cs->cs_outlock)) {
+		return;
+	}
+	spinlock_acquire(&cs->cs_outlock);
+	while (cs->cs_outcount > 0) {
+		drained = true;
+		cs->cs_sendpolled(cs->cs_devdata,
+				  cs->cs_outbuf[cs->cs_outtail]);
+		cs->cs_outtail = (cs->cs_outtail + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		cs->cs_outcount--;
+	}
+	spinlock_release(&cs->cs_outlock);
+	if (drained) {
+		wchan_wakeall(cs->cs_outwchan);
+	}
+}
+
 static
 void
 putch_prepare_polled(struct con_softc *cs)
@@ -129,6 +169,7 @@ putch_prepare_polled(struct con_softc *cs)
 	if (cs->cs_startpolling != NULL) {
 		cs->cs_startpolling(cs->cs_devdata);
 	}
+	drain_polled(cs);
 }
 
 static
@@ -143,14 +184,77 @@ putch_complete_polled(struct con_softc *cs)
 //////////////////////////////////////////////////
 
 /*
- * Print a character, using interrupts to wait for I/O completion.
+ * Start sending the next buffered character, if there is one.
+ * Called with cs_outlock held.
  */
 static
 void
-putch_intr(struct con_softc *cs, int ch)
+con_sendnext(struct con_softc *cs)
 {
-	P(cs->cs_wsem);
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	if (cs->cs_outcount == 0) {
+		cs->cs_outbusy = false;
+		return;
+	}
+	ch = cs->cs_outbuf[cs->cs_outtail];
+	cs->cs_outtail = (cs->cs_outtail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outcount--;
+	cs->cs_outbusy = true;
 	cs->cs_send(cs->cs_devdata, ch);
+
+	if (cs->cs_outcount == CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		/* writers sleep only when it's full; let them refill */
+		wchan_wakeall(cs->cs_outwchan);
+	}
+}
+
+/*
+ * Queue LEN characters for output, using interrupts to send them.
+ * Waits only if the buffer fills up. As long as there's room, the
+ * characters go in together and won't be interleaved with anyone
+ * else's.
+ */
+static
+void
+con_output(struct con_softc *cs, const char *data, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		while (cs->cs_outcount == CONSOLE_OUTPUT_BUFFER_SIZE) {
+			if (!cs->cs_outbusy) {
+				con_sendnext(cs);
+			}
+			wchan_lock(cs->cs_outwchan);
+			spinlock_release(&cs->cs_outlock);
+			wchan_sleep(cs->cs_outwchan);
+			spinlock_acquire(&cs->cs_outlock);
+		}
+		cs->cs_outbuf[cs->cs_outhead] = data[i];
+		cs->cs_outhead = (cs->cs_outhead + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		cs->cs_outcount++;
+	}
+	if (!cs->cs_outbusy) {
+		con_sendnext(cs);
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
+/*
+ * Print a character, using interrupts to send it.
+ */
+static
+void
+putch_intr(struct con_softc *cs, int ch)
+{
+	char c = ch;
+
+	con_output(cs, &c, 1);
 }
 
 /*
@@ -204,7 +308,9 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	con_sendnext(cs);
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -298,6 +404,43 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * Copy a user write into the output buffer, CON_WRITECHUNK bytes at
+ * a time, adding a \r before each \n. The write lock is held across
+ * the whole write, so writes don't interleave with each other.
+ */
+#define CON_WRITECHUNK 128
+
+static
+int
+con_write(struct con_softc *cs, struct uio *uio)
+{
+	char in[CON_WRITECHUNK];
+	char out[2 * CON_WRITECHUNK];
+	size_t len, i, n;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(in)) {
+			len = sizeof(in);
+		}
+		result = uiomove(in, len, uio);
+		if (result) {
+			return result;
+		}
+		n = 0;
+		for (i=0; i<len; i++) {
+			if (in[i] == '\n') {
+				out[n++] = '\r';
+			}
+			out[n++] = in[i];
+		}
+		con_output(cs, out, n);
+	}
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
@@ -306,8 +449,6 @@ con_io(struct device *dev, struct uio *uio)
 	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -318,31 +459,24 @@ con_io(struct device *dev, struct uio *uio)
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
+	if (uio->uio_rw==UIO_WRITE) {
+		result = con_write(dev->d_data, uio);
+		lock_release(lk);
+		return result;
+	}
+
 	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
+		ch = getch();
+		if (ch=='\r') {
+			ch = '\n';
 		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+		result = uiomove(&ch, 1, uio);
+		if (result) {
+			lock_release(lk);
+			return result;
+		}
+		if (ch=='\n') {
+			break;
 		}
 	}
 	lock_release(lk);
@@ -398,7 +532,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -418,29 +553,34 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outwchan = wwc;
+	cs->cs_outbusy = false;
+	cs->cs_outhead = 0;
+	cs->cs_outtail = 0;
+	cs->cs_outcount = 0;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -35,9 +35,18 @@
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output is queued in cs_outbuf and sent a character at a time from
+ * the device's write-done interrupt (con_start), so writers only
+ * wait for the device when the buffer is full. cs_outbusy is true
+ * while the device has a character in flight; when it's false the
+ * buffer is empty. The output fields are protected by cs_outlock.
  */
 
+#include <spinlock.h>
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -49,10 +58,17 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	struct spinlock cs_outlock;
+	struct wchan *cs_outwchan;	/* writers waiting for room */
+	bool cs_outbusy;		/* device is sending a char */
+	unsigned char cs_outbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outhead;		/* next slot to put a char in */
+	unsigned cs_outtail;		/* next slot to take a char out */
+	unsigned cs_outcount;		/* chars in cs_outbuf */
 };
 
 /*
@@ -48,6 +48,7 @@
 #include <array.h>
 #include <uio.h>
 #include <synch.h>
+#include <clock.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -170,6 +171,50 @@ emu_waitdone(struct emu_softc *sc)
 	return translate_err(sc, sc->e_result);
 }
 
+/*
+ * Get the use of the device: take e_lock, and wait for whoever left
+ * an operation running with emu_leavedev to come back for it.
+ */
+static
+void
+emu_getdev(struct emu_softc *sc)
+{
+	lock_acquire(sc->e_lock);
+	while (sc->e_busy) {
+		cv_wait(sc->e_cv, sc->e_lock);
+	}
+}
+
+/*
+ * Leave the operation just started running and drop e_lock, so the
+ * caller can copy to or from its uio (which may fault and sleep)
+ * meanwhile. Nobody else issues commands or touches e_iobuf until
+ * the caller comes back with emu_returndev.
+ */
+static
+void
+emu_leavedev(struct emu_softc *sc)
+{
+	KASSERT(lock_do_i_hold(sc->e_lock));
+	KASSERT(!sc->e_busy);
+	sc->e_busy = true;
+	lock_release(sc->e_lock);
+}
+
+/*
+ * Come back for an operation left running with emu_leavedev. Returns
+ * with e_lock held, ready to collect the result.
+ */
+static
+void
+emu_returndev(struct emu_softc *sc)
+{
+	lock_acquire(sc->e_lock);
+	KASSERT(sc->e_busy);
+	sc->e_busy = false;
+	cv_broadcast(sc->e_cv, sc->e_lock);
+}
+
 /*
  * Common file open routine (for both VOP_LOOKUP and VOP_CREATE).  Not
  * for VOP_OPEN. At the hardware level, we need to "open" files in
@@ -202,7 +247,7 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	/* mode isn't supported (yet?) */
 	(void)mode;
 
-	lock_acquire(sc->e_lock);
+	emu_getdev(sc);
 
 	strcpy(sc->e_iobuf, name);
 	emu_wreg(sc, REG_IOLEN, strlen(name));
@@ -234,7 +279,7 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 
 	mine = lock_do_i_hold(sc->e_lock);
 	if (!mine) {
-		lock_acquire(sc->e_lock);
+		emu_getdev(sc);
 	}
 
 	while (1) {
@@ -260,23 +305,23 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 }
 
 /*
- * Common code for read and readdir.
+ * Read a directory entry from a hardware-level file handle.
  */
 static
 int
-emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	   uint32_t op, struct uio *uio)
+emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	    struct uio *uio)
 {
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
 
-	lock_acquire(sc->e_lock);
+	emu_getdev(sc);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
-	emu_wreg(sc, REG_OPER, op);
+	emu_wreg(sc, REG_OPER, EMU_OP_READDIR);
 	result = emu_waitdone(sc);
 	if (result) {
 		goto out;
@@ -292,56 +337,67 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 }
 
 /*
- * Read from a hardware-level file handle.
+ * File reads and writes are split in two so that the caller can do
+ * something else (copy the previous chunk to or from the uio) while
+ * the device works. The caller holds the device, with emu_getdev or
+ * emu_returndev, for emu_startread and emu_startwrite and again for
+ * the matching emu_finishread or emu_waitdone, and uses emu_leavedev
+ * to let go of e_lock in between.
  */
-static
-int
-emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	 struct uio *uio)
-{
-	return emu_doread(sc, handle, len, EMU_OP_READ, uio);
-}
 
 /*
- * Read a directory entry from a hardware-level file handle.
+ * Start reading LEN bytes at POS from a hardware-level file handle.
  */
 static
-int
-emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	    struct uio *uio)
+void
+emu_startread(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	      off_t pos)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio);
+	KASSERT(lock_do_i_hold(sc->e_lock));
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, len);
+	emu_wreg(sc, REG_OFFSET, pos);
+	emu_wreg(sc, REG_OPER, EMU_OP_READ);
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Wait for a read to finish and copy the data to BUF. Hands back
+ * the amount read, which is 0 at EOF.
  */
 static
 int
-emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	  struct uio *uio)
+emu_finishread(struct emu_softc *sc, void *buf, uint32_t *len)
 {
 	int result;
 
-	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(lock_do_i_hold(sc->e_lock));
 
-	lock_acquire(sc->e_lock);
-
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
-
-	result = uiomove(sc->e_iobuf, len, uio);
+	result = emu_waitdone(sc);
 	if (result) {
-		goto out;
+		return result;
 	}
+	*len = emu_rreg(sc, REG_IOLEN);
+	memcpy(buf, sc->e_iobuf, *len);
+	return 0;
+}
 
-	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
-	result = emu_waitdone(sc);
+/*
+ * Start writing LEN bytes from BUF at POS in a hardware-level file
+ * handle. Finish with emu_waitdone.
+ */
+static
+void
+emu_startwrite(struct emu_softc *sc, uint32_t handle, const void *buf,
+	       uint32_t len, off_t pos)
+{
+	KASSERT(lock_do_i_hold(sc->e_lock));
 
- out:
-	lock_release(sc->e_lock);
-	return result;
+	memcpy(sc->e_iobuf, buf, len);
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, len);
+	emu_wreg(sc, REG_OFFSET, pos);
+	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
 }
 
 /*
@@ -353,7 +409,7 @@ emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 {
 	int result;
 
-	lock_acquire(sc->e_lock);
+	emu_getdev(sc);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_OPER, EMU_OP_GETSIZE);
@@ -375,7 +431,7 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 {
 	int result;
 
-	lock_acquire(sc->e_lock);
+	emu_getdev(sc);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
@@ -389,6 +445,141 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Caches
+//
+// File sizes and looked-up names are cached so that repeated stats
+// and opens of the same host files don't go to the device. Our own
+// writes and truncates keep cached sizes up to date, and emufs can't
+// remove or rename, so nothing we do makes a cached name wrong. The
+// host can change files behind our back, though; if that matters, set
+// EMUFS_CACHE_TTL to the number of seconds to trust cached data.
+//
+
+#define EMUFS_CACHE_TTL		0	/* 0: never expire */
+
+static
+time_t
+emufs_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return secs;
+}
+
+static
+bool
+emufs_fresh(time_t when)
+{
+	return EMUFS_CACHE_TTL == 0 || emufs_now() - when < EMUFS_CACHE_TTL;
+}
+
+static
+unsigned
+emufs_nchash(struct emufs_vnode *dir, const char *name)
+{
+	uint32_t h = dir->ev_handle;
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % EMUFS_NCSIZE;
+}
+
+/*
+ * Look up NAME in DIR in the name cache. On a hit, hands back a new
+ * reference to the vnode.
+ */
+static
+bool
+emufs_ncache_lookup(struct emufs_fs *ef, struct emufs_vnode *dir,
+		    const char *name, struct emufs_vnode **ret)
+{
+	struct emufs_ncentry *nc;
+	bool found = false;
+
+	if (strlen(name) >= EMUFS_NCNAMELEN) {
+		return false;
+	}
+	nc = &ef->ef_ncache[emufs_nchash(dir, name)];
+
+	spinlock_acquire(&ef->ef_nclock);
+	if (nc->nc_dir == dir && !strcmp(nc->nc_name, name) &&
+	    emufs_fresh(nc->nc_time)) {
+		VOP_INCREF(&nc->nc_vn->ev_v);
+		*ret = nc->nc_vn;
+		found = true;
+	}
+	spinlock_release(&ef->ef_nclock);
+	return found;
+}
+
+/*
+ * Record that NAME in DIR is VN, replacing whatever was in its slot.
+ */
+static
+void
+emufs_ncache_enter(struct emufs_fs *ef, struct emufs_vnode *dir,
+		   const char *name, struct emufs_vnode *vn)
+{
+	struct emufs_ncentry *nc;
+	struct emufs_vnode *olddir, *oldvn;
+
+	if (strlen(name) >= EMUFS_NCNAMELEN) {
+		return;
+	}
+	nc = &ef->ef_ncache[emufs_nchash(dir, name)];
+
+	VOP_INCREF(&dir->ev_v);
+	VOP_INCREF(&vn->ev_v);
+
+	spinlock_acquire(&ef->ef_nclock);
+	olddir = nc->nc_dir;
+	oldvn = nc->nc_vn;
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+	nc->nc_time = emufs_now();
+	spinlock_release(&ef->ef_nclock);
+
+	/* This may reclaim them, so not while holding the spinlock */
+	if (olddir != NULL) {
+		VOP_DECREF(&olddir->ev_v);
+		VOP_DECREF(&oldvn->ev_v);
+	}
+}
+
+/*
+ * Get the size of a file, from the cache if possible. Caller holds
+ * ev_lock.
+ */
+static
+int
+emufs_getsize(struct emufs_vnode *ev, off_t *ret)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	if (!ev->ev_sizevalid || !emufs_fresh(ev->ev_sizetime)) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle, &ev->ev_size);
+		if (result) {
+			ev->ev_sizevalid = false;
+			return result;
+		}
+		ev->ev_sizevalid = true;
+		ev->ev_sizetime = emufs_now();
+	}
+	*ret = ev->ev_size;
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
 ////////////////////////////////////////////////////////////
 //
 // vnode functions 
@@ -468,91 +659,147 @@ emufs_reclaim(struct vnode *v)
 {
 	struct emufs_vnode *ev = v->vn_data;
 	struct emufs_fs *ef = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct emufs_vnode **evp;
 	int result;
 
 	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
+	 * e_lock protects the device and the vnode table, so holding
+	 * it keeps emufs_loadvnode from finding the vnode while we
+	 * decide whether to get rid of it.
 	 */
+	emu_getdev(ef->ef_emu);
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
-
-	if (ev->ev_v.vn_refcount != 1) {
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. If so, consume the
+	 * reference VOP_DECREF gave us.
+	 */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
-	num = vnodearray_num(ef->ef_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *vx;
-
-		vx = vnodearray_get(ef->ef_vnodes, i);
-		if (vx == v) {
-			ix = i;
-			break;
+	evp = &ef->ef_vnhash[ev->ev_handle % EMUFS_VNHASHSIZE];
+	while (*evp != ev) {
+		if (*evp == NULL) {
+			panic("emu%d: reclaim vnode %u not in vnode pool\n",
+			      ef->ef_emu->e_unit, ev->ev_handle);
 		}
+		evp = &(*evp)->ev_hashnext;
 	}
-	if (ix == num) {
-		panic("emu%d: reclaim vnode %u not in vnode pool\n",
-		      ef->ef_emu->e_unit, ev->ev_handle);
-	}
-
-	vnodearray_remove(ef->ef_vnodes, ix);
+	*evp = ev->ev_hashnext;
 	VOP_CLEANUP(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
+	lock_destroy(ev->ev_lock);
+	kfree(ev->ev_rabuf);
 	kfree(ev);
 	return 0;
 }
 
 /*
  * VOP_READ
+ *
+ * The device is always asked for a whole EMU_MAXIO chunk, which goes
+ * into the vnode's read cache, so a run of small sequential reads
+ * costs one device operation per chunk. When a read needs more than
+ * the chunk it just got, we start the device fetching the next chunk
+ * before copying this one out to the caller.
  */
 static
 int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	struct emu_softc *sc = ev->ev_emu;
+	off_t nextpos = 0;
+	uint32_t len, amt;
+	bool busy = false;	/* we have a read of NEXTPOS in progress */
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+	lock_acquire(ev->ev_lock);
+
+	if (ev->ev_rabuf == NULL) {
+		ev->ev_rabuf = kmalloc(EMU_MAXIO);
+		if (ev->ev_rabuf == NULL) {
+			lock_release(ev->ev_lock);
+			return ENOMEM;
 		}
+		ev->ev_ralen = 0;
+	}
 
-		oldresid = uio->uio_resid;
+	while (uio->uio_resid > 0) {
+		if (uio->uio_offset < ev->ev_raoff ||
+		    uio->uio_offset >= ev->ev_raoff + ev->ev_ralen) {
+			/* Not cached; get (or collect) the next chunk. */
+			if (busy) {
+				emu_returndev(sc);
+				busy = false;
+			}
+			else {
+				emu_getdev(sc);
+				nextpos = uio->uio_offset;
+				emu_startread(sc, ev->ev_handle, EMU_MAXIO,
+					      nextpos);
+			}
+			KASSERT(nextpos == uio->uio_offset);
+
+			ev->ev_ralen = 0;
+			result = emu_finishread(sc, ev->ev_rabuf, &len);
+			if (result || len == 0) {
+				lock_release(sc->e_lock);
+				break;
+			}
+			ev->ev_raoff = nextpos;
+			ev->ev_ralen = len;
+
+			if (len == EMU_MAXIO && uio->uio_resid > len) {
+				/* Keep the device busy while we copy. */
+				nextpos += len;
+				emu_startread(sc, ev->ev_handle, EMU_MAXIO,
+					      nextpos);
+				emu_leavedev(sc);
+				busy = true;
+			}
+			else {
+				lock_release(sc->e_lock);
+			}
+		}
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
-		if (result) {
-			return result;
+		amt = ev->ev_raoff + ev->ev_ralen - uio->uio_offset;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
 		}
-		
-		if (uio->uio_resid == oldresid) {
-			/* nothing read - EOF */
+		result = uiomove(ev->ev_rabuf +
+				 (uio->uio_offset - ev->ev_raoff), amt, uio);
+		if (result) {
 			break;
 		}
 	}
 
-	return 0;
+	if (busy) {
+		/* Gave up early; the chunk in progress is unwanted. */
+		emu_returndev(sc);
+		(void)emu_waitdone(sc);
+		lock_release(sc->e_lock);
+	}
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -575,40 +822,123 @@ emufs_getdirentry(struct vnode *v, struct uio *uio)
 	return emu_readdir(ev->ev_emu, ev->ev_handle, amt, uio);
 }
 
+/*
+ * Undo a uiomove that stayed within one iovec, given copies of the
+ * uio and that iovec from before it.
+ */
+static
+void
+emufs_uiorewind(struct uio *uio, const struct uio *saveuio,
+		const struct iovec *saveiov)
+{
+	*uio = *saveuio;
+	*uio->uio_iov = *saveiov;
+}
+
 /*
  * VOP_WRITE
+ *
+ * Each chunk is copied in from the caller (into the read cache
+ * buffer, which a write invalidates anyway) while the device is
+ * writing the previous one. A chunk never spans iovecs, so if the
+ * device fails a write the uio can be wound back to the start of
+ * that chunk from a copy of one iovec.
  */
 static
 int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emu_softc *sc = ev->ev_emu;
+	struct iovec saveiov, prevsaveiov;
+	struct uio saveuio, prevsaveuio;
 	uint32_t amt;
-	size_t oldresid;
-	int result;
+	off_t pos;
+	bool busy = false;	/* we have a write in progress */
+	int result = 0, devresult;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	lock_acquire(ev->ev_lock);
+
+	ev->ev_ralen = 0;
+	if (ev->ev_rabuf == NULL) {
+		ev->ev_rabuf = kmalloc(EMU_MAXIO);
+		if (ev->ev_rabuf == NULL) {
+			lock_release(ev->ev_lock);
+			return ENOMEM;
+		}
+	}
+
 	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
+		while (uio->uio_iov->iov_len == 0) {
+			KASSERT(uio->uio_iovcnt > 1);
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+		amt = uio->uio_iov->iov_len;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
 		if (amt > EMU_MAXIO) {
 			amt = EMU_MAXIO;
 		}
+		pos = uio->uio_offset;
 
-		oldresid = uio->uio_resid;
-
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
+		saveuio = *uio;
+		saveiov = *uio->uio_iov;
+		result = uiomove(ev->ev_rabuf, amt, uio);
 		if (result) {
-			return result;
+			/* None of this chunk gets written. */
+			emufs_uiorewind(uio, &saveuio, &saveiov);
 		}
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
+		if (busy) {
+			emu_returndev(sc);
+			busy = false;
+			devresult = emu_waitdone(sc);
+			if (devresult) {
+				/* That chunk failed; this one didn't happen. */
+				emufs_uiorewind(uio, &saveuio, &saveiov);
+				emufs_uiorewind(uio, &prevsaveuio,
+						&prevsaveiov);
+				result = devresult;
+			}
+		}
+		else {
+			emu_getdev(sc);
+		}
+		if (result) {
+			lock_release(sc->e_lock);
 			break;
 		}
+
+		emu_startwrite(sc, ev->ev_handle, ev->ev_rabuf, amt, pos);
+		emu_leavedev(sc);
+		busy = true;
+		prevsaveuio = saveuio;
+		prevsaveiov = saveiov;
+	}
+
+	if (busy) {
+		emu_returndev(sc);
+		result = emu_waitdone(sc);
+		if (result) {
+			emufs_uiorewind(uio, &prevsaveuio, &prevsaveiov);
+		}
+		lock_release(sc->e_lock);
 	}
 
-	return 0;
+	/* Keep the cached size right. */
+	if (result) {
+		ev->ev_sizevalid = false;
+	}
+	else if (ev->ev_sizevalid && uio->uio_offset > ev->ev_size) {
+		ev->ev_size = uio->uio_offset;
+	}
+
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -641,7 +971,9 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
+	lock_acquire(ev->ev_lock);
+	result = emufs_getsize(ev, &statbuf->st_size);
+	lock_release(ev->ev_lock);
 	if (result) {
 		return result;
 	}
@@ -717,7 +1049,21 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	ev->ev_ralen = 0;
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result == 0) {
+		ev->ev_sizevalid = true;
+		ev->ev_size = len;
+		ev->ev_sizetime = emufs_now();
+	}
+	else {
+		ev->ev_sizevalid = false;
+	}
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -765,6 +1111,11 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
+	if (emufs_ncache_lookup(ef, ev, pathname, &newguy)) {
+		*ret = &newguy->ev_v;
+		return 0;
+	}
+
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
 	if (result) {
@@ -776,6 +1127,7 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 		emu_close(ev->ev_emu, handle);
 		return result;
 	}
+	emufs_ncache_enter(ef, ev, pathname, newguy);
 
 	*ret = &newguy->ev_v;
 	return 0;
@@ -836,14 +1188,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP - files can be mapped; the pages go through VOP_READ and
+ * VOP_WRITE.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -1148,25 +1501,20 @@ int
 emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		struct emufs_vnode **ret)
 {
-	struct vnode *v;
 	struct emufs_vnode *ev;
-	unsigned i, num;
+	unsigned bucket;
 	int result;
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	emu_getdev(ef->ef_emu);
 
-	num = vnodearray_num(ef->ef_vnodes);
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(ef->ef_vnodes, i);
-		ev = v->vn_data;
+	bucket = handle % EMUFS_VNHASHSIZE;
+	for (ev = ef->ef_vnhash[bucket]; ev != NULL; ev = ev->ev_hashnext) {
 		if (ev->ev_handle == handle) {
 			/* Found */
 
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1182,28 +1530,32 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
-
-	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
-			   &ef->ef_fs, ev);
-	if (result) {
+	ev->ev_rabuf = NULL;
+	ev->ev_raoff = 0;
+	ev->ev_ralen = 0;
+	ev->ev_sizevalid = false;
+	ev->ev_size = 0;
+	ev->ev_sizetime = 0;
+	ev->ev_lock = lock_create("emufs-vnode");
+	if (ev->ev_lock == NULL) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
-		return result;
+		return ENOMEM;
 	}
 
-	result = vnodearray_add(ef->ef_vnodes, &ev->ev_v, NULL);
+	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
+			   &ef->ef_fs, ev);
 	if (result) {
-		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
-		VOP_CLEANUP(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
 
+	ev->ev_hashnext = ef->ef_vnhash[bucket];
+	ef->ef_vnhash[bucket] = ev;
+
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
@@ -1284,6 +1636,7 @@ int
 emufs_addtovfs(struct emu_softc *sc, const char *devname)
 {
 	struct emufs_fs *ef;
+	unsigned i;
 	int result;
 
 	ef = kmalloc(sizeof(struct emufs_fs));
@@ -1299,10 +1652,13 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
-	ef->ef_vnodes = vnodearray_create();
-	if (ef->ef_vnodes == NULL) {
-		kfree(ef);
-		return ENOMEM;
+	for (i=0; i<EMUFS_VNHASHSIZE; i++) {
+		ef->ef_vnhash[i] = NULL;
+	}
+	spinlock_init(&ef->ef_nclock);
+	for (i=0; i<EMUFS_NCSIZE; i++) {
+		ef->ef_ncache[i].nc_dir = NULL;
+		ef->ef_ncache[i].nc_vn = NULL;
 	}
 
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
@@ -1344,6 +1700,15 @@ config_emu(struct emu_softc *sc, int emuno)
 		sc->e_lock = NULL;
 		return ENOMEM;
 	}
+	sc->e_busy = false;
+	sc->e_cv = cv_create("emufs-cv");
+	if (sc->e_cv == NULL) {
+		sem_destroy(sc->e_sem);
+		sc->e_sem = NULL;
+		lock_destroy(sc->e_lock);
+		sc->e_lock = NULL;
+		return ENOMEM;
+	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
 
 	snprintf(name, sizeof(name), "emu%d", emuno);
@@ -51,6 +51,10 @@ struct emu_softc {
 	struct semaphore *e_sem;
 	void *e_iobuf;
 
+	/* Protected by e_lock */
+	bool e_busy;		/* operation left running; see emu_leavedev */
+	struct cv *e_cv;	/* signalled when e_busy is cleared */
+
 	/* Written by the interrupt handler */
 	uint32_t e_result;
 };
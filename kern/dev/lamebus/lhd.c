@@ -35,7 +35,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,15 +96,217 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Tell the disk to do the current sector of the current request.
+ * Called with lh_lock held.
+ */
+static
+void
+lhd_issue(struct lhd_softc *lh)
+{
+	struct lhd_request *lr = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	if (lr->lr_write) {
+		memcpy(lh->lh_buf, lr->lr_data + lr->lr_pos * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+	lhd_wreg(lh, LHD_REG_SECT, lr->lr_sector + lr->lr_pos);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Take the next request to run off the queue, or return NULL if it's
+ * empty. We use C-LOOK: take the first request at or beyond the head
+ * position, and when there are none left in that direction, go back
+ * to the lowest-numbered one. Called with lh_lock held.
+ */
+struct lhd_request *
+lhd_queue_next(struct lhd_softc *lh)
+{
+	struct lhd_request **pp, **pick, *lr;
+
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
+
+	pick = &lh->lh_queue;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_headpos) {
+			pick = pp;
+			break;
+		}
+	}
+
+	lr = *pick;
+	*pick = lr->lr_next;
+	lr->lr_next = NULL;
+	return lr;
+}
+
+/*
+ * If the disk is idle, start the next request. Called with lh_lock
+ * held.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	if (lh->lh_cur != NULL) {
+		return;
+	}
+	lh->lh_cur = lhd_queue_next(lh);
+	if (lh->lh_cur != NULL) {
+		lhd_issue(lh);
+	}
+}
+
+/*
+ * Total length of the chain starting at LR, and its last request.
+ */
+static
+uint32_t
+lhd_chainlen(struct lhd_request *lr, struct lhd_request **last)
+{
+	uint32_t len = 0;
+
+	for (; lr->lr_merge != NULL; lr = lr->lr_merge) {
+		len += lr->lr_nsect;
+	}
+	*last = lr;
+	return len + lr->lr_nsect;
+}
+
+/*
+ * Try to tack NEW onto the end of the chain starting at LR.
+ */
+static
+bool
+lhd_backmerge(struct lhd_request *lr, struct lhd_request *new)
+{
+	struct lhd_request *last;
+	uint32_t len;
+
+	len = lhd_chainlen(lr, &last);
+	if (last->lr_write != new->lr_write ||
+	    last->lr_sector + last->lr_nsect != new->lr_sector ||
+	    len + new->lr_nsect > LHD_MAXMERGE) {
+		return false;
+	}
+	last->lr_merge = new;
+	return true;
+}
+
+/*
+ * Add a request to the queue, merging it with an adjacent one if
+ * possible. Returns true if it was merged into a request that is
+ * queued or running, which carries it along; false if it went into
+ * the queue by itself. Called with lh_lock held.
+ */
+bool
+lhd_queue_add(struct lhd_softc *lh, struct lhd_request *new)
+{
+	struct lhd_request **pp, *lr, *last;
+
+	/*
+	 * Extending the request in progress is the common case for
+	 * sequential I/O. (Sectors it has already passed are of no
+	 * concern; we only ever add to the end.)
+	 */
+	if (lh->lh_cur != NULL && lhd_backmerge(lh->lh_cur, new)) {
+		return true;
+	}
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		lr = *pp;
+		if (lhd_backmerge(lr, new)) {
+			return true;
+		}
+		if (lr->lr_write == new->lr_write &&
+		    new->lr_sector + new->lr_nsect == lr->lr_sector &&
+		    lhd_chainlen(lr, &last) + new->lr_nsect <= LHD_MAXMERGE) {
+			/* Front merge: NEW takes LR's place in the queue. */
+			new->lr_merge = lr;
+			new->lr_next = lr->lr_next;
+			lr->lr_next = NULL;
+			*pp = new;
+			return true;
+		}
+		if (lr->lr_sector > new->lr_sector) {
+			break;
+		}
+	}
+
+	/* No luck; insert in sector order. */
+	new->lr_next = *pp;
+	*pp = new;
+	return false;
+}
+
+/*
+ * Queue a request and start it if the disk is idle. Called with
+ * lh_lock held.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_request *new)
+{
+	if (!lhd_queue_add(lh, new)) {
+		lhd_start(lh);
+	}
+}
+
+/*
+ * The disk finished an operation with result ERR. Move the current
+ * request along, and when it's finished, mark it done and go on to
+ * the next one in its chain or on the queue.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *lr;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	lr = lh->lh_cur;
+	if (lr == NULL) {
+		/* Spurious; nothing was running. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (err == 0 && !lr->lr_write) {
+		memcpy(lr->lr_data + lr->lr_pos * LHD_SECTSIZE, lh->lh_buf,
+		       LHD_SECTSIZE);
+	}
+	lh->lh_headpos = lr->lr_sector + lr->lr_pos + 1;
+	lr->lr_pos++;
+
+	if (err == 0 && lr->lr_pos < lr->lr_nsect) {
+		lhd_issue(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * This request is finished. Once lr_done is set the waiting
+	 * thread may return and LR may vanish, so don't touch it
+	 * afterwards.
+	 */
+	lh->lh_cur = lr->lr_merge;
+	lr->lr_result = err;
+	lr->lr_done = true;
+
+	if (lh->lh_cur != NULL) {
+		lhd_issue(lh);
+	}
+	else {
+		lhd_start(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	wchan_wakeall(lh->lh_wchan);
 }
 
 /*
@@ -195,19 +398,25 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * The transfer is queued as one request and we sleep until the
+ * interrupt handler has done all of it. If the uio is a single kernel
+ * buffer the disk works on it directly; otherwise we go through a
+ * bounce buffer.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_request lr;
+	struct iovec *iov;
+	char *bounce = NULL;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +429,71 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == uio->uio_resid) {
+		lr.lr_data = iov->iov_kbase;
+	}
+	else {
+		bounce = kmalloc(len * LHD_SECTSIZE);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = uiomove(bounce, len * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
+				kfree(bounce);
 				return result;
 			}
 		}
+		lr.lr_data = bounce;
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	lr.lr_sector = sector;
+	lr.lr_nsect = len;
+	lr.lr_pos = 0;
+	lr.lr_write = (uio->uio_rw == UIO_WRITE);
+	lr.lr_result = 0;
+	lr.lr_done = false;
+	lr.lr_merge = NULL;
+	lr.lr_next = NULL;
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, &lr);
+	spinlock_release(&lh->lh_lock);
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	/*
+	 * Wait for it. The interrupt handler can't wake the channel
+	 * while we hold it locked, so checking lr_done under the
+	 * channel lock doesn't lose wakeups.
+	 */
+	wchan_lock(lh->lh_wchan);
+	while (!lr.lr_done) {
+		wchan_sleep(lh->lh_wchan);
+		wchan_lock(lh->lh_wchan);
+	}
+	wchan_unlock(lh->lh_wchan);
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+	result = lr.lr_result;
+	if (bounce != NULL) {
+		if (result == 0 && uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, len * LHD_SECTSIZE, uio);
 		}
+		kfree(bounce);
+	}
+	else if (result == 0) {
+		/* Account for the transfer the way uiomove would. */
+		iov->iov_kbase = (char *)iov->iov_kbase + len * LHD_SECTSIZE;
+		iov->iov_len -= len * LHD_SECTSIZE;
+		uio->uio_offset += len * LHD_SECTSIZE;
+		uio->uio_resid -= len * LHD_SECTSIZE;
 	}
 
-	return 0;
+	return result;
 }
 
 /*
@@ -289,15 +510,14 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
 
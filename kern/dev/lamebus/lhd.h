@@ -31,12 +31,41 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Requests longer than this many sectors are not extended by merging,
+ * so one long sequential transfer can't hold the disk indefinitely.
+ */
+#define LHD_MAXMERGE  128
+
+/*
+ * A transfer waiting for or undergoing service.
+ *
+ * The disk only moves one sector per operation, but the interrupt
+ * handler starts the next sector itself, so a request costs one
+ * sleep and one wakeup no matter how long it is. Requests that are
+ * contiguous with one another (same direction, adjacent sectors) are
+ * merged into a chain through lr_merge, which the interrupt handler
+ * runs back to back without going through the queue.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	uint32_t lr_pos;		/* Sectors done so far */
+	bool lr_write;			/* Direction */
+	char *lr_data;			/* Kernel buffer */
+	int lr_result;
+	volatile bool lr_done;		/* Set by the interrupt handler */
+	struct lhd_request *lr_merge;	/* Continues this request */
+	struct lhd_request *lr_next;	/* Next in the queue */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +80,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct lhd_request *lh_queue;	/* Pending requests, by sector */
+	struct lhd_request *lh_cur;	/* Request the disk is working on */
+	uint32_t lh_headpos;		/* Sector after the last one done */
+	struct wchan *lh_wchan;		/* For waiting for completion */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +92,8 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* The request queue; exposed for the lhd1 test */
+bool lhd_queue_add(struct lhd_softc *lh, struct lhd_request *new);
+struct lhd_request *lhd_queue_next(struct lhd_softc *lh);
+
 #endif /* _LAMEBUS_LHD_H_ */
@@ -0,0 +1,196 @@
+/*
+ * SFS block allocator.
+ *
+ * The freemap is divided into regions of SFS_REGIONBLOCKS blocks,
+ * and we keep a count of the free blocks in each. Looking for free
+ * space skips full regions without touching their bits, so the cost
+ * of an allocation doesn't grow as the volume fills.
+ *
+ * Allocation is goal-directed: the caller says which block it would
+ * like (normally the one after the file's previous block) and gets
+ * the first free block at or after it, wrapping around the end of
+ * the volume. This keeps a file's blocks together when there's room.
+ * sfs_alloc_extent does the same but also takes free blocks directly
+ * following the first one, for preallocation.
+ *
+ * The freemap and region counts are protected by sfs_freemaplock,
+ * which the entry points here take themselves.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <sfs.h>
+
+/*
+ * Find the first free block in [FROM, TO). The freemap is an array
+ * of bytes with block N in bit N%8 of byte N/8 (see bitmap.c).
+ */
+static
+int
+sfs_alloc_scan(struct sfs_fs *sfs, uint32_t from, uint32_t to,
+	       uint32_t *ret)
+{
+	unsigned char *bits = bitmap_getdata(sfs->sfs_freemap);
+	uint32_t i;
+
+	i = from;
+	while (i < to) {
+		if (i % CHAR_BIT == 0 && bits[i / CHAR_BIT] == 0xff) {
+			i += CHAR_BIT;
+			continue;
+		}
+		if ((bits[i / CHAR_BIT] & (1 << (i % CHAR_BIT))) == 0) {
+			*ret = i;
+			return 0;
+		}
+		i++;
+	}
+	return ENOSPC;
+}
+
+static
+void
+sfs_alloc_mark(struct sfs_fs *sfs, uint32_t block)
+{
+	bitmap_mark(sfs->sfs_freemap, block);
+	KASSERT(sfs->sfs_regionfree[block / SFS_REGIONBLOCKS] > 0);
+	sfs->sfs_regionfree[block / SFS_REGIONBLOCKS]--;
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Build the free block summary from the freemap. Called at mount
+ * time, after the freemap is loaded.
+ */
+int
+sfs_alloc_init(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t i;
+
+	sfs->sfs_nregions = DIVROUNDUP(nblocks, SFS_REGIONBLOCKS);
+	sfs->sfs_regionfree = kmalloc(sfs->sfs_nregions *
+				      sizeof(sfs->sfs_regionfree[0]));
+	if (sfs->sfs_regionfree == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_nregions; i++) {
+		sfs->sfs_regionfree[i] = 0;
+	}
+	for (i=0; i<nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_regionfree[i / SFS_REGIONBLOCKS]++;
+		}
+	}
+	return 0;
+}
+
+void
+sfs_alloc_cleanup(struct sfs_fs *sfs)
+{
+	kfree(sfs->sfs_regionfree);
+	sfs->sfs_regionfree = NULL;
+}
+
+/*
+ * Find and mark the first free block at or after GOAL.
+ */
+static
+int
+sfs_alloc_find(struct sfs_fs *sfs, uint32_t goal, uint32_t *ret)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t start, end;
+	unsigned i, r;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+
+	/*
+	 * Look from the goal to the end of its region, then in each
+	 * following region, and finally at the part of the goal's
+	 * region before the goal.
+	 */
+	for (i=0; i<=sfs->sfs_nregions; i++) {
+		r = (goal / SFS_REGIONBLOCKS + i) % sfs->sfs_nregions;
+		if (sfs->sfs_regionfree[r] == 0) {
+			continue;
+		}
+		start = (i == 0) ? goal : r * SFS_REGIONBLOCKS;
+		end = (r + 1) * SFS_REGIONBLOCKS;
+		if (end > nblocks) {
+			end = nblocks;
+		}
+		if (sfs_alloc_scan(sfs, start, end, ret) == 0) {
+			sfs_alloc_mark(sfs, *ret);
+			return 0;
+		}
+	}
+	return ENOSPC;
+}
+
+/*
+ * Allocate the first free block at or after GOAL.
+ */
+int
+sfs_alloc_block(struct sfs_fs *sfs, uint32_t goal, uint32_t *ret)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_alloc_find(sfs, goal, ret);
+	lock_release(sfs->sfs_freemaplock);
+	return result;
+}
+
+/*
+ * Allocate a run of up to MAXLEN contiguous blocks, the first as
+ * close to GOAL as possible. Hands back the first block and the
+ * number actually allocated, which is at least one.
+ */
+int
+sfs_alloc_extent(struct sfs_fs *sfs, uint32_t goal, unsigned maxlen,
+		 uint32_t *start, unsigned *len)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t block;
+	unsigned n;
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_alloc_find(sfs, goal, &block);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	for (n = 1; n < maxlen && block + n < nblocks; n++) {
+		if (bitmap_isset(sfs->sfs_freemap, block + n)) {
+			break;
+		}
+		sfs_alloc_mark(sfs, block + n);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	*start = block;
+	*len = n;
+	return 0;
+}
+
+/*
+ * Free a block.
+ */
+void
+sfs_alloc_free(struct sfs_fs *sfs, uint32_t block)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs->sfs_regionfree[block / SFS_REGIONBLOCKS]++;
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+}
@@ -0,0 +1,1315 @@
+/*
+ * SFS buffer cache.
+ *
+ * One cache of SFS_BLOCKSIZE buffers is shared by all mounted SFS
+ * volumes. Buffers are found by hashing (device, block), and are
+ * recycled in least-recently-used order once the cache reaches its
+ * size limit. A buffer that is in use (refcount > 0) is never
+ * recycled; if every buffer is in use the cache temporarily grows
+ * past its limit rather than failing.
+ *
+ * A buffer is modified by getting it, changing sfs_buf_data(), and
+ * calling sfs_buf_markdirty before releasing it. Normally dirty
+ * buffers are written back when released (write-through).
+ *
+ * With "options sfswriteback" they are instead left dirty in the
+ * cache and written back later, in block order and with adjacent
+ * blocks coalesced into one device request, by:
+ *    - the flusher thread, which syncs every mounted volume every
+ *      sfs_buf_interval seconds, or sooner once the fraction of
+ *      dirty buffers reaches sfs_buf_dirtyratio percent;
+ *    - a writer that finds every buffer dirty, which flushes its own
+ *      volume rather than wait for the flusher;
+ *    - eviction of a dirty buffer, which flushes its whole volume;
+ *    - sfs_fsync, which writes back just the file's blocks, and
+ *      sfs_sync, which writes back the whole volume.
+ *
+ * With "options sfsreadahead", sfs_read queues the blocks it expects
+ * to be asked for next with sfs_buf_prefetch, and a read-ahead
+ * thread reads them into the cache in the background, coalescing
+ * adjacent blocks into one device request.
+ *
+ * The cache's lists, counters, and buffer headers are protected by
+ * sfs_buf_lock, a sleep lock that comes after all the other SFS
+ * locks. It is not held while transferring buffers to and from the
+ * disk. Instead a buffer is marked busy while it is being read in,
+ * while it is being written back, and from sfs_buf_get of a block
+ * that wasn't cached until the caller has filled it in; whoever
+ * needs it idle waits on the buffer's own condition variable. Only
+ * a lookup that needs the contents waits, and only if they aren't
+ * there yet: a hit on a buffer being written back doesn't, and
+ * neither does sfs_buf_markdirty. Whoever makes a buffer busy holds
+ * a reference to it, so a busy buffer is never recycled.
+ *
+ * The contents of a buffer in use belong to whoever holds the block
+ * it contains (normally the vnode lock of the file it's part of);
+ * the cache only looks at them to write them back. Write-back marks
+ * a buffer clean before starting, so a change made while the write
+ * is under way marks it dirty again and it is written again later.
+ * A change made before sfs_buf_markdirty is never lost.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <synch.h>
+#include <sfs.h>
+#include "opt-sfswriteback.h"
+#include "opt-sfsreadahead.h"
+
+/* Number of hash buckets; a prime spreads sequential blocks well. */
+#define SFS_BUF_NBUCKETS	127
+
+/* Default limit on the number of buffers. */
+#define SFS_BUF_DEFAULTMAX	256
+
+/* Most blocks written by one device request when flushing. */
+#define SFS_BUF_MAXCLUSTER	16
+
+/* Most blocks sfs_buf_flushblocks sorts at once. */
+#define SFS_BUF_MAXFLUSH	64
+
+/* Flusher defaults: seconds between syncs, and dirty percentage. */
+#define SFS_BUF_DEFAULTINTERVAL	5
+#define SFS_BUF_DEFAULTRATIO	25
+
+/* Blocks that can be waiting for the read-ahead thread. */
+#define SFS_BUF_RAQUEUE		64
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* volume; NULL if buffer is free */
+	struct device *b_dev;		/* device, for the hash key */
+	uint32_t b_block;		/* block number on the device */
+	unsigned b_refcount;		/* users of this buffer */
+	bool b_valid;			/* b_data holds the block contents */
+	bool b_dirty;			/* b_data needs writing back */
+	bool b_prefetched;		/* read ahead and not yet used */
+	bool b_busy;			/* being transferred or filled in */
+	struct cv *b_cv;		/* for waiting until not busy */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list; head is oldest */
+	struct sfs_buf *b_lrunext;
+	char b_data[SFS_BLOCKSIZE];
+};
+
+static struct lock *sfs_buf_lock;
+static struct sfs_buf *sfs_buf_hash[SFS_BUF_NBUCKETS];
+static struct sfs_buf *sfs_buf_lruhead;
+static struct sfs_buf *sfs_buf_lrutail;
+static unsigned sfs_buf_num;
+static unsigned sfs_buf_ndirty;
+static unsigned sfs_buf_max = SFS_BUF_DEFAULTMAX;
+
+#if OPT_SFSWRITEBACK
+static unsigned sfs_buf_interval = SFS_BUF_DEFAULTINTERVAL;
+static unsigned sfs_buf_dirtyratio = SFS_BUF_DEFAULTRATIO;
+static bool sfs_buf_flusher_running;
+#endif
+
+/* Statistics */
+static unsigned sfs_buf_hits;
+static unsigned sfs_buf_misses;
+static unsigned sfs_buf_reads;
+static unsigned sfs_buf_writes;
+static unsigned sfs_buf_evictions;
+static unsigned sfs_buf_clusters;
+
+#if OPT_SFSREADAHEAD
+/* Blocks waiting to be read ahead, as a ring. */
+struct sfs_buf_raent {
+	struct sfs_fs *ra_fs;
+	uint32_t ra_block;
+};
+static struct sfs_buf_raent sfs_buf_raqueue[SFS_BUF_RAQUEUE];
+static unsigned sfs_buf_rahead;
+static unsigned sfs_buf_ranum;
+static unsigned sfs_buf_ragen;		/* bumped by sfs_buf_racancel */
+static struct semaphore *sfs_buf_rasem;
+
+static unsigned sfs_buf_raqueued;
+static unsigned sfs_buf_radropped;
+static unsigned sfs_buf_rahits;
+static unsigned sfs_buf_rawasted;
+#endif
+
+static int sfs_buf_doflush(struct sfs_fs *sfs);
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+sfs_buf_bucket(struct device *dev, uint32_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) % SFS_BUF_NBUCKETS;
+}
+
+static
+void
+sfs_buf_hashinsert(struct sfs_buf *buf)
+{
+	unsigned b = sfs_buf_bucket(buf->b_dev, buf->b_block);
+
+	buf->b_hashnext = sfs_buf_hash[b];
+	sfs_buf_hash[b] = buf;
+}
+
+static
+void
+sfs_buf_hashremove(struct sfs_buf *buf)
+{
+	unsigned b = sfs_buf_bucket(buf->b_dev, buf->b_block);
+	struct sfs_buf **pp;
+
+	for (pp = &sfs_buf_hash[b]; *pp != NULL; pp = &(*pp)->b_hashnext) {
+		if (*pp == buf) {
+			*pp = buf->b_hashnext;
+			buf->b_hashnext = NULL;
+			return;
+		}
+	}
+	panic("sfs: buffer for block %u not in hash\n", buf->b_block);
+}
+
+static
+struct sfs_buf *
+sfs_buf_hashfind(struct device *dev, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	buf = sfs_buf_hash[sfs_buf_bucket(dev, block)];
+	for (; buf != NULL; buf = buf->b_hashnext) {
+		if (buf->b_dev == dev && buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		sfs_buf_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		sfs_buf_lrutail = buf->b_lruprev;
+	}
+	buf->b_lruprev = buf->b_lrunext = NULL;
+}
+
+/* Put BUF at the most-recently-used end. */
+static
+void
+sfs_buf_lruappend(struct sfs_buf *buf)
+{
+	buf->b_lrunext = NULL;
+	buf->b_lruprev = sfs_buf_lrutail;
+	if (sfs_buf_lrutail != NULL) {
+		sfs_buf_lrutail->b_lrunext = buf;
+	}
+	else {
+		sfs_buf_lruhead = buf;
+	}
+	sfs_buf_lrutail = buf;
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+static
+void
+sfs_buf_clean(struct sfs_buf *buf)
+{
+	if (buf->b_dirty) {
+		KASSERT(sfs_buf_ndirty > 0);
+		sfs_buf_ndirty--;
+		buf->b_dirty = false;
+	}
+}
+
+static
+void
+sfs_buf_redirty(struct sfs_buf *buf)
+{
+	if (!buf->b_dirty) {
+		buf->b_dirty = true;
+		sfs_buf_ndirty++;
+	}
+}
+
+/*
+ * Wait until BUF isn't busy. The caller holds a reference to it.
+ */
+static
+void
+sfs_buf_waitidle(struct sfs_buf *buf)
+{
+	KASSERT(lock_do_i_hold(sfs_buf_lock));
+	KASSERT(buf->b_refcount > 0);
+
+	while (buf->b_busy) {
+		cv_wait(buf->b_cv, sfs_buf_lock);
+	}
+}
+
+static
+void
+sfs_buf_unbusy(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_busy);
+	buf->b_busy = false;
+	cv_broadcast(buf->b_cv, sfs_buf_lock);
+}
+
+/*
+ * Transfer BUF to or from the disk. BUF must be busy; sfs_buf_lock
+ * is dropped for the transfer.
+ */
+static
+int
+sfs_buf_io(struct sfs_buf *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(buf->b_busy);
+
+	SFSUIO(&iov, &ku, buf->b_data, buf->b_block, rw);
+	lock_release(sfs_buf_lock);
+	result = sfs_rwblock(buf->b_fs, &ku);
+	lock_acquire(sfs_buf_lock);
+	return result;
+}
+
+/*
+ * Transfer NBUFS busy buffers for consecutive blocks of the same
+ * volume with one device request.
+ */
+static
+int
+sfs_buf_clusterio(struct sfs_buf **bufs, unsigned nbufs, enum uio_rw rw)
+{
+	struct iovec iov[SFS_BUF_MAXCLUSTER];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(nbufs > 0 && nbufs <= SFS_BUF_MAXCLUSTER);
+
+	for (i=0; i<nbufs; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_fs == bufs[0]->b_fs);
+		KASSERT(bufs[i]->b_block == bufs[0]->b_block + i);
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = nbufs;
+	ku.uio_offset = (off_t)bufs[0]->b_block * SFS_BLOCKSIZE;
+	ku.uio_resid = nbufs * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	return sfs_rwblock(bufs[0]->b_fs, &ku);
+}
+
+/*
+ * Write NBUFS dirty, idle buffers for consecutive blocks of the same
+ * volume with one device request, with sfs_buf_lock dropped for the
+ * transfer. The caller holds a reference to each. If the write fails
+ * they are left dirty.
+ */
+static
+int
+sfs_buf_writecluster(struct sfs_buf **bufs, unsigned nbufs)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<nbufs; i++) {
+		KASSERT(bufs[i]->b_refcount > 0);
+		KASSERT(bufs[i]->b_valid);
+		KASSERT(bufs[i]->b_dirty);
+		KASSERT(!bufs[i]->b_busy);
+		bufs[i]->b_busy = true;
+		sfs_buf_clean(bufs[i]);
+	}
+
+	if (nbufs == 1) {
+		result = sfs_buf_io(bufs[0], UIO_WRITE);
+	}
+	else {
+		lock_release(sfs_buf_lock);
+		result = sfs_buf_clusterio(bufs, nbufs, UIO_WRITE);
+		lock_acquire(sfs_buf_lock);
+		if (!result) {
+			sfs_buf_clusters++;
+		}
+	}
+
+	for (i=0; i<nbufs; i++) {
+		if (result) {
+			sfs_buf_redirty(bufs[i]);
+		}
+		else {
+			sfs_buf_writes++;
+		}
+		sfs_buf_unbusy(bufs[i]);
+	}
+	return result;
+}
+
+/*
+ * Write BUF back if it's dirty, first waiting out any transfer of it
+ * already under way. The caller holds a reference to it.
+ */
+static
+int
+sfs_buf_writeback(struct sfs_buf *buf)
+{
+	sfs_buf_waitidle(buf);
+	if (!buf->b_dirty) {
+		return 0;
+	}
+	return sfs_buf_writecluster(&buf, 1);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation
+
+/*
+ * Detach BUF from whatever block it holds. It must be clean and not
+ * in use. It stays on the LRU list.
+ */
+static
+void
+sfs_buf_detach(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_refcount == 0);
+	KASSERT(!buf->b_busy);
+	if (buf->b_fs == NULL) {
+		return;
+	}
+	KASSERT(!buf->b_dirty);
+	sfs_buf_hashremove(buf);
+#if OPT_SFSREADAHEAD
+	if (buf->b_prefetched) {
+		sfs_buf_rawasted++;
+	}
+#endif
+	buf->b_fs = NULL;
+	buf->b_dev = NULL;
+	buf->b_valid = false;
+	buf->b_prefetched = false;
+}
+
+/*
+ * Find a buffer to hold a new block: a free one, a new one if we're
+ * under the limit, or the least recently used one not in use. If
+ * every candidate is dirty, they are written back first, which drops
+ * sfs_buf_lock; so the caller must look for its block again after
+ * this returns.
+ */
+static
+int
+sfs_buf_alloc(struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+ again:
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_fs == NULL) {
+			*ret = buf;
+			return 0;
+		}
+	}
+
+	if (sfs_buf_num < sfs_buf_max) {
+		goto grow;
+	}
+
+	/* Prefer a clean buffer, so eviction doesn't cost a write. */
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_refcount > 0 || buf->b_dirty) {
+			continue;
+		}
+		sfs_buf_detach(buf);
+		sfs_buf_evictions++;
+		*ret = buf;
+		return 0;
+	}
+
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_refcount > 0) {
+			continue;
+		}
+#if OPT_SFSWRITEBACK
+		/*
+		 * Everything is dirty. Write back the whole volume in
+		 * one sorted pass rather than one block at a time.
+		 */
+		result = sfs_buf_doflush(buf->b_fs);
+#else
+		buf->b_refcount++;
+		result = sfs_buf_writeback(buf);
+		buf->b_refcount--;
+#endif
+		if (result) {
+			/* Can't write it back; grow rather than fail. */
+			break;
+		}
+		/* The lock was dropped, so start over. */
+		goto again;
+	}
+
+ grow:
+	buf = kmalloc(sizeof(*buf));
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	buf->b_cv = cv_create("sfs_buf");
+	if (buf->b_cv == NULL) {
+		kfree(buf);
+		return ENOMEM;
+	}
+	buf->b_fs = NULL;
+	buf->b_dev = NULL;
+	buf->b_block = 0;
+	buf->b_refcount = 0;
+	buf->b_valid = false;
+	buf->b_dirty = false;
+	buf->b_prefetched = false;
+	buf->b_busy = false;
+	buf->b_hashnext = NULL;
+	sfs_buf_lruappend(buf);
+	sfs_buf_num++;
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Free clean buffers until we're back under the limit. Dirty ones
+ * are left for the flusher.
+ */
+static
+void
+sfs_buf_shrink(void)
+{
+	struct sfs_buf *buf, *next;
+
+	for (buf = sfs_buf_lruhead;
+	     buf != NULL && sfs_buf_num > sfs_buf_max;
+	     buf = next) {
+		next = buf->b_lrunext;
+		if (buf->b_refcount > 0 || buf->b_dirty) {
+			continue;
+		}
+		sfs_buf_detach(buf);
+		sfs_buf_lruremove(buf);
+		cv_destroy(buf->b_cv);
+		kfree(buf);
+		sfs_buf_num--;
+	}
+}
+
+#if OPT_SFSREADAHEAD
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+/*
+ * Read a run of consecutive blocks that were just allocated for
+ * read-ahead (and are held and busy, so they can't be recycled or
+ * read by anyone else under us). sfs_buf_lock is dropped for the
+ * transfer; anyone who wants one of the blocks meanwhile waits for
+ * just that buffer, and everything else in the cache stays usable.
+ * On failure the buffers are just thrown away; whoever wants the
+ * blocks will read them and see the error.
+ */
+static
+void
+sfs_buf_readrun(struct sfs_buf **bufs, unsigned nbufs)
+{
+	unsigned i;
+	int result;
+
+	lock_release(sfs_buf_lock);
+	result = sfs_buf_clusterio(bufs, nbufs, UIO_READ);
+	lock_acquire(sfs_buf_lock);
+	for (i=0; i<nbufs; i++) {
+		if (result) {
+			bufs[i]->b_prefetched = false;
+		}
+		else {
+			sfs_buf_reads++;
+			bufs[i]->b_valid = true;
+		}
+		sfs_buf_unbusy(bufs[i]);
+		bufs[i]->b_refcount--;
+		if (result && bufs[i]->b_refcount == 0) {
+			sfs_buf_detach(bufs[i]);
+		}
+	}
+}
+
+/*
+ * Read in everything on the read-ahead queue that isn't already
+ * cached, in runs of adjacent blocks. The lock is dropped while
+ * each run is read, and may be while allocating, so the queue can
+ * change under us; if it is cancelled meanwhile, the entry in hand
+ * is dropped.
+ */
+static
+void
+sfs_buf_dorahead(void)
+{
+	struct sfs_buf *run[SFS_BUF_MAXCLUSTER];
+	struct sfs_buf_raent ent;
+	struct sfs_buf *buf;
+	unsigned n = 0, gen;
+
+	KASSERT(lock_do_i_hold(sfs_buf_lock));
+
+	while (sfs_buf_ranum > 0) {
+		ent = sfs_buf_raqueue[sfs_buf_rahead];
+		sfs_buf_rahead = (sfs_buf_rahead + 1) % SFS_BUF_RAQUEUE;
+		sfs_buf_ranum--;
+
+		if (sfs_buf_hashfind(ent.ra_fs->sfs_device,
+				     ent.ra_block) != NULL) {
+			continue;
+		}
+
+		if (n > 0 && (n == SFS_BUF_MAXCLUSTER ||
+			      run[0]->b_fs != ent.ra_fs ||
+			      run[n-1]->b_block + 1 != ent.ra_block)) {
+			sfs_buf_readrun(run, n);
+			n = 0;
+		}
+
+		gen = sfs_buf_ragen;
+		if (sfs_buf_alloc(&buf)) {
+			continue;
+		}
+		if (gen != sfs_buf_ragen ||
+		    sfs_buf_hashfind(ent.ra_fs->sfs_device,
+				     ent.ra_block) != NULL) {
+			/* Cancelled or read in while the lock was dropped */
+			continue;
+		}
+		buf->b_fs = ent.ra_fs;
+		buf->b_dev = ent.ra_fs->sfs_device;
+		buf->b_block = ent.ra_block;
+		buf->b_valid = false;
+		buf->b_dirty = false;
+		buf->b_prefetched = true;
+		buf->b_busy = true;
+		sfs_buf_hashinsert(buf);
+		buf->b_refcount++;
+		sfs_buf_lruremove(buf);
+		sfs_buf_lruappend(buf);
+		run[n++] = buf;
+	}
+
+	if (n > 0) {
+		sfs_buf_readrun(run, n);
+	}
+}
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+sfs_buf_raloop(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	while (1) {
+		P(sfs_buf_rasem);
+		lock_acquire(sfs_buf_lock);
+		sfs_buf_dorahead();
+		lock_release(sfs_buf_lock);
+	}
+}
+
+/*
+ * Start the read-ahead thread, if it isn't running already. Called
+ * at mount time.
+ */
+int
+sfs_buf_startreadahead(void)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_buf_rasem != NULL) {
+		return 0;
+	}
+	sfs_buf_rasem = sem_create("sfs_readahead", 0);
+	if (sfs_buf_rasem == NULL) {
+		return ENOMEM;
+	}
+	result = thread_fork("sfs_readahead", NULL, sfs_buf_raloop, NULL, 0);
+	if (result) {
+		sem_destroy(sfs_buf_rasem);
+		sfs_buf_rasem = NULL;
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Ask for BLOCKS of SFS to be read into the cache in the background.
+ * This is only a hint: blocks already cached are skipped, and if the
+ * queue is full the rest are dropped.
+ */
+void
+sfs_buf_prefetch(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n)
+{
+	struct sfs_buf_raent *ent;
+	unsigned i, queued = 0;
+
+	if (sfs_buf_rasem == NULL) {
+		return;
+	}
+
+	lock_acquire(sfs_buf_lock);
+
+	for (i=0; i<n; i++) {
+		if (sfs_buf_hashfind(sfs->sfs_device, blocks[i]) != NULL) {
+			continue;
+		}
+		if (sfs_buf_ranum == SFS_BUF_RAQUEUE) {
+			sfs_buf_radropped += n - i;
+			break;
+		}
+		ent = &sfs_buf_raqueue[(sfs_buf_rahead + sfs_buf_ranum)
+				       % SFS_BUF_RAQUEUE];
+		ent->ra_fs = sfs;
+		ent->ra_block = blocks[i];
+		sfs_buf_ranum++;
+		queued++;
+	}
+
+	if (queued > 0) {
+		sfs_buf_raqueued += queued;
+		V(sfs_buf_rasem);
+	}
+
+	lock_release(sfs_buf_lock);
+}
+
+/*
+ * Drop any queued read-ahead for SFS. Called on unmount.
+ */
+static
+void
+sfs_buf_racancel(struct sfs_fs *sfs)
+{
+	struct sfs_buf_raent *ent;
+	unsigned i, n = 0;
+
+	KASSERT(lock_do_i_hold(sfs_buf_lock));
+
+	for (i=0; i<sfs_buf_ranum; i++) {
+		ent = &sfs_buf_raqueue[(sfs_buf_rahead + i) % SFS_BUF_RAQUEUE];
+		if (ent->ra_fs == sfs) {
+			continue;
+		}
+		sfs_buf_raqueue[(sfs_buf_rahead + n) % SFS_BUF_RAQUEUE] = *ent;
+		n++;
+	}
+	sfs_buf_ranum = n;
+	sfs_buf_ragen++;
+}
+
+#endif /* OPT_SFSREADAHEAD */
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Get the buffer for BLOCK of SFS, with a reference. If DOREAD is
+ * set, its contents are read in if not already cached. Otherwise the
+ * caller promises to overwrite the whole block, and a buffer that
+ * wasn't cached comes back zero-filled and busy; it stays busy, so
+ * nobody else can read the block into it, until the caller calls
+ * sfs_buf_markdirty or releases it.
+ */
+static
+int
+sfs_buf_lookup(struct sfs_fs *sfs, uint32_t block, bool doread,
+	       struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	lock_acquire(sfs_buf_lock);
+
+ again:
+	buf = sfs_buf_hashfind(sfs->sfs_device, block);
+	if (buf != NULL) {
+		sfs_buf_hits++;
+#if OPT_SFSREADAHEAD
+		if (buf->b_prefetched) {
+			sfs_buf_rahits++;
+			buf->b_prefetched = false;
+		}
+#endif
+	}
+	else {
+		result = sfs_buf_alloc(&buf);
+		if (result) {
+			lock_release(sfs_buf_lock);
+			return result;
+		}
+		if (sfs_buf_hashfind(sfs->sfs_device, block) != NULL) {
+			/* Someone got it while the lock was dropped. */
+			goto again;
+		}
+		sfs_buf_misses++;
+		buf->b_fs = sfs;
+		buf->b_dev = sfs->sfs_device;
+		buf->b_block = block;
+		buf->b_valid = false;
+		buf->b_dirty = false;
+		sfs_buf_hashinsert(buf);
+	}
+
+	buf->b_refcount++;
+	sfs_buf_lruremove(buf);
+	sfs_buf_lruappend(buf);
+
+	/*
+	 * If someone is reading the block in or filling it, wait for
+	 * them. A buffer being written back is valid and doesn't need
+	 * waiting for.
+	 */
+	while (buf->b_busy && !buf->b_valid) {
+		cv_wait(buf->b_cv, sfs_buf_lock);
+	}
+
+	if (!buf->b_valid) {
+		buf->b_busy = true;
+		if (!doread) {
+			/* Don't leak whatever the buffer held before. */
+			bzero(buf->b_data, sizeof(buf->b_data));
+		}
+		else {
+			result = sfs_buf_io(buf, UIO_READ);
+			if (!result) {
+				sfs_buf_reads++;
+				buf->b_valid = true;
+			}
+			sfs_buf_unbusy(buf);
+			if (result) {
+				buf->b_refcount--;
+				if (buf->b_refcount == 0) {
+					sfs_buf_detach(buf);
+				}
+				lock_release(sfs_buf_lock);
+				return result;
+			}
+		}
+	}
+
+	lock_release(sfs_buf_lock);
+	*ret = buf;
+	return 0;
+}
+
+int
+sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, true, ret);
+}
+
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, false, ret);
+}
+
+void *
+sfs_buf_data(struct sfs_buf *buf)
+{
+	return buf->b_data;
+}
+
+/*
+ * Note that the caller has changed (or, for sfs_buf_get, filled in)
+ * the buffer's contents. This doesn't wait for a write of the buffer
+ * that is already under way; the buffer is just written again.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *buf)
+{
+	lock_acquire(sfs_buf_lock);
+	KASSERT(buf->b_refcount > 0);
+	if (!buf->b_valid) {
+		/* Filled in after sfs_buf_get; let waiters at it. */
+		buf->b_valid = true;
+		sfs_buf_unbusy(buf);
+	}
+	sfs_buf_redirty(buf);
+	lock_release(sfs_buf_lock);
+}
+
+/*
+ * Note that the caller's change to the buffer failed partway (say,
+ * copying from a bad user pointer). A buffer that already held the
+ * block keeps whatever was changed, like any partial write, and is
+ * marked dirty. One that came zero-filled from sfs_buf_get holds
+ * zeros and part of a copy, not the block; it is left invalid so
+ * that release throws it away rather than writing it over the block
+ * on disk.
+ */
+void
+sfs_buf_markfailed(struct sfs_buf *buf)
+{
+	lock_acquire(sfs_buf_lock);
+	KASSERT(buf->b_refcount > 0);
+	if (buf->b_valid) {
+		sfs_buf_redirty(buf);
+	}
+	lock_release(sfs_buf_lock);
+}
+
+/*
+ * Drop a reference to a buffer. In write-through mode it is written
+ * back if it's dirty; if the write fails the buffer stays dirty and
+ * the error is returned.
+ */
+int
+sfs_buf_release(struct sfs_buf *buf)
+{
+	int result;
+
+	lock_acquire(sfs_buf_lock);
+	KASSERT(buf->b_refcount > 0);
+
+	if (!buf->b_valid) {
+		/* Got with sfs_buf_get but never filled in; forget it. */
+		sfs_buf_unbusy(buf);
+		buf->b_refcount--;
+		if (buf->b_refcount == 0) {
+			sfs_buf_detach(buf);
+		}
+		lock_release(sfs_buf_lock);
+		return 0;
+	}
+
+#if OPT_SFSWRITEBACK
+	result = 0;
+	if (sfs_buf_ndirty >= sfs_buf_max) {
+		/* No clean buffers left; don't wait for the flusher. */
+		result = sfs_buf_doflush(buf->b_fs);
+	}
+#else
+	result = sfs_buf_writeback(buf);
+#endif
+
+	buf->b_refcount--;
+	if (sfs_buf_num > sfs_buf_max) {
+		sfs_buf_shrink();
+	}
+	lock_release(sfs_buf_lock);
+	return result;
+}
+
+/*
+ * Sort buffers by block number. Insertion sort; the array is at
+ * most a few hundred entries and usually nearly in order already.
+ */
+static
+void
+sfs_buf_sort(struct sfs_buf **bufs, unsigned nbufs)
+{
+	struct sfs_buf *tmp;
+	unsigned i, j;
+
+	for (i=1; i<nbufs; i++) {
+		tmp = bufs[i];
+		for (j=i; j>0 && bufs[j-1]->b_block > tmp->b_block; j--) {
+			bufs[j] = bufs[j-1];
+		}
+		bufs[j] = tmp;
+	}
+}
+
+/*
+ * Whether a flush has to deal with BUF: it's dirty, or it's being
+ * written back and the flush must wait for that write to finish.
+ */
+static
+bool
+sfs_buf_needsflush(struct sfs_buf *buf)
+{
+	return buf->b_dirty || (buf->b_busy && buf->b_valid);
+}
+
+/*
+ * Write back NBUFS buffers of one volume in block order, coalescing
+ * runs of adjacent blocks. The caller holds a reference to each,
+ * and the reference is dropped here. A buffer that is already being
+ * written is waited for, and then written again if it was changed
+ * meanwhile.
+ */
+static
+int
+sfs_buf_writesorted(struct sfs_buf **bufs, unsigned n)
+{
+	unsigned i, start;
+	int result, ret = 0;
+
+	sfs_buf_sort(bufs, n);
+
+	for (start = 0; start < n; start = i) {
+		sfs_buf_waitidle(bufs[start]);
+		if (!bufs[start]->b_dirty) {
+			i = start + 1;
+			continue;
+		}
+		for (i = start+1; i < n && i - start < SFS_BUF_MAXCLUSTER; i++) {
+			if (bufs[i]->b_block != bufs[i-1]->b_block + 1 ||
+			    bufs[i]->b_busy || !bufs[i]->b_dirty) {
+				break;
+			}
+		}
+		result = sfs_buf_writecluster(&bufs[start], i - start);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_refcount > 0);
+		bufs[i]->b_refcount--;
+	}
+	return ret;
+}
+
+/*
+ * Write back all the dirty buffers belonging to SFS, in block order,
+ * coalescing runs of adjacent blocks. sfs_buf_lock is dropped while
+ * writing. If we can't get memory for the sort, fall back to writing
+ * them one at a time.
+ */
+static
+int
+sfs_buf_doflush(struct sfs_fs *sfs)
+{
+	struct sfs_buf **bufs;
+	struct sfs_buf *buf;
+	unsigned n, tries;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_buf_lock));
+
+	n = 0;
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_fs == sfs && sfs_buf_needsflush(buf)) {
+			n++;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	bufs = kmalloc(n * sizeof(*bufs));
+	if (bufs == NULL) {
+		/*
+		 * The list can change whenever the lock is dropped, so
+		 * rescan from the top for each buffer. Bound the number
+		 * of passes in case others keep dirtying buffers.
+		 */
+		for (tries = n; tries > 0; tries--) {
+			for (buf = sfs_buf_lruhead; buf != NULL;
+			     buf = buf->b_lrunext) {
+				if (buf->b_fs == sfs && buf->b_dirty &&
+				    !buf->b_busy) {
+					break;
+				}
+			}
+			if (buf == NULL) {
+				break;
+			}
+			buf->b_refcount++;
+			result = sfs_buf_writeback(buf);
+			buf->b_refcount--;
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	n = 0;
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_fs == sfs && sfs_buf_needsflush(buf)) {
+			buf->b_refcount++;
+			bufs[n++] = buf;
+		}
+	}
+	result = sfs_buf_writesorted(bufs, n);
+
+	kfree(bufs);
+	return result;
+}
+
+int
+sfs_buf_flush(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs_buf_lock);
+	result = sfs_buf_doflush(sfs);
+	lock_release(sfs_buf_lock);
+	return result;
+}
+
+/*
+ * Write back whichever of BLOCKS of SFS are cached and dirty. This
+ * is for fsync, which knows which blocks belong to the file; it
+ * saves writing back the rest of the volume.
+ */
+int
+sfs_buf_flushblocks(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n)
+{
+	struct sfs_buf *bufs[SFS_BUF_MAXFLUSH];
+	struct sfs_buf *buf;
+	unsigned i, ndirty;
+	int result, ret = 0;
+
+	lock_acquire(sfs_buf_lock);
+	while (n > 0) {
+		ndirty = 0;
+		for (i=0; i<n && i<SFS_BUF_MAXFLUSH; i++) {
+			buf = sfs_buf_hashfind(sfs->sfs_device, blocks[i]);
+			if (buf != NULL && sfs_buf_needsflush(buf)) {
+				buf->b_refcount++;
+				bufs[ndirty++] = buf;
+			}
+		}
+		blocks += i;
+		n -= i;
+		result = sfs_buf_writesorted(bufs, ndirty);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	lock_release(sfs_buf_lock);
+	return ret;
+}
+
+/*
+ * Throw away all the buffers belonging to SFS. Called on unmount,
+ * after a successful sync; none may be in use or dirty, except by
+ * read-ahead still under way, which is waited for.
+ */
+void
+sfs_buf_purge(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+
+	lock_acquire(sfs_buf_lock);
+
+#if OPT_SFSREADAHEAD
+	sfs_buf_racancel(sfs);
+#endif
+
+ again:
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_fs != sfs) {
+			continue;
+		}
+		if (buf->b_busy) {
+			/* Still being read ahead; wait, then rescan. */
+			buf->b_refcount++;
+			sfs_buf_waitidle(buf);
+			buf->b_refcount--;
+			goto again;
+		}
+		KASSERT(buf->b_refcount == 0);
+		KASSERT(!buf->b_dirty);
+		sfs_buf_detach(buf);
+	}
+
+	lock_release(sfs_buf_lock);
+}
+
+/*
+ * BLOCK of SFS has been freed; its contents no longer matter. Drop
+ * any cached copy so it isn't written back for nothing.
+ */
+void
+sfs_buf_forget(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	lock_acquire(sfs_buf_lock);
+	buf = sfs_buf_hashfind(sfs->sfs_device, block);
+	if (buf != NULL) {
+		sfs_buf_clean(buf);
+		if (buf->b_refcount == 0) {
+			sfs_buf_detach(buf);
+		}
+	}
+	lock_release(sfs_buf_lock);
+}
+
+#if OPT_SFSWRITEBACK
+
+/*
+ * The flusher thread. Wakes once a second and syncs all volumes when
+ * the interval has elapsed or too much of the cache is dirty.
+ */
+static
+void
+sfs_buf_flusher(void *junk, unsigned long junk2)
+{
+	unsigned elapsed = 0;
+	bool due;
+
+	(void)junk;
+	(void)junk2;
+
+	while (1) {
+		clocksleep(1);
+		elapsed++;
+
+		lock_acquire(sfs_buf_lock);
+		due = elapsed >= sfs_buf_interval ||
+			sfs_buf_ndirty * 100 >= sfs_buf_max * sfs_buf_dirtyratio;
+		lock_release(sfs_buf_lock);
+
+		if (due) {
+			vfs_sync();
+			elapsed = 0;
+		}
+	}
+}
+
+/*
+ * Start the flusher thread, if it isn't running already. Called at
+ * mount time.
+ */
+int
+sfs_buf_startflusher(void)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_buf_flusher_running) {
+		return 0;
+	}
+	result = thread_fork("sfs_flusher", NULL, sfs_buf_flusher, NULL, 0);
+	if (result) {
+		return result;
+	}
+	sfs_buf_flusher_running = true;
+	return 0;
+}
+
+/*
+ * Set the flusher's interval (in seconds) and dirty ratio (percent).
+ */
+void
+sfs_buf_setwriteback(unsigned interval, unsigned ratio)
+{
+	KASSERT(interval > 0);
+	KASSERT(ratio > 0 && ratio <= 100);
+
+	lock_acquire(sfs_buf_lock);
+	sfs_buf_interval = interval;
+	sfs_buf_dirtyratio = ratio;
+	lock_release(sfs_buf_lock);
+}
+
+#endif /* OPT_SFSWRITEBACK */
+
+/*
+ * Set up the cache. Called once at boot.
+ */
+void
+sfs_buf_bootstrap(void)
+{
+	sfs_buf_lock = lock_create("sfs_buf");
+	if (sfs_buf_lock == NULL) {
+		panic("sfs: Could not create buffer cache lock\n");
+	}
+}
+
+/*
+ * Change the size limit of the cache.
+ */
+void
+sfs_buf_setmax(unsigned max)
+{
+	KASSERT(max > 0);
+
+	lock_acquire(sfs_buf_lock);
+	sfs_buf_max = max;
+	sfs_buf_shrink();
+	lock_release(sfs_buf_lock);
+}
+
+unsigned
+sfs_buf_getmax(void)
+{
+	return sfs_buf_max;
+}
+
+void
+sfs_buf_printstats(void)
+{
+	unsigned ninuse = 0;
+	struct sfs_buf *buf;
+
+	lock_acquire(sfs_buf_lock);
+	for (buf = sfs_buf_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_refcount > 0) {
+			ninuse++;
+		}
+	}
+	kprintf("sfs buffer cache: %u/%u buffers, %u in use, %u dirty\n",
+		sfs_buf_num, sfs_buf_max, ninuse, sfs_buf_ndirty);
+	kprintf("    %u hits, %u misses, %u reads, %u writes, "
+		"%u evictions\n", sfs_buf_hits, sfs_buf_misses,
+		sfs_buf_reads, sfs_buf_writes, sfs_buf_evictions);
+#if OPT_SFSWRITEBACK
+	kprintf("    write-back: sync every %us or at %u%% dirty; "
+		"%u clustered writes\n", sfs_buf_interval,
+		sfs_buf_dirtyratio, sfs_buf_clusters);
+#endif
+#if OPT_SFSREADAHEAD
+	kprintf("    read-ahead: %u queued, %u dropped, %u used, "
+		"%u evicted unused\n", sfs_buf_raqueued, sfs_buf_radropped,
+		sfs_buf_rahits, sfs_buf_rawasted);
+#endif
+	lock_release(sfs_buf_lock);
+}
@@ -0,0 +1,260 @@
+/*
+ * In-memory hashed name index for SFS directories.
+ *
+ * The index maps a hash of each name in a directory to the slot the
+ * entry lives in, and keeps a stack of free slots. It does not store
+ * the names themselves: a hash match is only a candidate, which the
+ * caller confirms by reading the slot (normally out of the buffer
+ * cache). This keeps the index small enough to hold for directories
+ * with tens of thousands of entries.
+ *
+ * The index is owned by the directory's sfs_vnode and is protected
+ * by its sv_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <sfs.h>
+
+/* Initial number of buckets; always a power of two. */
+#define SFS_DIRHASH_MINBUCKETS	64
+
+/* Grow the table when there are this many entries per bucket. */
+#define SFS_DIRHASH_LOAD	2
+
+struct sfs_dirhash_ent {
+	uint32_t de_hash;			/* hash of the name */
+	int de_slot;				/* directory slot */
+	struct sfs_dirhash_ent *de_next;	/* hash chain */
+};
+
+struct sfs_dirhash {
+	struct sfs_dirhash_ent **dh_buckets;
+	unsigned dh_nbuckets;
+	unsigned dh_nents;
+	int *dh_free;			/* stack of free slots */
+	unsigned dh_nfree;
+	unsigned dh_maxfree;
+};
+
+/*
+ * FNV-1a.
+ */
+static
+uint32_t
+sfs_dirhash_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+struct sfs_dirhash *
+sfs_dirhash_create(void)
+{
+	struct sfs_dirhash *dh;
+	unsigned i;
+
+	dh = kmalloc(sizeof(*dh));
+	if (dh == NULL) {
+		return NULL;
+	}
+	dh->dh_nbuckets = SFS_DIRHASH_MINBUCKETS;
+	dh->dh_buckets = kmalloc(dh->dh_nbuckets * sizeof(dh->dh_buckets[0]));
+	if (dh->dh_buckets == NULL) {
+		kfree(dh);
+		return NULL;
+	}
+	for (i=0; i<dh->dh_nbuckets; i++) {
+		dh->dh_buckets[i] = NULL;
+	}
+	dh->dh_nents = 0;
+	dh->dh_free = NULL;
+	dh->dh_nfree = 0;
+	dh->dh_maxfree = 0;
+	return dh;
+}
+
+void
+sfs_dirhash_destroy(struct sfs_dirhash *dh)
+{
+	struct sfs_dirhash_ent *de, *next;
+	unsigned i;
+
+	for (i=0; i<dh->dh_nbuckets; i++) {
+		for (de = dh->dh_buckets[i]; de != NULL; de = next) {
+			next = de->de_next;
+			kfree(de);
+		}
+	}
+	kfree(dh->dh_buckets);
+	if (dh->dh_free != NULL) {
+		kfree(dh->dh_free);
+	}
+	kfree(dh);
+}
+
+/*
+ * Double the number of buckets. Failure isn't fatal; the chains just
+ * get longer.
+ */
+static
+void
+sfs_dirhash_grow(struct sfs_dirhash *dh)
+{
+	struct sfs_dirhash_ent **newbuckets;
+	struct sfs_dirhash_ent *de, *next;
+	unsigned i, b, newnbuckets;
+
+	newnbuckets = dh->dh_nbuckets * 2;
+	newbuckets = kmalloc(newnbuckets * sizeof(newbuckets[0]));
+	if (newbuckets == NULL) {
+		return;
+	}
+	for (i=0; i<newnbuckets; i++) {
+		newbuckets[i] = NULL;
+	}
+	for (i=0; i<dh->dh_nbuckets; i++) {
+		for (de = dh->dh_buckets[i]; de != NULL; de = next) {
+			next = de->de_next;
+			b = de->de_hash & (newnbuckets - 1);
+			de->de_next = newbuckets[b];
+			newbuckets[b] = de;
+		}
+	}
+	kfree(dh->dh_buckets);
+	dh->dh_buckets = newbuckets;
+	dh->dh_nbuckets = newnbuckets;
+}
+
+/*
+ * Record that NAME lives in SLOT.
+ */
+int
+sfs_dirhash_add(struct sfs_dirhash *dh, const char *name, int slot)
+{
+	struct sfs_dirhash_ent *de;
+	unsigned b;
+
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_hash = sfs_dirhash_hash(name);
+	de->de_slot = slot;
+
+	b = de->de_hash & (dh->dh_nbuckets - 1);
+	de->de_next = dh->dh_buckets[b];
+	dh->dh_buckets[b] = de;
+	dh->dh_nents++;
+
+	if (dh->dh_nents > dh->dh_nbuckets * SFS_DIRHASH_LOAD) {
+		sfs_dirhash_grow(dh);
+	}
+	return 0;
+}
+
+/*
+ * Forget that NAME lives in SLOT.
+ */
+void
+sfs_dirhash_remove(struct sfs_dirhash *dh, const char *name, int slot)
+{
+	struct sfs_dirhash_ent **pp, *de;
+	uint32_t hash;
+
+	hash = sfs_dirhash_hash(name);
+	pp = &dh->dh_buckets[hash & (dh->dh_nbuckets - 1)];
+	for (; *pp != NULL; pp = &(*pp)->de_next) {
+		de = *pp;
+		if (de->de_hash == hash && de->de_slot == slot) {
+			*pp = de->de_next;
+			kfree(de);
+			dh->dh_nents--;
+			return;
+		}
+	}
+	panic("sfs: dirhash: %s (slot %d) not in index\n", name, slot);
+}
+
+/*
+ * Iterate over the slots that might hold NAME. Start with *CURSOR
+ * set to NULL; returns -1 when there are no more candidates.
+ */
+int
+sfs_dirhash_next(struct sfs_dirhash *dh, const char *name, void **cursor)
+{
+	struct sfs_dirhash_ent *de;
+	uint32_t hash;
+
+	hash = sfs_dirhash_hash(name);
+	if (*cursor == NULL) {
+		de = dh->dh_buckets[hash & (dh->dh_nbuckets - 1)];
+	}
+	else {
+		de = ((struct sfs_dirhash_ent *)*cursor)->de_next;
+	}
+	for (; de != NULL; de = de->de_next) {
+		if (de->de_hash == hash) {
+			*cursor = de;
+			return de->de_slot;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Note that SLOT is free.
+ */
+int
+sfs_dirhash_addfree(struct sfs_dirhash *dh, int slot)
+{
+	unsigned newmax;
+	int *newfree;
+
+	if (dh->dh_nfree == dh->dh_maxfree) {
+		newmax = dh->dh_maxfree ? dh->dh_maxfree * 2 : 16;
+		newfree = kmalloc(newmax * sizeof(newfree[0]));
+		if (newfree == NULL) {
+			return ENOMEM;
+		}
+		if (dh->dh_free != NULL) {
+			memcpy(newfree, dh->dh_free,
+			       dh->dh_nfree * sizeof(newfree[0]));
+			kfree(dh->dh_free);
+		}
+		dh->dh_free = newfree;
+		dh->dh_maxfree = newmax;
+	}
+	dh->dh_free[dh->dh_nfree++] = slot;
+	return 0;
+}
+
+/*
+ * Return a free slot, or -1 if there aren't any. The slot stays
+ * free until sfs_dirhash_takefree is called for it.
+ */
+int
+sfs_dirhash_getfree(struct sfs_dirhash *dh)
+{
+	if (dh->dh_nfree == 0) {
+		return -1;
+	}
+	return dh->dh_free[dh->dh_nfree - 1];
+}
+
+/*
+ * Note that SLOT, as returned by sfs_dirhash_getfree, is now in use.
+ */
+void
+sfs_dirhash_takefree(struct sfs_dirhash *dh, int slot)
+{
+	KASSERT(dh->dh_nfree > 0);
+	KASSERT(dh->dh_free[dh->dh_nfree - 1] == slot);
+	dh->dh_nfree--;
+}
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -101,6 +102,40 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Set up and tear down the table of loaded vnodes.
+ */
+static
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i].vb_head = NULL;
+		sfs->sfs_vnhash[i].vb_lock = lock_create("sfs_vnhash");
+		if (sfs->sfs_vnhash[i].vb_lock == NULL) {
+			while (i-- > 0) {
+				lock_destroy(sfs->sfs_vnhash[i].vb_lock);
+			}
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		KASSERT(sfs->sfs_vnhash[i].vb_head == NULL);
+		lock_destroy(sfs->sfs_vnhash[i].vb_lock);
+	}
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +146,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnbucket *vb;
+	struct sfs_vnode *sv, *next;
+	unsigned i;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +183,52 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/*
+	 * Go over the table of loaded vnodes, syncing their inodes
+	 * into the buffer cache as we go; the data is written back
+	 * with everything else below. Syncing takes the vnode's lock,
+	 * which comes before the table's, so hold a reference to each
+	 * vnode instead of the bucket lock while syncing it; the
+	 * reference also keeps it in the table so we can find the
+	 * next one afterwards.
+	 */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		vb = &sfs->sfs_vnhash[i];
+		lock_acquire(vb->vb_lock);
+		sv = vb->vb_head;
+		if (sv != NULL) {
+			VOP_INCREF(&sv->sv_v);
+		}
+		lock_release(vb->vb_lock);
+
+		while (sv != NULL) {
+			sfs_vnode_syncinode(sv);
+
+			lock_acquire(vb->vb_lock);
+			next = sv->sv_hashnext;
+			if (next != NULL) {
+				VOP_INCREF(&next->sv_v);
+			}
+			lock_release(vb->vb_lock);
+
+			VOP_DECREF(&sv->sv_v);
+			sv = next;
+		}
 	}
 
+	/* Write back any dirty blocks in the buffer cache. */
+	result = sfs_buf_flush(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,13 +238,13 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -189,13 +258,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name doesn't change while we're mounted. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,13 +273,20 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	unsigned i;
+	bool busy;
 
 	vfs_biglock_acquire();
 	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
-		return EBUSY;
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		lock_acquire(sfs->sfs_vnhash[i].vb_lock);
+		busy = sfs->sfs_vnhash[i].vb_head != NULL;
+		lock_release(sfs->sfs_vnhash[i].vb_lock);
+		if (busy) {
+			vfs_biglock_release();
+			return EBUSY;
+		}
 	}
 
 	/* We should have just had sfs_sync called. */
@@ -222,8 +294,11 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_buf_purge(sfs);
+	sfs_vnhash_cleanup(sfs);
+	sfs_alloc_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_freemaplock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -282,6 +357,24 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+#if OPT_SFSWRITEBACK
+	/* Make sure there's a thread to write back dirty buffers */
+	result = sfs_buf_startflusher();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+#endif
+
+#if OPT_SFSREADAHEAD
+	/* And one to read ahead for sequential readers */
+	result = sfs_buf_startreadahead();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+#endif
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -289,21 +382,30 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
 
+	/* Set up the vnode table */
+	result = sfs_vnhash_init(sfs);
+	if (result) {
+		lock_destroy(sfs->sfs_freemaplock);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
 
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -316,7 +418,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
@@ -333,7 +436,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
@@ -341,7 +445,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+	result = sfs_alloc_init(sfs);
+	if (result) {
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vnhash_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
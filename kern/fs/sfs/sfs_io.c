@@ -43,6 +43,10 @@
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
+//
+// No lock is needed here; the device copes with concurrent
+// requests, and callers lock the blocks they transfer (the buffer
+// cache its buffers, sfs_sync the freemap and superblock).
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,8 +54,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -49,6 +49,9 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,9 +61,16 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	return sfs_buf_release(buf);
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -68,9 +78,20 @@ static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct sfs_buf *buf;
+		int result;
+
+		result = sfs_buf_get(sfs, sv->sv_ino, &buf);
+		if (result) {
+			return result;
+		}
+		memcpy(sfs_buf_data(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_buf_markdirty(buf);
+		result = sfs_buf_release(buf);
 		if (result) {
 			return result;
 		}
@@ -79,24 +100,37 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+/*
+ * Same, for callers that don't hold the vnode's lock.
+ */
+int
+sfs_vnode_syncinode(struct sfs_vnode *sv)
+{
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, as close as we can to GOAL.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = sfs_alloc_block(sfs, goal, diskblock);
 	if (result) {
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -107,14 +141,71 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Allocate a block for file SV, aiming for the block after the last
+ * one it used. A file being appended to takes its blocks from a small
+ * preallocated extent instead, so that files written at the same time
+ * don't end up interleaved on disk.
+ *
+ * Preallocated blocks are marked in use in the freemap until they're
+ * used or released, so a crash can leak up to SFS_PREALLOC blocks per
+ * open file; sfsck reclaims them.
+ */
+static
+int
+sfs_vballoc(struct sfs_vnode *sv, bool appending, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t goal = sv->sv_lastblock + 1;
+	int result;
+
+	if (!appending) {
+		result = sfs_balloc(sfs, goal, diskblock);
+	}
+	else {
+		if (sv->sv_prenum == 0) {
+			result = sfs_alloc_extent(sfs, goal, SFS_PREALLOC,
+						  &sv->sv_prestart,
+						  &sv->sv_prenum);
+			if (result) {
+				return result;
+			}
+		}
+		*diskblock = sv->sv_prestart++;
+		sv->sv_prenum--;
+		result = sfs_clearblock(sfs, *diskblock);
+	}
+	if (result) {
+		return result;
+	}
+	sv->sv_lastblock = *diskblock;
+	return 0;
+}
+
+/*
+ * Free a block. Drop it from the buffer cache first; once it's free
+ * someone else may allocate it and put new contents in the cache.
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_buf_forget(sfs, diskblock);
+	sfs_alloc_free(sfs, diskblock);
+}
+
+/*
+ * Give back any blocks preallocated for SV.
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	while (sv->sv_prenum > 0) {
+		sfs_alloc_free(sfs, sv->sv_prestart++);
+		sv->sv_prenum--;
+	}
 }
 
 /*
@@ -124,160 +215,168 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Number of file blocks mapped by each entry of an indirect block
+ * LEVELS levels above the data.
+ */
+static
+uint32_t
+sfs_idspan(unsigned levels)
+{
+	uint32_t span = 1;
+
+	while (levels-- > 1) {
+		span *= SFS_DBPERIDB;
+	}
+	return span;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, along with any indirect blocks needed to reach it.
+ *
+ * Past the direct blocks, blocks are found through the single,
+ * double, or triple indirect block. Rather than walk down from the
+ * inode every time, we remember the last single indirect block we
+ * went through (at any level of the tree) and which file blocks it
+ * maps; sequential I/O mostly stays within one.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct sfs_buf *buf = NULL;
+	uint32_t *slot;
+	uint32_t block, base, span, idx;
+	unsigned levels;
+	bool appending;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Blocks past EOF come from the file's preallocated extent. */
+	appending = fileblock >= DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
 
 	/*
-	 * If the block we want is one of the direct blocks...
+	 * Figure out where to start: SLOT points at the block pointer
+	 * in the inode, LEVELS is the number of indirect blocks
+	 * between it and the data, and BASE is the first file block
+	 * reached through it.
 	 */
 	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
-
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
-			}
-
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
-		}
-
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
+		slot = &sv->sv_i.sfi_direct[fileblock];
+		levels = 0;
+		base = fileblock;
+	}
+	else if (fileblock < SFS_NDIRECT + SFS_DBPERIDB) {
+		slot = &sv->sv_i.sfi_indirect;
+		levels = 1;
+		base = SFS_NDIRECT;
+	}
+	else if (fileblock < SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERDIDB) {
+		slot = &sv->sv_i.sfi_dindirect;
+		levels = 2;
+		base = SFS_NDIRECT + SFS_DBPERIDB;
+	}
+	else if (fileblock - (SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERDIDB)
+		 < SFS_DBPERTIDB) {
+		slot = &sv->sv_i.sfi_tindirect;
+		levels = 3;
+		base = SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERDIDB;
 	}
-
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	else {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	/* If we've been through the right indirect block lately, use it. */
+	if (sv->sv_idcacheblock != 0 && fileblock >= sv->sv_idcachebase &&
+	    fileblock - sv->sv_idcachebase < SFS_DBPERIDB) {
+		result = sfs_buf_read(sfs, sv->sv_idcacheblock, &buf);
 		if (result) {
 			return result;
 		}
+		slot = sfs_buf_data(buf);
+		slot += fileblock - sv->sv_idcachebase;
+		levels = 0;
+	}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	/*
+	 * Walk down the tree. BUF holds the block SLOT is in, or is
+	 * NULL if SLOT is in the inode.
+	 */
+	while (1) {
+		block = *slot;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		if (block==0 && doalloc) {
+			/*
+			 * Allocate the missing block (which sfs_vballoc
+			 * zeroes, so a new indirect block maps nothing)
+			 * and remember it in its parent.
+			 */
+			result = sfs_vballoc(sv, appending, &block);
+			if (result) {
+				if (buf != NULL) {
+					sfs_buf_release(buf);
+				}
+				return result;
+			}
+			*slot = block;
+			if (buf == NULL) {
+				sv->sv_dirty = true;
+			}
+			else {
+				sfs_buf_markdirty(buf);
+			}
 		}
-	}
-
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+		if (buf != NULL) {
+			result = sfs_buf_release(buf);
+			buf = NULL;
+			if (result) {
+				return result;
+			}
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		if (block == 0 || levels == 0) {
+			break;
+		}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+		/* Go down a level. */
+		result = sfs_buf_read(sfs, block, &buf);
 		if (result) {
 			return result;
 		}
+		if (levels == 1) {
+			sv->sv_idcacheblock = block;
+			sv->sv_idcachebase = base;
+		}
+		span = sfs_idspan(levels);
+		idx = (fileblock - base) / span;
+		slot = sfs_buf_data(buf);
+		slot += idx;
+		base += idx * span;
+		levels--;
 	}
 
 	/* Hand back the result and return. */
@@ -285,6 +384,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
 		      block, fileblock, sv->sv_ino);
 	}
+	if (block != 0) {
+		sv->sv_lastblock = block;
+	}
 	*diskblock = block;
 	return 0;
 }
@@ -308,16 +410,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,105 +433,62 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache. If we're going to
+	 * overwrite all of it there's no need to read it first.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	if (uio->uio_rw == UIO_WRITE && len == SFS_BLOCKSIZE) {
+		result = sfs_buf_get(sfs, diskblock, &iobuf);
+	}
+	else {
+		result = sfs_buf_read(sfs, diskblock, &iobuf);
+	}
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)sfs_buf_data(iobuf)+skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer is now dirty. If the uiomove
+	 * failed partway through, a buffer we got without reading
+	 * holds zeros past the copy and must not be written out.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
 		if (result) {
-			return result;
+			sfs_buf_markfailed(iobuf);
+		}
+		else {
+			sfs_buf_markdirty(iobuf);
 		}
 	}
 
-	return 0;
+	if (result) {
+		sfs_buf_release(iobuf);
+		return result;
+	}
+	return sfs_buf_release(iobuf);
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of a single whole block. This goes
+ * through the buffer cache like everything else, so that it sees
+ * (and doesn't go behind the back of) any cached copy of the block.
  */
 static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
-	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
-
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
-
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
-
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
-	}
-
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
-	return result;
+	return sfs_partialio(sv, uio, 0, SFS_BLOCKSIZE);
 }
 
 /*
@@ -541,28 +592,96 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+#if OPT_SFSREADAHEAD
+/*
+ * Read-ahead. A read that starts where the previous one ended opens
+ * the window, or doubles it up to SFS_RA_MAXWINDOW blocks; any other
+ * read closes it. While it's open, the blocks in the window past the
+ * end of this read are handed to the buffer cache to fetch in the
+ * background. SV_RAEND remembers how far we've already asked for, so
+ * a run of small reads doesn't ask for the same blocks over and over.
+ *
+ * START and END are the file offsets the read covered.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t blocks[SFS_RA_MAXWINDOW];
+	uint32_t fileblock, lastblock, eofblock, diskblock;
+	unsigned n = 0;
+
+	if (start == sv->sv_raoffset) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RA_MINWINDOW;
+		}
+		else if (sv->sv_rawindow < SFS_RA_MAXWINDOW) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_raoffset = end;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	fileblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	if (fileblock < sv->sv_raend) {
+		fileblock = sv->sv_raend;
+	}
+	lastblock = DIVROUNDUP(end, SFS_BLOCKSIZE) + sv->sv_rawindow;
+	eofblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (lastblock > eofblock) {
+		lastblock = eofblock;
+	}
+
+	for (; fileblock < lastblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			blocks[n++] = diskblock;
+		}
+	}
+	sv->sv_raend = fileblock;
+
+	if (n > 0) {
+		sfs_buf_prefetch(sfs, blocks, n);
+	}
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
 
+/* Number of directory entries in a block */
+#define SFS_DIRPERBLOCK ((int)(SFS_BLOCKSIZE / sizeof(struct sfs_dir)))
+
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Write (overwrite) the directory entry in slot SLOT of a directory
+ * vnode.
  */
 static
 int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 {
 	struct iovec iov;
 	struct uio ku;
 	off_t actualpos;
 	int result;
 
-	/* Compute the actual position in the directory to read. */
+	/* Compute the actual position in the directory. */
+	KASSERT(slot>=0);
 	actualpos = slot * sizeof(struct sfs_dir);
 
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
+	/* Set up a uio to do the write */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
 
 	/* do it */
 	result = sfs_io(sv, &ku);
@@ -570,9 +689,9 @@ sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		return result;
 	}
 
-	/* We should not hit EOF in the middle of a directory entry */
+	/* Should not end up with a partial entry! */
 	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
 	}
 
 	/* Done */
@@ -580,66 +699,203 @@ sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 }
 
 /*
- * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
  */
 static
 int
-sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_dir_nentries(struct sfs_vnode *sv)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
+	off_t size;
 
-	/* Compute the actual position in the directory. */
-	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_dir);
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
 
-	/* Set up a uio to do the write */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
 
-	/* do it */
-	result = sfs_io(sv, &ku);
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Read the directory entry in slot SLOT, from the buffer cache.
+ */
+static
+int
+sfs_dir_readslot(struct sfs_vnode *sv, int slot, struct sfs_dir *sd)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_dir *bsd;
+	uint32_t diskblock;
+	int result;
+
+	result = sfs_bmap(sv, slot / SFS_DIRPERBLOCK, 0, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		bzero(sd, sizeof(*sd));
+		return 0;
+	}
+
+	result = sfs_buf_read(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	bsd = sfs_buf_data(buf);
+	memcpy(sd, &bsd[slot % SFS_DIRPERBLOCK], sizeof(*sd));
+	sfs_buf_release(buf);
+
+	/* Ensure null termination, just in case */
+	sd->sfd_name[sizeof(sd->sfd_name)-1] = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory name index
+//
+// Directories of SFS_DIRHASH_MINENTRIES slots or more get an
+// in-memory index (see sfs_dirhash.c), built on the first lookup and
+// kept up to date by sfs_dir_link and sfs_dir_unlink (and so by
+// rename). If we run out of memory keeping it up to date we just
+// throw it away; it'll be rebuilt on the next lookup.
+
+#define SFS_DIRHASH_MINENTRIES	(4 * SFS_DIRPERBLOCK)
+
+static
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	if (sv->sv_dirhash != NULL) {
+		sfs_dirhash_destroy(sv->sv_dirhash);
+		sv->sv_dirhash = NULL;
+	}
+}
+
+/*
+ * Build the index for a directory by scanning it a block at a time.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirhash *dh;
+	struct sfs_buf *buf;
+	struct sfs_dir *sd;
+	char name[SFS_NAMELEN];
+	uint32_t diskblock;
+	int nentries = sfs_dir_nentries(sv);
+	int base, i, n, result;
+
+	KASSERT(sv->sv_dirhash == NULL);
+
+	dh = sfs_dirhash_create();
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+
+	/* Go backwards so the lowest free slots end up on top. */
+	for (base = (nentries - 1) / SFS_DIRPERBLOCK * SFS_DIRPERBLOCK;
+	     base >= 0; base -= SFS_DIRPERBLOCK) {
+		n = nentries - base;
+		if (n > SFS_DIRPERBLOCK) {
+			n = SFS_DIRPERBLOCK;
+		}
+
+		result = sfs_bmap(sv, base / SFS_DIRPERBLOCK, 0, &diskblock);
+		if (result) {
+			goto fail;
+		}
+		if (diskblock == 0) {
+			for (i=n-1; i>=0; i--) {
+				result = sfs_dirhash_addfree(dh, base + i);
+				if (result) {
+					goto fail;
+				}
+			}
+			continue;
+		}
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+		result = sfs_buf_read(sfs, diskblock, &buf);
+		if (result) {
+			goto fail;
+		}
+		sd = sfs_buf_data(buf);
+		for (i=n-1; i>=0; i--) {
+			if (sd[i].sfd_ino == SFS_NOINO) {
+				result = sfs_dirhash_addfree(dh, base + i);
+			}
+			else {
+				memcpy(name, sd[i].sfd_name, sizeof(name));
+				name[sizeof(name)-1] = 0;
+				result = sfs_dirhash_add(dh, name, base + i);
+			}
+			if (result) {
+				sfs_buf_release(buf);
+				goto fail;
+			}
+		}
+		sfs_buf_release(buf);
 	}
 
-	/* Done */
+	sv->sv_dirhash = dh;
 	return 0;
+
+ fail:
+	sfs_dirhash_destroy(dh);
+	return result;
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * sfs_dir_findname using the index.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_dir_findindexed(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
 {
-	off_t size;
-
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	struct sfs_dir sd;
+	void *cursor = NULL;
+	int s, result;
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	while ((s = sfs_dirhash_next(sv->sv_dirhash, name, &cursor)) >= 0) {
+		result = sfs_dir_readslot(sv, s, &sd);
+		if (result) {
+			return result;
+		}
+		if (sd.sfd_ino != SFS_NOINO && !strcmp(sd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = s;
+			}
+			if (ino != NULL) {
+				*ino = sd.sfd_ino;
+			}
+			return 0;
+		}
 	}
 
-	return size / sizeof(struct sfs_dir);
+	if (emptyslot != NULL) {
+		s = sfs_dirhash_getfree(sv->sv_dirhash);
+		if (s >= 0) {
+			*emptyslot = s;
+		}
+	}
+	return ENOENT;
 }
 
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * The directory is scanned a block at a time straight out of the
+ * buffer cache, rather than reading each entry with sfs_io.
  */
 
 static
@@ -647,45 +903,84 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
-	struct sfs_dir tsd;
-	int found = 0;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_dir *sd;
+	uint32_t diskblock;
 	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	bool fits = strlen(name) < sizeof(sd->sfd_name);
+	int base, i, n, result;
+
+	/* Use (or build) the index if the directory is big enough */
+	if (sv->sv_dirhash == NULL && nentries >= SFS_DIRHASH_MINENTRIES) {
+		/* If this fails, just do it the slow way */
+		(void)sfs_dir_buildindex(sv);
+	}
+	if (sv->sv_dirhash != NULL) {
+		return sfs_dir_findindexed(sv, name, ino, slot, emptyslot);
+	}
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	/* For each block... */
+	for (base=0; base<nentries; base += SFS_DIRPERBLOCK) {
+		n = nentries - base;
+		if (n > SFS_DIRPERBLOCK) {
+			n = SFS_DIRPERBLOCK;
+		}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
+		result = sfs_bmap(sv, base / SFS_DIRPERBLOCK, 0, &diskblock);
 		if (result) {
 			return result;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
+		if (diskblock == 0) {
+			/* Unallocated, so all free slots */
 			if (emptyslot != NULL) {
-				*emptyslot = i;
+				*emptyslot = base;
 			}
+			continue;
 		}
-		else {
-			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
 
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+		result = sfs_buf_read(sfs, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		sd = sfs_buf_data(buf);
+
+		/* For each slot in the block... */
+		for (i=0; i<n; i++) {
+			if (sd[i].sfd_ino == SFS_NOINO) {
+				/*
+				 * Free slot - report it back if one
+				 * was requested
+				 */
+				if (emptyslot != NULL) {
+					*emptyslot = base + i;
+				}
+				continue;
+			}
 
-				found = 1;
+			/*
+			 * If NAME fits in sfd_name, strcmp stops inside
+			 * the entry even if it isn't null terminated;
+			 * if it doesn't fit it can't be there. Each
+			 * name may legally appear only once, so stop at
+			 * the first match.
+			 */
+			if (fits && !strcmp(sd[i].sfd_name, name)) {
 				if (slot != NULL) {
-					*slot = i;
+					*slot = base + i;
 				}
 				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
+					*ino = sd[i].sfd_ino;
 				}
+				sfs_buf_release(buf);
+				return 0;
 			}
 		}
+
+		sfs_buf_release(buf);
 	}
 
-	return found ? 0 : ENOENT;
+	return ENOENT;
 }
 
 /*
@@ -697,6 +992,7 @@ int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
+	int nentries;
 	int result;
 	struct sfs_dir sd;
 
@@ -714,8 +1010,9 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* If we didn't get an empty slot, add the entry at the end. */
+	nentries = sfs_dir_nentries(sv);
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		emptyslot = nentries;
 	}
 
 	/* Set up the entry. */
@@ -729,8 +1026,21 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	/* Update the index, if there is one. */
+	if (sv->sv_dirhash != NULL) {
+		if (emptyslot < nentries) {
+			sfs_dirhash_takefree(sv->sv_dirhash, emptyslot);
+		}
+		if (sfs_dirhash_add(sv->sv_dirhash, name, emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -740,14 +1050,35 @@ static
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_dir sd;
+	struct sfs_dir sd, oldsd;
+	int result;
+
+	/* If there's an index we need the old name to update it. */
+	if (sv->sv_dirhash != NULL) {
+		result = sfs_dir_readslot(sv, slot, &oldsd);
+		if (result) {
+			return result;
+		}
+		KASSERT(oldsd.sfd_ino != SFS_NOINO);
+	}
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_dirhash != NULL) {
+		sfs_dirhash_remove(sv->sv_dirhash, oldsd.sfd_name, slot);
+		if (sfs_dirhash_addfree(sv->sv_dirhash, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -774,6 +1105,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	/* Link counts only change with the directory locked. */
 	if ((*ret)->sv_i.sfi_linkcount == 0) {
 		panic("sfs: Link count of file %u found in dir %u is 0\n",
 		      (*ret)->sv_ino, sv->sv_ino);
@@ -787,11 +1119,13 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. The inode
+ * is placed as near to block GOAL as possible.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t goal,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -801,7 +1135,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, goal, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1209,12 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	/*
+	 * Write back the inode. The data is left to the flusher (or
+	 * was written already, in write-through mode); only fsync
+	 * waits for it.
+	 */
+	return sfs_vnode_syncinode(v->vn_data);
 }
 
 /*
@@ -890,31 +1228,50 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnbucket *vb;
+	struct sfs_vnode **pp;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Hold the vnode's bucket in the table so sfs_loadvnode can't
+	 * find it while we're deciding whether to get rid of it.
+	 */
+	vb = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)];
+	lock_acquire(vb->vb_lock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(vb->vb_lock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * Nobody else has a reference, so nobody else can hold the
+	 * vnode's lock and this won't wait, even though it's out of
+	 * the usual order.
+	 */
+	lock_acquire(sv->sv_lock);
+
+	/* Give back any blocks we didn't get around to using. */
+	sfs_prealloc_release(sv);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			lock_release(vb->vb_lock);
 			return result;
 		}
 	}
@@ -922,7 +1279,8 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(vb->vb_lock);
 		return result;
 	}
 
@@ -932,26 +1290,20 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	for (pp = &vb->vb_head; *pp != sv; pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*pp = sv->sv_hashnext;
+	lock_release(vb->vb_lock);
 
+	sfs_dir_dropindex(sv);
+	lock_release(sv->sv_lock);
+	lock_destroy(sv->sv_lock);
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
@@ -969,11 +1321,20 @@ sfs_read(struct vnode *v, struct uio *uio)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
+#if OPT_SFSREADAHEAD
+	off_t start = uio->uio_offset;
+#endif
+
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+#if OPT_SFSREADAHEAD
+	if (result == 0 && uio->uio_offset > start) {
+		sfs_readahead(sv, start, uio->uio_offset);
+	}
+#endif
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1351,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1394,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1416,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type is fixed once the vnode is loaded; no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1091,65 +1451,244 @@ sfs_tryseek(struct vnode *v, off_t pos)
 	return 0;
 }
 
+/* Blocks sfs_fsync collects before handing them to the cache. */
+#define SFS_FSYNCBATCH	64
+
+/*
+ * Blocks of a file collected by sfs_fsync, written back a batch at a
+ * time.
+ */
+struct sfs_fsyncblocks {
+	struct sfs_fs *fb_fs;
+	uint32_t fb_blocks[SFS_FSYNCBATCH];
+	unsigned fb_num;
+	int fb_result;			/* first error writing back */
+};
+
+static
+void
+sfs_fsync_flush(struct sfs_fsyncblocks *fb)
+{
+	int result;
+
+	result = sfs_buf_flushblocks(fb->fb_fs, fb->fb_blocks, fb->fb_num);
+	if (result && fb->fb_result == 0) {
+		fb->fb_result = result;
+	}
+	fb->fb_num = 0;
+}
+
+static
+void
+sfs_fsync_add(struct sfs_fsyncblocks *fb, uint32_t block)
+{
+	if (block == 0) {
+		return;
+	}
+	fb->fb_blocks[fb->fb_num++] = block;
+	if (fb->fb_num == SFS_FSYNCBATCH) {
+		sfs_fsync_flush(fb);
+	}
+}
+
+/*
+ * Collect the blocks in the tree under indirect block IDBLOCK, which
+ * is LEVELS levels above the data, and then IDBLOCK itself.
+ */
+static
+int
+sfs_fsync_tree(struct sfs_fsyncblocks *fb, uint32_t idblock, unsigned levels)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
+	unsigned j;
+	int result;
+
+	if (idblock == 0) {
+		return 0;
+	}
+
+	result = sfs_buf_read(fb->fb_fs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = sfs_buf_data(idbuf);
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (levels > 1) {
+			result = sfs_fsync_tree(fb, idptrs[j], levels - 1);
+			if (result) {
+				sfs_buf_release(idbuf);
+				return result;
+			}
+		}
+		else {
+			sfs_fsync_add(fb, idptrs[j]);
+		}
+	}
+	result = sfs_buf_release(idbuf);
+	sfs_fsync_add(fb, idblock);
+	return result;
+}
+
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync(). Writes back the inode and whichever of the
+ * file's data and indirect blocks are dirty in the buffer cache; the
+ * rest of the volume is left to the flusher. (sfs_sync does the
+ * whole volume.)
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fsyncblocks *fb;
+	unsigned i;
 	int result;
 
-	vfs_biglock_acquire();
+	fb = kmalloc(sizeof(*fb));
+	if (fb == NULL) {
+		return ENOMEM;
+	}
+	fb->fb_fs = v->vn_fs->fs_data;
+	fb->fb_num = 0;
+	fb->fb_result = 0;
+
+	/* Hold the lock so the block map can't change under us. */
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result) {
+		goto out;
+	}
+
+	sfs_fsync_add(fb, sv->sv_ino);
+	for (i=0; i<SFS_NDIRECT; i++) {
+		sfs_fsync_add(fb, sv->sv_i.sfi_direct[i]);
+	}
+	result = sfs_fsync_tree(fb, sv->sv_i.sfi_indirect, 1);
+	if (result == 0) {
+		result = sfs_fsync_tree(fb, sv->sv_i.sfi_dindirect, 2);
+	}
+	if (result == 0) {
+		result = sfs_fsync_tree(fb, sv->sv_i.sfi_tindirect, 3);
+	}
+	sfs_fsync_flush(fb);
+	if (result == 0) {
+		result = fb->fb_result;
+	}
 
+ out:
+	lock_release(sv->sv_lock);
+	kfree(fb);
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Regular files can always be mapped; the pages
+ * are read and written back with VOP_READ and VOP_WRITE. (Directories
+ * use sfs_dirops, which rejects this.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free everything at or past file block BLOCKLEN in the tree under
+ * the indirect block *IDBLOCKP, which is LEVELS levels above the data
+ * and whose first entry maps file block BASE. If that empties the
+ * indirect block, free it too, zero *IDBLOCKP, and set *CHANGED.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_tree(struct sfs_vnode *sv, uint32_t *idblockp, unsigned levels,
+		  uint32_t base, uint32_t blocklen, bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t span, j;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	span = sfs_idspan(levels);
+	if (*idblockp == 0 || blocklen >= base + span * SFS_DBPERIDB) {
+		/* Nothing here, or nothing here past the new EOF */
+		return 0;
+	}
+
+	result = sfs_buf_read(sfs, *idblockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = sfs_buf_data(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (idptrs[j] == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			result = sfs_truncate_tree(sv, &idptrs[j], levels - 1,
+						   base + j * span, blocklen,
+						   &iddirty);
+			if (result) {
+				if (iddirty) {
+					sfs_buf_markdirty(idbuf);
+				}
+				sfs_buf_release(idbuf);
+				return result;
+			}
+		}
+		else if (blocklen <= base + j) {
+			sfs_bfree(sfs, idptrs[j]);
+			idptrs[j] = 0;
+			iddirty = true;
+		}
+		if (idptrs[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		result = sfs_buf_release(idbuf);
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		*changed = true;
+		return result;
+	}
+	if (iddirty) {
+		sfs_buf_markdirty(idbuf);
+	}
+	return sfs_buf_release(idbuf);
+}
+
+/*
+ * Truncate (or extend) SV to LEN bytes. SV must be locked.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block, base;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Preallocated blocks would be past the new EOF; drop them. */
+	sfs_prealloc_release(sv);
 
-	vfs_biglock_acquire();
+	/* The indirect block cache may point at something we free. */
+	sv->sv_idcacheblock = 0;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +1703,24 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	/* Then the trees hanging off the indirect blocks. */
+	base = SFS_NDIRECT;
+	result = sfs_truncate_tree(sv, &sv->sv_i.sfi_indirect, 1, base,
+				   blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+	base += SFS_DBPERIDB;
+	result = sfs_truncate_tree(sv, &sv->sv_i.sfi_dindirect, 2, base,
+				   blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+	base += SFS_DBPERDIDB;
+	result = sfs_truncate_tree(sv, &sv->sv_i.sfi_tindirect, 3, base,
+				   blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
@@ -1220,10 +1729,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,37 +1784,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	/* Didn't exist - create it, near the directory */
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +1823,20 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* Update the linkcount of the new file */
+	/* Update the linkcount of the new file, marking it dirty */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
-
-	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	*ret = &newguy->sv_v;
-	
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1331,20 +1855,29 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* and update the link count, marking the inode dirty */
+	/*
+	 * and update the link count, marking the inode dirty. (The
+	 * file can be the directory itself; it's already locked.)
+	 */
+	if (f != sv) {
+		lock_acquire(f->sv_lock);
+	}
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	if (f != sv) {
+		lock_release(f->sv_lock);
+	}
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +1893,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +1906,18 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,15 +1937,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +1966,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +1981,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +2005,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2029,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* Nothing here looks at the directory's contents; no lock. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2042,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2059,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1651,33 +2187,34 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
+	struct sfs_vnbucket *vb;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	/*
+	 * Look in the vnode table. We keep the bucket locked while
+	 * loading, so nobody else can load the same inode meanwhile.
+	 */
+	vb = &sfs->sfs_vnhash[SFS_VNHASH(ino)];
+	lock_acquire(vb->vb_lock);
 
+	for (sv = vb->vb_head; sv != NULL; sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/* Inodes in memory must be in allocated blocks */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
 			/* May only be set when creating new objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(vb->vb_lock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +2224,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(vb->vb_lock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(vb->vb_lock);
 		return ENOMEM;
 	}
 
@@ -1697,15 +2241,38 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_buf_read(sfs, ino, &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(vb->vb_lock);
 		return result;
 	}
+	memcpy(&sv->sv_i, sfs_buf_data(buf), sizeof(sv->sv_i));
+	sfs_buf_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No directory index until someone looks something up */
+	sv->sv_dirhash = NULL;
+
+	/* Allocate the file's first block just after its inode */
+	sv->sv_lastblock = ino;
+	sv->sv_prestart = 0;
+	sv->sv_prenum = 0;
+
+	/* No indirect block looked up yet */
+	sv->sv_idcacheblock = 0;
+	sv->sv_idcachebase = 0;
+
+#if OPT_SFSREADAHEAD
+	/* A read from the start of the file counts as sequential */
+	sv->sv_raoffset = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+#endif
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,7 +2303,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(vb->vb_lock);
 		return result;
 	}
 
@@ -1744,12 +2313,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sv->sv_hashnext = vb->vb_head;
+	vb->vb_head = sv;
+	lock_release(vb->vb_lock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2333,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -30,6 +30,7 @@
 #ifndef _ADDRSPACE_H_
 #define _ADDRSPACE_H_
 #include "opt-A3.h"
+#include "opt-mmap.h"
 /*
  * Address space structure and operations.
  */
@@ -38,6 +39,7 @@
 #include <vm.h>
 
 struct vnode;
+struct mmap_region;
 
 
 /* 
@@ -66,6 +68,9 @@ struct addrspace {
   bool isLoaded;
   struct array * pt;
 #endif 
+#if OPT_MMAP
+  struct mmap_region *as_mmaps;	/* file mappings, see vm/mmap.c */
+#endif
 };
 
 /*
@@ -0,0 +1,23 @@
+#ifndef _AIO_H_
+#define _AIO_H_
+
+/*
+ * Asynchronous file I/O ("options aio"), see syscall/aio.c.
+ */
+
+#include "opt-aio.h"
+#include "opt-fdtable.h"
+
+#if OPT_AIO && !OPT_FDTABLE
+#error "options aio requires options fdtable"
+#endif
+
+struct aioctx;
+
+/* Start the worker threads. */
+void aio_bootstrap(void);
+
+/* Drop a process's AIO state; called from proc_destroy. */
+void aioctx_release(struct aioctx *ac);
+
+#endif /* _AIO_H_ */
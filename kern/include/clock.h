@@ -44,6 +44,11 @@
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
  *
+ * gettime_nsecs() returns the current time as a single count of
+ * nanoseconds, for timing and statistics code. It returns 0 until
+ * gettime_bootstrap() has been called (once the clock device is
+ * attached), so it is safe to call at any point during boot.
+ *
  * XXX we have struct timespec now, let's use it.
  */
 
@@ -63,6 +68,9 @@ void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
+void gettime_bootstrap(void);
+uint64_t gettime_nsecs(void);
+
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
@@ -54,6 +54,8 @@
  * addressing error was encountered, or (for the string versions)
  * ENAMETOOLONG if the space available was insufficient.
  *
+ * copyoutzeros zeroes LEN bytes at a user-space address USERDEST.
+ *
  * NOTE that the order of the arguments is the same as bcopy() or 
  * cp/mv, that is, source on the left, NOT the same as strcpy().
  * The const qualifiers and types will help protect against mistakes
@@ -68,6 +70,7 @@ int copyin(const_userptr_t usersrc, void *dest, size_t len);
 int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
+int copyoutzeros(userptr_t userdest, size_t len);
 
 
 #endif /* _COPYINOUT_H_ */
@@ -34,6 +34,8 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <kern/schedstats.h>
+#include "opt-schedstats.h"
 
 
 /*
@@ -68,6 +70,9 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+#if OPT_SCHEDSTATS
+	struct schedstats c_schedstats;	/* Scheduler statistics */
+#endif
 
 	/*
 	 * Accessed by other cpus.
@@ -36,6 +36,17 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
+
+/*
+ * Loaded vnodes are hashed by handle. Names looked up are cached in
+ * a small direct-mapped table; each entry holds references to the
+ * directory and the vnode found, so the vnode (and its host handle)
+ * stays open while it's cached.
+ */
+#define EMUFS_VNHASHSIZE	32
+#define EMUFS_NCSIZE		32
+#define EMUFS_NCNAMELEN		48
 
 /*
  * Our structures
@@ -45,13 +56,30 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+	struct lock *ev_lock;		/* serializes I/O on this handle */
+	char *ev_rabuf;			/* read cache (EMU_MAXIO) or NULL */
+	off_t ev_raoff;			/* file offset of ev_rabuf[0] */
+	uint32_t ev_ralen;		/* valid bytes in ev_rabuf */
+	bool ev_sizevalid;		/* ev_size is cached */
+	off_t ev_size;			/* file size */
+	time_t ev_sizetime;		/* when ev_size was fetched */
+	struct emufs_vnode *ev_hashnext; /* vnode table chain */
+};
+
+struct emufs_ncentry {
+	struct emufs_vnode *nc_dir;	/* NULL if unused */
+	struct emufs_vnode *nc_vn;
+	char nc_name[EMUFS_NCNAMELEN];
+	time_t nc_time;			/* when entered */
 };
 
 struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
-	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+	struct emufs_vnode *ef_vnhash[EMUFS_VNHASHSIZE]; /* loaded vnodes */
+	struct spinlock ef_nclock;	/* protects ef_ncache */
+	struct emufs_ncentry ef_ncache[EMUFS_NCSIZE];
 };
 
 
@@ -0,0 +1,62 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file tables ("options fdtable").
+ *
+ * An openfile is what open() creates: a vnode plus the state that's
+ * shared by every descriptor that refers to it (through dup2 or
+ * fork), namely the access mode and the seek position. The seek
+ * position is protected by of_lock, which is held across each read
+ * or write on a seekable file so concurrent users of the same
+ * openfile see each other's updates atomically. Non-seekable objects
+ * (the console) don't need it and don't take it.
+ *
+ * A filetable is an array of openfile pointers indexed by file
+ * descriptor. It belongs to one process and is protected by its own
+ * spinlock, so looking up a descriptor never touches anything global.
+ * filetable_get hands back a reference to the openfile, so a
+ * concurrent close can't free it while I/O is in progress.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+#include "opt-fdtable.h"
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vn;		/* the file */
+	int of_flags;			/* flags from open() */
+	bool of_seekable;		/* whether of_offset means anything */
+	struct lock *of_lock;		/* protects of_offset */
+	off_t of_offset;		/* seek position */
+	struct spinlock of_reflock;	/* protects of_refcount */
+	unsigned of_refcount;		/* descriptors (and I/O) using it */
+};
+
+struct filetable {
+	struct spinlock ft_lock;
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/* Open PATH (which may be destroyed) and make an openfile for it. */
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+void filetable_copy(struct filetable *src, struct filetable *dst);
+int filetable_openstdio(struct filetable *ft);
+
+/* Put OF in the lowest free slot; consumes the caller's reference. */
+int filetable_add(struct filetable *ft, struct openfile *of, int *fd);
+/* Get a new reference to the openfile for FD. */
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+/* Make NEWFD refer to what OLDFD does, closing NEWFD first. */
+int filetable_dup2(struct filetable *ft, int oldfd, int newfd);
+int filetable_close(struct filetable *ft, int fd);
+
+#endif /* _FILE_H_ */
@@ -0,0 +1,62 @@
+#ifndef _KERN_AIO_H_
+#define _KERN_AIO_H_
+
+/*
+ * Definitions for aio_submit() and aio_reap(), shared with userland.
+ *
+ * aio_submit(cbs, n) queues the N transfers described by the array
+ * CBS and returns how many it queued. It stops at the first bad one;
+ * if that's the first, it fails with its error instead. The data is
+ * held in the kernel while a transfer is queued, and there's only so
+ * much room for it; when that's used up (by any process), or the
+ * process has AIO_MAXPENDING transfers unreaped, the error is EAGAIN.
+ *
+ * aio_reap(evs, min, max) waits until at least MIN of the process's
+ * transfers have finished (or until none are left in progress),
+ * stores up to MAX completions in EVS, and returns how many. Reads
+ * land in the caller's buffer when they're reaped, not before.
+ *
+ * Transfers are positional, like pread/pwrite, so they need a
+ * seekable file and don't move its seek position.
+ */
+
+/* Operations (aio_op) */
+#define AIO_READ      0      /* Read from the file into aio_buf */
+#define AIO_WRITE     1      /* Write aio_buf to the file */
+
+/* Limits */
+#define AIO_MAXIO     65536  /* Largest single transfer */
+#define AIO_MAXPENDING 64    /* Transfers per process not yet reaped */
+
+/*
+ * Pointers here are user pointers; see <kern/iovec.h> for why the
+ * kernel gives them a different type.
+ */
+struct aiocb {
+	int aio_fildes;			/* File to transfer to or from */
+	int aio_op;			/* AIO_READ or AIO_WRITE */
+#ifdef _KERNEL
+	userptr_t aio_buf;		/* Buffer */
+#else
+	void *aio_buf;
+#endif
+	size_t aio_nbytes;		/* Length of transfer */
+	off_t aio_offset;		/* Position in the file */
+#ifdef _KERNEL
+	userptr_t aio_data;		/* Returned as is in the completion */
+#else
+	void *aio_data;
+#endif
+};
+
+struct aio_event {
+#ifdef _KERNEL
+	userptr_t ae_data;		/* aio_data from the request */
+#else
+	void *ae_data;
+#endif
+	int ae_error;			/* 0, or the error it failed with */
+	size_t ae_count;		/* Bytes transferred */
+};
+
+#endif /* _KERN_AIO_H_ */
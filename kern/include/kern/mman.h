@@ -0,0 +1,20 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap() and munmap(), shared with userland.
+ */
+
+/* Protections (the PROT argument); combine with | */
+#define PROT_NONE     0
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+
+/* Flags (the FLAGS argument); exactly one of MAP_SHARED/MAP_PRIVATE */
+#define MAP_SHARED    0x1    /* Writes go back to the file */
+#define MAP_PRIVATE   0x2    /* Writes are private to the process */
+#define MAP_FIXED     0x10   /* Map at exactly ADDR (not supported) */
+
+
+#endif /* _KERN_MMAN_H_ */
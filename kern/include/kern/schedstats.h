@@ -0,0 +1,28 @@
+#ifndef _KERN_SCHEDSTATS_H_
+#define _KERN_SCHEDSTATS_H_
+
+/*
+ * Per-cpu scheduler statistics, as returned by __schedstats().
+ *
+ * Times are in nanoseconds. Latency is measured from the moment a
+ * thread is put on a run queue until it is switched to. The run
+ * queue length histogram is sampled at every context switch; bucket
+ * 0 counts empty queues and bucket i (i > 0) counts lengths from
+ * 2^(i-1) to 2^i - 1, with the last bucket taking everything longer.
+ */
+
+#define SCHEDSTATS_RQBUCKETS	8
+
+struct schedstats {
+	__u32 ss_cpu;			/* cpu number */
+	__u32 ss_switches;		/* context switches */
+	__u32 ss_latcount;		/* latency samples */
+	__u64 ss_lattotal;		/* total runnable-to-running time */
+	__u64 ss_latmax;		/* worst runnable-to-running time */
+	__u32 ss_migrated_in;		/* threads migrated to this cpu */
+	__u32 ss_migrated_out;		/* threads migrated away */
+	__u64 ss_idletime;		/* time spent in cpu_idle */
+	__u32 ss_rqlen[SCHEDSTATS_RQBUCKETS];	/* run queue lengths */
+};
+
+#endif /* _KERN_SCHEDSTATS_H_ */
@@ -0,0 +1,19 @@
+#ifndef _KERN_SYSCALLSTATS_H_
+#define _KERN_SYSCALLSTATS_H_
+
+/*
+ * Per-syscall statistics, as returned by __syscallstats().
+ *
+ * Times are in nanoseconds, from the start of argument decoding
+ * until the call returns to the dispatcher. Calls that don't return
+ * (_exit, and execv when it succeeds) aren't counted.
+ */
+
+struct syscallstat {
+	__u32 sc_count;			/* calls made */
+	__u32 sc_errors;		/* calls that failed */
+	__u64 sc_lattotal;		/* total time in the call */
+	__u64 sc_latmax;		/* worst time in the call */
+};
+
+#endif /* _KERN_SYSCALLSTATS_H_ */
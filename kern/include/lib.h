@@ -145,6 +145,14 @@ char *strtok_r(char *buf, const char *seps, char **context);
 void *memcpy(void *dest, const void *src, size_t len);
 void *memmove(void *dest, const void *src, size_t len);
 void bzero(void *ptr, size_t len);
+
+/*
+ * Faster versions for large, non-overlapping buffers; best when both
+ * are word-aligned. Machine-dependent.
+ */
+void fastcopy(void *dest, const void *src, size_t len);
+void fastzero(void *ptr, size_t len);
+
 int atoi(const char *str);
 
 int snprintf(char *buf, size_t maxlen, const char *fmt, ...) __PF(3,4);
@@ -0,0 +1,89 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler.
+ *
+ * Only built with "options lockprof". A struct lockprof is embedded
+ * in each sleep lock and wait channel, and can be attached to any
+ * spinlock; all of them are kept on a global list so the worst
+ * offenders can be dumped from the menu (the "lp" command).
+ *
+ * What the fields mean depends on the kind of object:
+ *
+ *                 spinlock          lock               wchan
+ *   acquires      acquires          acquires           wc_lock acquires
+ *   contended     had to spin       had to sleep       wc_lock had to spin
+ *   spinns        time spinning     -                  time spinning
+ *   sleeps        -                 times slept        threads slept
+ *   sleepns       -                 time asleep        time asleep
+ *   maxholdns     longest hold      longest hold       longest wc_lock hold
+ *
+ * Counters are updated by the holder of the profiled object, so they
+ * need no locking of their own. Times are in nanoseconds and are only
+ * collected once there is a clock (see gettime_nsecs in <clock.h>);
+ * before then only the counts advance.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+struct spinlock;
+
+#define LOCKPROF_SPINLOCK	0
+#define LOCKPROF_LOCK		1
+#define LOCKPROF_WCHAN		2
+
+struct lockprof {
+	const char *lp_name;		/* name; not copied */
+	unsigned lp_kind;		/* LOCKPROF_* */
+	unsigned lp_acquires;
+	unsigned lp_contended;
+	uint64_t lp_spinns;
+	unsigned lp_sleeps;
+	uint64_t lp_sleepns;
+	uint64_t lp_maxholdns;
+	uint64_t lp_holdstart;		/* time current hold began */
+	struct lockprof *lp_prev;	/* global list */
+	struct lockprof *lp_next;
+};
+
+/*
+ * Set up / tear down a record. init puts it on the global list;
+ * cleanup must be called before the memory holding it goes away.
+ * NAME must remain valid until cleanup.
+ */
+void lockprof_init(struct lockprof *lp, const char *name, unsigned kind);
+void lockprof_cleanup(struct lockprof *lp);
+
+/*
+ * Allocate a spinlock record and attach it to LK. For long-lived
+ * spinlocks only; the record is never freed.
+ */
+void lockprof_attach(struct spinlock *lk, const char *name);
+
+/*
+ * Events, called by the synchronization code with the profiled
+ * object held.
+ *
+ * acquired	the object was acquired; CONTENDED says whether we had
+ *		to wait for it.
+ * spun		a spinlock was acquired; SPUN says whether we had to
+ *		spin, and if so the spinning began at WAITSTART.
+ * slept	a sleep (in lock_acquire or on a wchan) that began at
+ *		WAITSTART has just ended.
+ * released	the object is about to be released; account the hold.
+ */
+void lockprof_acquired(struct lockprof *lp, bool contended);
+void lockprof_spun(struct lockprof *lp, bool spun, uint64_t waitstart);
+void lockprof_slept(struct lockprof *lp, uint64_t waitstart);
+void lockprof_released(struct lockprof *lp);
+
+/* Print the N most contended objects; zero all counters. */
+void lockprof_print(unsigned n);
+void lockprof_reset(void);
+
+#endif /* OPT_LOCKPROF */
+
+#endif /* _LOCKPROF_H_ */
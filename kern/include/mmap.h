@@ -0,0 +1,49 @@
+#ifndef _MMAP_H_
+#define _MMAP_H_
+
+/*
+ * File-backed memory regions ("options mmap"), see vm/mmap.c.
+ */
+
+#include "opt-mmap.h"
+#include "opt-fdtable.h"
+#include "opt-A3.h"
+
+#if OPT_MMAP && !OPT_FDTABLE
+#error "options mmap requires options fdtable"
+#endif
+#if OPT_MMAP && !OPT_A3
+#error "options mmap requires options A3"
+#endif
+
+struct addrspace;
+struct uio;
+struct vnode;
+
+/* Map LEN bytes of VN starting at OFFSET; hands back the address. */
+int mmap_create(struct addrspace *as, size_t len, int prot, int flags,
+		struct vnode *vn, off_t offset, vaddr_t *ret);
+/* Unmap the regions in [ADDR, ADDR+LEN). */
+int mmap_remove(struct addrspace *as, vaddr_t addr, size_t len);
+/* Write back AS's dirty shared pages of VN. */
+int mmap_sync(struct addrspace *as, struct vnode *vn);
+
+/*
+ * Handle a fault on a mapped page. Returns false if ADDR isn't in a
+ * mapping; otherwise returns true and puts the result in *RESULT.
+ */
+bool mmap_fault(struct addrspace *as, int faulttype, vaddr_t addr,
+		int *result);
+
+/*
+ * Read in any of AS's mapped pages that the user buffers of UIO
+ * cover, before the transfer starts. mmap_fault won't do this while
+ * t_mmapnofill is set.
+ */
+int mmap_prefault(struct addrspace *as, const struct uio *uio);
+
+/* For as_copy and as_destroy. */
+int mmap_copy(struct addrspace *old, struct addrspace *new);
+void mmap_destroyall(struct addrspace *as);
+
+#endif /* _MMAP_H_ */
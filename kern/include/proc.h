@@ -36,12 +36,20 @@
  * Note: curproc is defined by <current.h>.
  */
 #include "opt-A2.h"
+#include "opt-fdtable.h"
+#include "opt-aio.h"
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
 
 struct vnode;
+#if OPT_FDTABLE
+struct filetable;
+#endif
+#if OPT_AIO
+struct aioctx;
+#endif
 
 #ifdef UW
 struct semaphore;
@@ -71,6 +79,12 @@ struct proc {
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+#if OPT_FDTABLE
+	struct filetable *p_files;	/* open files */
+#endif
+#if OPT_AIO
+	struct aioctx *p_aio;		/* asynchronous I/O, or NULL */
+#endif
 
 #ifdef UW
   /* a vnode to refer to the console device */
@@ -48,21 +48,84 @@
  */
 #include <kern/sfs.h>
 
+#include "opt-sfswriteback.h"
+#include "opt-sfsreadahead.h"
+
+/*
+ * Locking. Each vnode has a sleep lock, sv_lock, covering its inode,
+ * its contents, and the fields of struct sfs_vnode (except
+ * sv_hashnext, which belongs to the vnode table). Each volume has
+ * sfs_freemaplock for the freemap, region counts, and superblock;
+ * each bucket of the vnode table has a lock; and the buffer cache
+ * has its own (see sfs_buf.c). Take them in that order: directory,
+ * then file, then vnode table, then freemap, then buffer cache.
+ *
+ * Don't drop a reference to a vnode while holding its lock; that may
+ * reclaim it.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
+	struct lock *sv_lock;           /* per-vnode lock */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_dirhash *sv_dirhash; /* name index (big dirs only) */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
+	uint32_t sv_lastblock;          /* last block mapped, for goal */
+	uint32_t sv_prestart;           /* preallocated blocks... */
+	unsigned sv_prenum;             /* ...and how many */
+	uint32_t sv_idcacheblock;       /* last single indirect block used */
+	uint32_t sv_idcachebase;        /* first file block it maps */
+#if OPT_SFSREADAHEAD
+	off_t sv_raoffset;              /* where a sequential read starts */
+	uint32_t sv_raend;              /* first block not yet read ahead */
+	unsigned sv_rawindow;           /* read-ahead window, in blocks */
+#endif
+};
+
+/*
+ * Blocks preallocated at a time for a file being appended to.
+ */
+#define SFS_PREALLOC		8
+
+/*
+ * The allocator keeps a count of free blocks per region of this many
+ * blocks (64 bytes of freemap).
+ */
+#define SFS_REGIONBLOCKS	512
+
+/*
+ * Read-ahead window limits, in blocks. The maximum matches the
+ * largest request the buffer cache will send to the disk.
+ */
+#define SFS_RA_MINWINDOW	2
+#define SFS_RA_MAXWINDOW	16
+
+/*
+ * Table of loaded vnodes, hashed by inode number. Each bucket has
+ * its own lock, which is held while looking up, loading, or
+ * reclaiming a vnode in that bucket.
+ */
+#define SFS_VNHASHSIZE	64
+#define SFS_VNHASH(ino)	((ino) % SFS_VNHASHSIZE)
+
+struct sfs_vnbucket {
+	struct lock *vb_lock;
+	struct sfs_vnode *vb_head;
 };
 
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
+	struct lock *sfs_freemaplock;   /* for superblock and freemap */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnbucket sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t *sfs_regionfree;       /* free blocks in each region */
+	unsigned sfs_nregions;
 };
 
 /*
@@ -84,8 +147,74 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/*
+ * Buffer cache (sfs_buf.c). Indirect blocks, inodes, and file data
+ * go through the cache; the superblock and freemap are read and
+ * written directly with sfs_rblock/sfs_wblock.
+ *
+ * sfs_buf_read gets a block, reading it in if it isn't cached.
+ * sfs_buf_get gets a block the caller will overwrite entirely.
+ * Change the data only between get/read and release, and call
+ * sfs_buf_markdirty to have the change written back, or
+ * sfs_buf_markfailed if the change failed partway. With
+ * "options sfswriteback" that happens later, in the background;
+ * sfs_buf_flush forces it for a volume, and sfs_buf_flushblocks
+ * for a list of blocks. With "options sfsreadahead",
+ * sfs_buf_prefetch asks for blocks to be read in the background.
+ */
+struct sfs_buf;
+void sfs_buf_bootstrap(void);
+int sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void *sfs_buf_data(struct sfs_buf *buf);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+void sfs_buf_markfailed(struct sfs_buf *buf);
+int sfs_buf_release(struct sfs_buf *buf);
+int sfs_buf_flush(struct sfs_fs *sfs);
+int sfs_buf_flushblocks(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n);
+void sfs_buf_purge(struct sfs_fs *sfs);
+void sfs_buf_forget(struct sfs_fs *sfs, uint32_t block);
+void sfs_buf_setmax(unsigned max);
+unsigned sfs_buf_getmax(void);
+void sfs_buf_printstats(void);
+#if OPT_SFSWRITEBACK
+int sfs_buf_startflusher(void);
+void sfs_buf_setwriteback(unsigned interval, unsigned ratio);
+#endif
+#if OPT_SFSREADAHEAD
+int sfs_buf_startreadahead(void);
+void sfs_buf_prefetch(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n);
+#endif
+
+/*
+ * Block allocator (sfs_alloc.c).
+ */
+int sfs_alloc_init(struct sfs_fs *sfs);
+void sfs_alloc_cleanup(struct sfs_fs *sfs);
+int sfs_alloc_block(struct sfs_fs *sfs, uint32_t goal, uint32_t *ret);
+int sfs_alloc_extent(struct sfs_fs *sfs, uint32_t goal, unsigned maxlen,
+		     uint32_t *start, unsigned *len);
+void sfs_alloc_free(struct sfs_fs *sfs, uint32_t block);
+
+/*
+ * Directory name index (sfs_dirhash.c). Maps names to candidate
+ * slots, which the caller must check, and tracks free slots.
+ */
+struct sfs_dirhash;
+struct sfs_dirhash *sfs_dirhash_create(void);
+void sfs_dirhash_destroy(struct sfs_dirhash *dh);
+int sfs_dirhash_add(struct sfs_dirhash *dh, const char *name, int slot);
+void sfs_dirhash_remove(struct sfs_dirhash *dh, const char *name, int slot);
+int sfs_dirhash_next(struct sfs_dirhash *dh, const char *name, void **cursor);
+int sfs_dirhash_addfree(struct sfs_dirhash *dh, int slot);
+int sfs_dirhash_getfree(struct sfs_dirhash *dh);
+void sfs_dirhash_takefree(struct sfs_dirhash *dh, int slot);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Write a vnode's inode to the buffer cache if it has changed. */
+int sfs_vnode_syncinode(struct sfs_vnode *sv);
+
 
 #endif /* _SFS_H_ */
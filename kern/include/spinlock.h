@@ -36,6 +36,8 @@
  */
 
 #include <cdefs.h>
+#include "opt-ticketlock.h"
+#include "opt-lockprof.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -55,14 +57,48 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
+#if OPT_TICKETLOCK
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket now being served. */
+#else
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+#endif
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+
+	/* Statistics; updated only by the holder. */
+	unsigned lk_acquires;		/* Number of times acquired. */
+	unsigned lk_contended;		/* Acquires that had to wait. */
+	unsigned lk_spins;		/* Total backoff rounds spent waiting. */
+#if OPT_LOCKPROF
+	struct lockprof *lk_prof;	/* Contention profile, if attached. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKPROF
+#define SPINLOCK_PROF_INITIALIZER	, NULL
+#else
+#define SPINLOCK_PROF_INITIALIZER
+#endif
+#if OPT_TICKETLOCK
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, 0 \
+				  SPINLOCK_PROF_INITIALIZER }
+#else
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, 0 \
+				  SPINLOCK_PROF_INITIALIZER }
+#endif
+
+/*
+ * Snapshot of a spinlock's counters, as returned by spinlock_getstats.
+ */
+struct spinlock_stats {
+	unsigned ss_acquires;
+	unsigned ss_contended;
+	unsigned ss_spins;
+};
 
 /*
  * Spinlock functions.
@@ -74,6 +110,16 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * getstats	Copy out the acquire/contention/spin counters.
+ * resetstats	Zero the counters.
+ *
+ * When the kernel is built with "options ticketlock", spinlocks are
+ * FIFO ticket locks: each acquirer takes a ticket with an atomic
+ * fetch-and-add and waits for its number to come up, so CPUs are
+ * served in arrival order. Otherwise they are test-and-test-and-set
+ * locks. Either way, waiters back off exponentially between polls of
+ * the lock word to keep the cache line quiet.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +130,8 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_getstats(struct spinlock *lk, struct spinlock_stats *ss);
+void spinlock_resetstats(struct spinlock *lk);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <lockprof.h>
 
 /*
  * Dijkstra-style semaphore.
@@ -79,6 +80,9 @@ struct lock {
         volatile struct thread *held_thread;
         struct wchan *lock_wchan;
         struct spinlock lock_sl;
+#if OPT_LOCKPROF
+        struct lockprof lock_prof;
+#endif
 };
 
 struct lock *lock_create(const char *name);
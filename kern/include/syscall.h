@@ -30,6 +30,11 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "opt-A2.h"
+#include "opt-schedstats.h"
+#include "opt-syscallstats.h"
+#include "opt-aio.h"
+#include "opt-fdtable.h"
+#include "opt-mmap.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -39,6 +44,14 @@ struct trapframe; /* from <machine/trapframe.h> */
 
 void syscall(struct trapframe *tf);
 
+#if OPT_SYSCALLSTATS
+/* Per-syscall statistics (see <kern/syscallstats.h>), kept by syscall(). */
+struct syscallstat;
+int syscall_getstats(int callno, struct syscallstat *st, unsigned *ncalls);
+void syscall_resetstats(void);
+void syscall_printstats(void);
+#endif
+
 /*
  * Support functions.
  */
@@ -62,12 +75,44 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
+#if OPT_SCHEDSTATS
+int sys___schedstats(unsigned cpunum, userptr_t user_stats, int32_t *retval);
+#endif
+
+#if OPT_SYSCALLSTATS
+int sys___syscallstats(int callno, userptr_t user_stats, int32_t *retval);
+#endif
+
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
+#if OPT_FDTABLE
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_read(int fd, userptr_t ubuf, unsigned int nbytes, int *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_pread(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_pwrite(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_close(int fd);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_fsync(int fd);
+int sys_sendfile(int outfd, int infd, userptr_t offp, size_t count,
+		 int *retval);
+#if OPT_MMAP
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+#endif
+#if OPT_AIO
+int sys_aio_submit(const_userptr_t cbs, int ncbs, int *retval);
+int sys_aio_reap(userptr_t evs, int min, int max, int *retval);
+#endif
+#endif
+
 #if OPT_A2
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(const_userptr_t path, userptr_t argv);
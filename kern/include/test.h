@@ -59,6 +59,7 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int spinlocktest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -74,11 +75,20 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int bufcachetest(int, char **);
+int dirhashtest(int, char **);
+
+/* vm tests */
+int mmaptest(int, char **);
+
+/* system call tests */
+int aiotest(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
 int nettest(int, char **);
+int lhdqueuetest(int, char **);
 
 /* Routine for running a user-level program. */
 #if OPT_A2
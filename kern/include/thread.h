@@ -40,8 +40,12 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include "opt-A2.h"
+#include "opt-lockprof.h"
+#include "opt-mmap.h"
+#include "opt-schedstats.h"
 
 struct cpu;
+struct schedstats;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -84,6 +88,15 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+#if OPT_LOCKPROF
+	uint64_t t_sleepstart;		/* When we went to sleep (lockprof) */
+#endif
+#if OPT_SCHEDSTATS
+	uint64_t t_readytime;		/* When we were made runnable */
+#endif
+#if OPT_MMAP
+	bool t_mmapnofill;		/* In file I/O; see mmap_fault */
+#endif
 
 	/*
 	 * Interrupt state fields.
@@ -134,6 +147,9 @@ void thread_panic(void);
 /* Call during system shutdown to offline other CPUs. */
 void thread_shutdown(void);
 
+/* Return the number of CPUs that have been brought up. */
+unsigned thread_numcpus(void);
+
 /*
  * Make a new thread, which will start executing at "func". The thread
  * will belong to the process "proc", or to the current thread's
@@ -172,5 +188,19 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+#if OPT_SCHEDSTATS
+/*
+ * Scheduler statistics (see <kern/schedstats.h>).
+ *
+ * Times are only collected once there is a clock (see gettime_nsecs
+ * in <clock.h>); until then only counts advance.
+ * thread_getschedstats copies out one cpu's stats, or returns EINVAL
+ * if there is no such cpu.
+ * thread_printschedstats prints them all.
+ */
+int thread_getschedstats(unsigned cpunum, struct schedstats *ss);
+void thread_printschedstats(void);
+#endif
+
 
 #endif /* _THREAD_H_ */
@@ -32,6 +32,7 @@
 
 
 #include <array.h>
+#include "opt-namecache.h"
 
 
 /*
@@ -174,6 +175,29 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
 
+#if OPT_NAMECACHE
+/*
+ * Pathname component cache (vfscache.c).
+ *
+ *    vfs_ncache_lookup     - look up NAME in DIR; true if cached, with
+ *                            *RESULT a new reference or NULL if NAME is
+ *                            known not to exist; on a miss, *GEN is
+ *                            set for passing to vfs_ncache_enter
+ *    vfs_ncache_enter      - cache NAME in DIR as VN (NULL: nonexistent),
+ *                            unless something was invalidated since
+ *                            the miss that returned GEN
+ *    vfs_ncache_invalidate - forget NAME in DIR
+ *    vfs_ncache_purgefs    - forget everything about FS (for unmount)
+ */
+bool vfs_ncache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **result, unsigned *gen);
+void vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_ncache_invalidate(struct vnode *dir, const char *name);
+void vfs_ncache_purgefs(struct fs *fs);
+void vfs_ncache_printstats(void);
+#endif
+
 /*
  * Array of vnodes.
  */
@@ -185,8 +209,11 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global lock for the VFS layer's own tables: the list of known
+ * devices and mounted filesystems, and the boot filesystem. It is
+ * held across mount, unmount, and sync. Filesystems lock their own
+ * state (SFS per volume and per vnode) and vnode counts have their
+ * own lock, so ordinary file operations don't take it.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -81,5 +81,13 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Move all threads sleeping on FROM onto TO without waking them, so
+ * that they are woken (one at a time, if TO is a lock's channel) by
+ * whoever wakes TO. Neither channel should already be locked. Used
+ * for wait morphing in cv_broadcast.
+ */
+void wchan_requeue(struct wchan *from, struct wchan *to);
+
 
 #endif /* _WCHAN_H_ */
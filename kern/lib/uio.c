@@ -82,12 +82,13 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 
 		switch (uio->uio_segflg) {
 		    case UIO_SYSSPACE:
+			    /* kernel buffers here never overlap */
 			    result = 0;
 			    if (uio->uio_rw == UIO_READ) {
-				    memmove(iov->iov_kbase, ptr, size);
+				    fastcopy(iov->iov_kbase, ptr, size);
 			    }
 			    else {
-				    memmove(ptr, iov->iov_kbase, size);
+				    fastcopy(ptr, iov->iov_kbase, size);
 			    }
 			    iov->iov_kbase = ((char *)iov->iov_kbase+size);
 			    break;
@@ -122,24 +123,56 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 int
 uiomovezeros(size_t n, struct uio *uio)
 {
-	/* static, so initialized as zero */
-	static char zeros[16];
-	size_t amt;
+	struct iovec *iov;
+	size_t size;
 	int result;
 
 	/* This only makes sense when reading */
 	KASSERT(uio->uio_rw == UIO_READ);
 
-	while (n > 0) {
-		amt = sizeof(zeros);
-		if (amt > n) {
-			amt = n;
+	/*
+	 * Same walk as uiomove, but zero each piece in place rather
+	 * than copying from a small static buffer of zeros.
+	 */
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+
+		if (size > n) {
+			size = n;
 		}
-		result = uiomove(zeros, amt, uio);
-		if (result) {
-			return result;
+
+		if (size == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			if (uio->uio_iovcnt == 0) {
+				panic("uiomovezeros: ran out of buffers\n");
+			}
+			continue;
 		}
-		n -= amt;
+
+		switch (uio->uio_segflg) {
+		    case UIO_SYSSPACE:
+			    fastzero(iov->iov_kbase, size);
+			    iov->iov_kbase = ((char *)iov->iov_kbase+size);
+			    break;
+		    case UIO_USERSPACE:
+		    case UIO_USERISPACE:
+			    result = copyoutzeros(iov->iov_ubase, size);
+			    if (result) {
+				    return result;
+			    }
+			    iov->iov_ubase += size;
+			    break;
+		    default:
+			    panic("uiomovezeros: Invalid uio_segflg %d\n",
+				  (int)uio->uio_segflg);
+		}
+
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		n -= size;
 	}
 
 	return 0;
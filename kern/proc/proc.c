@@ -54,6 +54,12 @@
 #include <kern/fcntl.h>
 #include <kern/wait.h>
 #include "opt-A2.h"
+#if OPT_FDTABLE
+#include <file.h>
+#endif
+#if OPT_AIO
+#include <aio.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -105,6 +111,12 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+#if OPT_FDTABLE
+	proc->p_files = NULL;
+#endif
+#if OPT_AIO
+	proc->p_aio = NULL;
+#endif
 
 #ifdef UW
 	proc->console = NULL;
@@ -167,6 +179,19 @@ proc_destroy(struct proc *proc)
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
+#if OPT_FDTABLE
+	if (proc->p_files) {
+		filetable_destroy(proc->p_files);
+		proc->p_files = NULL;
+	}
+#endif
+#if OPT_AIO
+	if (proc->p_aio) {
+		/* Anything still in flight keeps it alive until done. */
+		aioctx_release(proc->p_aio);
+		proc->p_aio = NULL;
+	}
+#endif
 
 
 #ifndef UW  // in the UW version, space destruction occurs in sys_exit, not here
@@ -299,7 +324,9 @@ struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
+#if defined(UW) && !OPT_FDTABLE
 	char *console_path;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
@@ -314,7 +341,7 @@ proc_create_runprogram(const char *name)
     }
 #endif
 
-#ifdef UW
+#if defined(UW) && !OPT_FDTABLE
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
@@ -324,7 +351,7 @@ proc_create_runprogram(const char *name)
 	  panic("unable to open the console during process creation\n");
 	}
 	kfree(console_path);
-#endif // UW
+#endif // UW && !OPT_FDTABLE
 	  
 	/* VM fields */
 
@@ -358,6 +385,19 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+#if OPT_FDTABLE
+	/*
+	 * Start with no open files; runprogram opens the console,
+	 * and fork copies the parent's table. (Done last so that
+	 * proc_destroy can undo everything above.)
+	 */
+	proc->p_files = filetable_create();
+	if (proc->p_files == NULL) {
+		proc_destroy(proc);
+		return NULL;
+	}
+#endif
+
 	return proc;
 }
 
@@ -49,7 +49,10 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <aio.h>
+#include <sfs.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-sfs.h"
 
 
 /*
@@ -111,6 +114,9 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+#if OPT_SFS
+	sfs_buf_bootstrap();
+#endif
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -120,6 +126,8 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+	/* The clock is attached now; start collecting times. */
+	gettime_bootstrap();
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
@@ -129,6 +137,9 @@ boot(void)
 #if OPT_A3
 	initialize_coremap();
 #endif 
+#if OPT_AIO
+	aio_bootstrap();
+#endif
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
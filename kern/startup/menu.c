@@ -42,9 +42,12 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <lockprof.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-mmap.h"
+#include "opt-aio.h"
 #include "opt-A2.h"
 /*
  * In-kernel menu and command dispatcher.
@@ -400,6 +403,138 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_SCHEDSTATS
+/*
+ * Command for printing the scheduler statistics.
+ */
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printschedstats();
+	return 0;
+}
+#endif
+
+#if OPT_SYSCALLSTATS
+/*
+ * Command for printing (or clearing) the per-syscall statistics.
+ */
+static
+int
+cmd_syscallstats(int nargs, char **args)
+{
+	if (nargs > 2 || (nargs == 2 && strcmp(args[1], "reset"))) {
+		kprintf("Usage: sc [reset]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		syscall_resetstats();
+		return 0;
+	}
+
+	syscall_printstats();
+	return 0;
+}
+#endif
+
+#if OPT_SFS
+/*
+ * Command for printing the SFS buffer cache statistics, and
+ * optionally setting the cache size.
+ */
+static
+int
+cmd_bufcache(int nargs, char **args)
+{
+	int max;
+
+	if (nargs > 2) {
+		kprintf("Usage: bc [nbufs]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		max = atoi(args[1]);
+		if (max <= 0) {
+			kprintf("bc: invalid buffer count\n");
+			return EINVAL;
+		}
+		sfs_buf_setmax(max);
+	}
+
+	sfs_buf_printstats();
+	return 0;
+}
+
+#if OPT_SFSWRITEBACK
+/*
+ * Command for setting the buffer cache flusher's interval (seconds)
+ * and dirty ratio (percent).
+ */
+static
+int
+cmd_writeback(int nargs, char **args)
+{
+	int interval, ratio;
+
+	if (nargs != 3) {
+		kprintf("Usage: wb interval ratio\n");
+		return EINVAL;
+	}
+	interval = atoi(args[1]);
+	ratio = atoi(args[2]);
+	if (interval <= 0 || ratio <= 0 || ratio > 100) {
+		kprintf("wb: interval must be positive and ratio 1-100\n");
+		return EINVAL;
+	}
+
+	sfs_buf_setwriteback(interval, ratio);
+	return 0;
+}
+#endif
+#endif
+
+#if OPT_NAMECACHE
+/*
+ * Command for printing the name cache statistics.
+ */
+static
+int
+cmd_namecache(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_ncache_printstats();
+	return 0;
+}
+#endif
+
+#if OPT_LOCKPROF
+/*
+ * Command for dumping the lock contention profile.
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: lp [count | reset]\n");
+		return EINVAL;
+	}
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+		return 0;
+	}
+
+	lockprof_print(nargs == 2 ? atoi(args[1]) : 10);
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -469,6 +604,8 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sl1] Spinlock stress test          ",
+	"[lhd1] Disk queue merging and C-LOOK",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -478,6 +615,16 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if OPT_SFS
+	"[sfs1] SFS buffer cache errors      ",
+	"[sfs2] SFS directory name index     ",
+#endif
+#if OPT_MMAP
+	"[mm1] mmap read() into own file     ",
+#endif
+#if OPT_AIO
+	"[aio1] Async I/O submit and reap    ",
+#endif
 	NULL
 };
 
@@ -508,6 +655,24 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#if OPT_SFSWRITEBACK
+	"[wb] SFS write-back settings        ",
+#endif
+#endif
+#if OPT_NAMECACHE
+	"[nc] Name cache stats               ",
+#endif
+#if OPT_LOCKPROF
+	"[lp] Lock contention profile        ",
+#endif
+#if OPT_SCHEDSTATS
+	"[ss] Scheduler stats                ",
+#endif
+#if OPT_SYSCALLSTATS
+	"[sc] Syscall stats                  ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -563,6 +728,24 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_SFS
+	{ "bc",		cmd_bufcache },
+#if OPT_SFSWRITEBACK
+	{ "wb",		cmd_writeback },
+#endif
+#endif
+#if OPT_NAMECACHE
+	{ "nc",		cmd_namecache },
+#endif
+#if OPT_LOCKPROF
+	{ "lp",		cmd_lockprof },
+#endif
+#if OPT_SCHEDSTATS
+	{ "ss",		cmd_schedstats },
+#endif
+#if OPT_SYSCALLSTATS
+	{ "sc",		cmd_syscallstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -576,6 +759,8 @@ static struct {
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
 	{ "sy1",	semtest },
+	{ "sl1",	spinlocktest },
+	{ "lhd1",	lhdqueuetest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
@@ -591,6 +776,20 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+#if OPT_SFS
+	{ "sfs1",	bufcachetest },
+	{ "sfs2",	dirhashtest },
+#endif
+
+	/* vm tests */
+#if OPT_MMAP
+	{ "mm1",	mmaptest },
+#endif
+
+	/* system call tests */
+#if OPT_AIO
+	{ "aio1",	aiotest },
+#endif
 
 	{ NULL, NULL }
 };
@@ -0,0 +1,599 @@
+/*
+ * Asynchronous file I/O. See <kern/aio.h> for the user interface.
+ *
+ * aio_submit turns each aiocb into an aioreq holding a reference to
+ * the openfile and a kernel buffer (filled from the user's buffer,
+ * for writes), and puts each batch on a global work queue in one go.
+ * A fixed pool of kernel threads takes requests off the queue and
+ * does the VOP_READ or VOP_WRITE on the kernel buffer, so they never
+ * touch a user address space. Finished requests go on the submitting
+ * process's completion list, where aio_reap picks them up and copies
+ * read data out to the user's buffer.
+ *
+ * The kernel buffers of all requests not yet reaped come out of a
+ * global budget of AIO_MAXBYTES, so that a few processes each with
+ * AIO_MAXPENDING requests of AIO_MAXIO bytes can't use up the kernel
+ * heap; a request that doesn't fit fails with EAGAIN.
+ *
+ * A process's aioctx is made on its first aio_submit. It is counted:
+ * one reference for the process and one for each request in flight,
+ * so a process can exit with I/O outstanding and the worker that
+ * finishes the last request cleans up.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/aio.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <file.h>
+#include <syscall.h>
+#include <aio.h>
+
+#define AIO_NWORKERS	4	/* worker threads */
+#define AIO_BATCH	16	/* aiocbs or events copied at a time */
+#define AIO_MAXBYTES	(4 * AIO_MAXIO)	/* kernel buffer space, all told */
+
+struct aioreq {
+	struct aioreq *ar_next;		/* on the work queue or done list */
+	struct aioctx *ar_ctx;		/* the submitter's */
+	struct openfile *ar_file;	/* held until the I/O is done */
+	int ar_op;			/* AIO_READ or AIO_WRITE */
+	void *ar_kbuf;			/* the data, in the kernel */
+	size_t ar_nbytes;
+	off_t ar_offset;
+	userptr_t ar_ubuf;		/* the user's buffer */
+	userptr_t ar_data;		/* the user's cookie */
+	int ar_error;			/* result */
+	size_t ar_count;
+};
+
+struct aioctx {
+	struct lock *ac_lock;
+	struct cv *ac_cv;		/* signalled when a request finishes */
+	struct aioreq *ac_done;		/* finished, not yet reaped */
+	struct aioreq **ac_donetail;
+	unsigned ac_ndone;
+	unsigned ac_pending;		/* submitted, not yet reaped */
+	unsigned ac_refcount;		/* process + requests in flight */
+};
+
+/* The work queue. */
+static struct lock *aio_qlock;
+static struct cv *aio_qcv;
+static struct aioreq *aio_qhead;
+static struct aioreq **aio_qtail = &aio_qhead;
+
+/* Bytes of kernel buffer in use, out of AIO_MAXBYTES. */
+static struct spinlock aio_bytelock = SPINLOCK_INITIALIZER;
+static size_t aio_bytes;
+
+////////////////////////////////////////////////////////////
+//
+// Requests and contexts
+
+/*
+ * Get the kernel buffer for AR, if there's room in the budget.
+ */
+static
+int
+aioreq_getbuf(struct aioreq *ar)
+{
+	spinlock_acquire(&aio_bytelock);
+	if (ar->ar_nbytes > AIO_MAXBYTES - aio_bytes) {
+		spinlock_release(&aio_bytelock);
+		return EAGAIN;
+	}
+	aio_bytes += ar->ar_nbytes;
+	spinlock_release(&aio_bytelock);
+
+	ar->ar_kbuf = kmalloc(ar->ar_nbytes);
+	if (ar->ar_kbuf == NULL) {
+		spinlock_acquire(&aio_bytelock);
+		aio_bytes -= ar->ar_nbytes;
+		spinlock_release(&aio_bytelock);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+aioreq_putbuf(struct aioreq *ar)
+{
+	if (ar->ar_kbuf == NULL) {
+		return;
+	}
+	kfree(ar->ar_kbuf);
+	ar->ar_kbuf = NULL;
+
+	spinlock_acquire(&aio_bytelock);
+	KASSERT(aio_bytes >= ar->ar_nbytes);
+	aio_bytes -= ar->ar_nbytes;
+	spinlock_release(&aio_bytelock);
+}
+
+static
+void
+aioreq_destroy(struct aioreq *ar)
+{
+	if (ar->ar_file != NULL) {
+		openfile_decref(ar->ar_file);
+	}
+	aioreq_putbuf(ar);
+	kfree(ar);
+}
+
+/*
+ * Make a request from CB. Checks everything that can be checked up
+ * front, so the workers only see I/O errors.
+ */
+static
+int
+aioreq_create(struct aioctx *ac, const struct aiocb *cb, struct aioreq **ret)
+{
+	struct aioreq *ar;
+	int how, result;
+
+	if (cb->aio_op != AIO_READ && cb->aio_op != AIO_WRITE) {
+		return EINVAL;
+	}
+	if (cb->aio_nbytes > AIO_MAXIO || cb->aio_offset < 0) {
+		return EINVAL;
+	}
+
+	ar = kmalloc(sizeof(*ar));
+	if (ar == NULL) {
+		return ENOMEM;
+	}
+	ar->ar_next = NULL;
+	ar->ar_ctx = ac;
+	ar->ar_file = NULL;
+	ar->ar_op = cb->aio_op;
+	ar->ar_kbuf = NULL;
+	ar->ar_nbytes = cb->aio_nbytes;
+	ar->ar_offset = cb->aio_offset;
+	ar->ar_ubuf = cb->aio_buf;
+	ar->ar_data = cb->aio_data;
+	ar->ar_error = 0;
+	ar->ar_count = 0;
+
+	result = filetable_get(curproc->p_files, cb->aio_fildes, &ar->ar_file);
+	if (result) {
+		aioreq_destroy(ar);
+		return result;
+	}
+	how = ar->ar_file->of_flags & O_ACCMODE;
+	if ((ar->ar_op == AIO_READ && how == O_WRONLY) ||
+	    (ar->ar_op == AIO_WRITE && how == O_RDONLY)) {
+		aioreq_destroy(ar);
+		return EBADF;
+	}
+	if (!ar->ar_file->of_seekable) {
+		aioreq_destroy(ar);
+		return ESPIPE;
+	}
+
+	if (ar->ar_nbytes > 0) {
+		result = aioreq_getbuf(ar);
+		if (result) {
+			aioreq_destroy(ar);
+			return result;
+		}
+	}
+	if (ar->ar_op == AIO_WRITE) {
+		result = copyin(ar->ar_ubuf, ar->ar_kbuf, ar->ar_nbytes);
+		if (result) {
+			aioreq_destroy(ar);
+			return result;
+		}
+	}
+
+	*ret = ar;
+	return 0;
+}
+
+static
+struct aioctx *
+aioctx_create(void)
+{
+	struct aioctx *ac;
+
+	ac = kmalloc(sizeof(*ac));
+	if (ac == NULL) {
+		return NULL;
+	}
+	ac->ac_lock = lock_create("aioctx");
+	if (ac->ac_lock == NULL) {
+		kfree(ac);
+		return NULL;
+	}
+	ac->ac_cv = cv_create("aioctx");
+	if (ac->ac_cv == NULL) {
+		lock_destroy(ac->ac_lock);
+		kfree(ac);
+		return NULL;
+	}
+	ac->ac_done = NULL;
+	ac->ac_donetail = &ac->ac_done;
+	ac->ac_ndone = 0;
+	ac->ac_pending = 0;
+	ac->ac_refcount = 1;
+	return ac;
+}
+
+static
+void
+aioctx_destroy(struct aioctx *ac)
+{
+	struct aioreq *ar;
+
+	KASSERT(ac->ac_refcount == 0);
+
+	/* Completions nobody reaped. */
+	while (ac->ac_done != NULL) {
+		ar = ac->ac_done;
+		ac->ac_done = ar->ar_next;
+		aioreq_destroy(ar);
+	}
+	cv_destroy(ac->ac_cv);
+	lock_destroy(ac->ac_lock);
+	kfree(ac);
+}
+
+void
+aioctx_release(struct aioctx *ac)
+{
+	bool last;
+
+	lock_acquire(ac->ac_lock);
+	KASSERT(ac->ac_refcount > 0);
+	ac->ac_refcount--;
+	last = (ac->ac_refcount == 0);
+	lock_release(ac->ac_lock);
+
+	if (last) {
+		aioctx_destroy(ac);
+	}
+}
+
+/*
+ * Get the current process's aioctx, making it if necessary.
+ */
+static
+int
+aioctx_get(struct aioctx **ret)
+{
+	struct proc *p = curproc;
+	struct aioctx *ac, *other;
+
+	spinlock_acquire(&p->p_lock);
+	ac = p->p_aio;
+	spinlock_release(&p->p_lock);
+	if (ac != NULL) {
+		*ret = ac;
+		return 0;
+	}
+
+	ac = aioctx_create();
+	if (ac == NULL) {
+		return ENOMEM;
+	}
+	spinlock_acquire(&p->p_lock);
+	other = p->p_aio;
+	if (other == NULL) {
+		p->p_aio = ac;
+	}
+	spinlock_release(&p->p_lock);
+	if (other != NULL) {
+		/* Someone else got there first. */
+		ac->ac_refcount = 0;
+		aioctx_destroy(ac);
+		ac = other;
+	}
+	*ret = ac;
+	return 0;
+}
+
+/*
+ * Reserve room for up to WANT more requests; returns how many we
+ * got. Each one holds a reference to AC until it finishes.
+ */
+static
+unsigned
+aioctx_reserve(struct aioctx *ac, unsigned want)
+{
+	unsigned got;
+
+	lock_acquire(ac->ac_lock);
+	got = AIO_MAXPENDING - ac->ac_pending;
+	if (got > want) {
+		got = want;
+	}
+	ac->ac_pending += got;
+	ac->ac_refcount += got;
+	lock_release(ac->ac_lock);
+	return got;
+}
+
+/* Give back N reservations that weren't used. */
+static
+void
+aioctx_unreserve(struct aioctx *ac, unsigned n)
+{
+	lock_acquire(ac->ac_lock);
+	KASSERT(ac->ac_pending >= n);
+	KASSERT(ac->ac_refcount > n);
+	ac->ac_pending -= n;
+	ac->ac_refcount -= n;
+	lock_release(ac->ac_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Workers
+
+/*
+ * Do one request and hand it back to its context.
+ */
+static
+void
+aio_doreq(struct aioreq *ar)
+{
+	struct aioctx *ac = ar->ar_ctx;
+	struct iovec iov;
+	struct uio u;
+	bool last;
+
+	if (ar->ar_op == AIO_READ) {
+		uio_kinit(&iov, &u, ar->ar_kbuf, ar->ar_nbytes, ar->ar_offset,
+			  UIO_READ);
+		ar->ar_error = VOP_READ(ar->ar_file->of_vn, &u);
+	}
+	else {
+		uio_kinit(&iov, &u, ar->ar_kbuf, ar->ar_nbytes, ar->ar_offset,
+			  UIO_WRITE);
+		ar->ar_error = VOP_WRITE(ar->ar_file->of_vn, &u);
+	}
+	ar->ar_count = ar->ar_nbytes - u.uio_resid;
+
+	/* Let go of what we don't need any more. */
+	openfile_decref(ar->ar_file);
+	ar->ar_file = NULL;
+	if (ar->ar_op == AIO_WRITE) {
+		aioreq_putbuf(ar);
+	}
+
+	lock_acquire(ac->ac_lock);
+	*ac->ac_donetail = ar;
+	ac->ac_donetail = &ar->ar_next;
+	ac->ac_ndone++;
+	cv_broadcast(ac->ac_cv, ac->ac_lock);
+	KASSERT(ac->ac_refcount > 0);
+	ac->ac_refcount--;
+	last = (ac->ac_refcount == 0);
+	lock_release(ac->ac_lock);
+
+	if (last) {
+		/* The process exited while we were busy. */
+		aioctx_destroy(ac);
+	}
+}
+
+static
+void
+aio_worker(void *unused1, unsigned long unused2)
+{
+	struct aioreq *ar;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(aio_qlock);
+		while (aio_qhead == NULL) {
+			cv_wait(aio_qcv, aio_qlock);
+		}
+		ar = aio_qhead;
+		aio_qhead = ar->ar_next;
+		if (aio_qhead == NULL) {
+			aio_qtail = &aio_qhead;
+		}
+		lock_release(aio_qlock);
+
+		ar->ar_next = NULL;
+		aio_doreq(ar);
+	}
+}
+
+void
+aio_bootstrap(void)
+{
+	int i, result;
+
+	aio_qlock = lock_create("aio queue");
+	aio_qcv = cv_create("aio queue");
+	if (aio_qlock == NULL || aio_qcv == NULL) {
+		panic("aio_bootstrap: Out of memory\n");
+	}
+
+	for (i=0; i<AIO_NWORKERS; i++) {
+		result = thread_fork("aio worker", NULL, aio_worker, NULL, i);
+		if (result) {
+			panic("aio_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// System calls
+
+/*
+ * Queue NCBS requests from the user array UCBS. The aiocbs are
+ * copied in AIO_BATCH at a time, and each batch goes on the work
+ * queue under one lock acquisition.
+ */
+int
+sys_aio_submit(const_userptr_t ucbs, int ncbs, int *retval)
+{
+	struct aiocb cbs[AIO_BATCH];
+	struct aioreq *head, **tail, *ar;
+	struct aioctx *ac;
+	unsigned n, got, count, i;
+	int done, result;
+
+	if (ncbs < 0) {
+		return EINVAL;
+	}
+	if (ncbs == 0) {
+		*retval = 0;
+		return 0;
+	}
+	result = aioctx_get(&ac);
+	if (result) {
+		return result;
+	}
+
+	done = 0;
+	while (done < ncbs && result == 0) {
+		n = ncbs - done;
+		if (n > AIO_BATCH) {
+			n = AIO_BATCH;
+		}
+		result = copyin(ucbs + done * sizeof(cbs[0]), cbs,
+				n * sizeof(cbs[0]));
+		if (result) {
+			break;
+		}
+
+		got = aioctx_reserve(ac, n);
+		if (got == 0) {
+			result = EAGAIN;
+			break;
+		}
+
+		head = NULL;
+		tail = &head;
+		for (count=0; count<got; count++) {
+			result = aioreq_create(ac, &cbs[count], &ar);
+			if (result) {
+				break;
+			}
+			*tail = ar;
+			tail = &ar->ar_next;
+		}
+		if (count < got) {
+			aioctx_unreserve(ac, got - count);
+		}
+		else if (got < n) {
+			/* Too many pending for the rest. */
+			result = EAGAIN;
+		}
+
+		if (count > 0) {
+			lock_acquire(aio_qlock);
+			*aio_qtail = head;
+			aio_qtail = tail;
+			for (i=0; i<count && i<AIO_NWORKERS; i++) {
+				cv_signal(aio_qcv, aio_qlock);
+			}
+			lock_release(aio_qlock);
+		}
+		done += count;
+	}
+
+	if (done == 0) {
+		return result;
+	}
+	*retval = done;
+	return 0;
+}
+
+/*
+ * Wait for at least MIN completions (or until nothing is left in
+ * flight), then hand back up to MAX of them in UEVS. Read data is
+ * copied out to the user's buffer here, in the process's own
+ * context. If UEVS itself is bad, the completions are lost.
+ */
+int
+sys_aio_reap(userptr_t uevs, int min, int max, int *retval)
+{
+	struct aio_event evs[AIO_BATCH];
+	struct aioreq *list, *ar;
+	struct aioctx *ac;
+	unsigned n, i, j;
+	int result, err;
+
+	if (min < 0 || max <= 0 || min > max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	ac = curproc->p_aio;
+	spinlock_release(&curproc->p_lock);
+	if (ac == NULL) {
+		/* Never submitted anything. */
+		*retval = 0;
+		return 0;
+	}
+
+	lock_acquire(ac->ac_lock);
+	while (ac->ac_ndone < (unsigned)min &&
+	       ac->ac_ndone < ac->ac_pending) {
+		cv_wait(ac->ac_cv, ac->ac_lock);
+	}
+	n = ac->ac_ndone;
+	if (n > (unsigned)max) {
+		n = max;
+	}
+	list = ac->ac_done;
+	for (i=0; i<n; i++) {
+		ac->ac_done = ac->ac_done->ar_next;
+	}
+	if (ac->ac_done == NULL) {
+		ac->ac_donetail = &ac->ac_done;
+	}
+	ac->ac_ndone -= n;
+	ac->ac_pending -= n;
+	lock_release(ac->ac_lock);
+
+	result = 0;
+	for (i=0; i<n; i++) {
+		ar = list;
+		list = ar->ar_next;
+
+		if (ar->ar_op == AIO_READ && ar->ar_count > 0) {
+			err = copyout(ar->ar_kbuf, ar->ar_ubuf, ar->ar_count);
+			if (err) {
+				ar->ar_error = err;
+				ar->ar_count = 0;
+			}
+		}
+
+		j = i % AIO_BATCH;
+		evs[j].ae_data = ar->ar_data;
+		evs[j].ae_error = ar->ar_error;
+		evs[j].ae_count = ar->ar_count;
+		aioreq_destroy(ar);
+
+		if ((j == AIO_BATCH - 1 || i == n - 1) && result == 0) {
+			result = copyout(evs, uevs + (i - j) * sizeof(evs[0]),
+					 (j + 1) * sizeof(evs[0]));
+		}
+	}
+	if (result) {
+		return result;
+	}
+
+	*retval = n;
+	return 0;
+}
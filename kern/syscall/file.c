@@ -0,0 +1,252 @@
+/*
+ * Open files and per-process file tables. See file.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <file.h>
+
+////////////////////////////////////////////////////////////
+//
+// Open files
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *of;
+	struct vnode *vn;
+	int result;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		lock_destroy(of->of_lock);
+		kfree(of);
+		return result;
+	}
+
+	of->of_vn = vn;
+	of->of_flags = flags;
+	of->of_seekable = (VOP_TRYSEEK(vn, 0) == 0);
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = (of->of_refcount == 0);
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		vfs_close(of->of_vn);
+		lock_destroy(of->of_lock);
+		spinlock_cleanup(&of->of_reflock);
+		kfree(of);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// File tables
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	spinlock_init(&ft->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+	}
+	return ft;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	unsigned i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+			ft->ft_files[i] = NULL;
+		}
+	}
+	spinlock_cleanup(&ft->ft_lock);
+	kfree(ft);
+}
+
+/*
+ * Make DST (a new, empty table) share all of SRC's open files, as
+ * for fork. This only takes references, so it can't fail.
+ */
+void
+filetable_copy(struct filetable *src, struct filetable *dst)
+{
+	unsigned i;
+
+	spinlock_acquire(&src->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		KASSERT(dst->ft_files[i] == NULL);
+		if (src->ft_files[i] != NULL) {
+			openfile_incref(src->ft_files[i]);
+			dst->ft_files[i] = src->ft_files[i];
+		}
+	}
+	spinlock_release(&src->ft_lock);
+}
+
+/*
+ * Attach the console to descriptors 0, 1, and 2 of a new table.
+ */
+int
+filetable_openstdio(struct filetable *ft)
+{
+	static const int flags[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	char path[5];
+	int fd, result;
+
+	for (fd=0; fd<3; fd++) {
+		/* vfs_open may destroy the path */
+		strcpy(path, "con:");
+		result = openfile_open(path, flags[fd], 0, &of);
+		if (result) {
+			return result;
+		}
+		KASSERT(ft->ft_files[fd] == NULL);
+		ft->ft_files[fd] = of;
+	}
+	return 0;
+}
+
+int
+filetable_add(struct filetable *ft, struct openfile *of, int *fd)
+{
+	int i;
+
+	spinlock_acquire(&ft->ft_lock);
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			spinlock_release(&ft->ft_lock);
+			*fd = i;
+			return 0;
+		}
+	}
+	spinlock_release(&ft->ft_lock);
+	return EMFILE;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	if (of != NULL) {
+		openfile_incref(of);
+	}
+	spinlock_release(&ft->ft_lock);
+
+	if (of == NULL) {
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
+
+int
+filetable_dup2(struct filetable *ft, int oldfd, int newfd)
+{
+	struct openfile *of, *old;
+
+	if (oldfd < 0 || oldfd >= OPEN_MAX || newfd < 0 || newfd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[oldfd];
+	if (of == NULL) {
+		spinlock_release(&ft->ft_lock);
+		return EBADF;
+	}
+	if (oldfd == newfd) {
+		spinlock_release(&ft->ft_lock);
+		return 0;
+	}
+	openfile_incref(of);
+	old = ft->ft_files[newfd];
+	ft->ft_files[newfd] = of;
+	spinlock_release(&ft->ft_lock);
+
+	/* Closing may sleep, so do it outside the spinlock. */
+	if (old != NULL) {
+		openfile_decref(old);
+	}
+	return 0;
+}
+
+int
+filetable_close(struct filetable *ft, int fd)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->ft_lock);
+	of = ft->ft_files[fd];
+	ft->ft_files[fd] = NULL;
+	spinlock_release(&ft->ft_lock);
+
+	if (of == NULL) {
+		return EBADF;
+	}
+	openfile_decref(of);
+	return 0;
+}
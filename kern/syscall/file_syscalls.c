@@ -8,6 +8,516 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#if OPT_FDTABLE
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <limits.h>
+#include <stat.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <file.h>
+#if OPT_MMAP
+#include <kern/mman.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <mmap.h>
+#endif
+
+/* readv/writev iovec arrays up to this size don't need a kmalloc */
+#define FILE_STACKIOV	8
+
+/* Size of the kernel buffer sendfile copies through */
+#define FILE_COPYCHUNK	PAGE_SIZE
+
+/* Largest total transfer, so the count fits in the return value */
+#define FILE_MAXIO	0x7fffffffU
+
+/*
+ * Do the transfer U describes on the file open as FD. If POS is
+ * NULL, this happens at (and advances) the file's seek position;
+ * otherwise it happens at *POS and the seek position isn't touched.
+ * Hands back the number of bytes transferred.
+ */
+static
+int
+file_io(int fd, struct uio *u, const off_t *pos, size_t *done)
+{
+	struct openfile *of;
+	struct stat st;
+	size_t resid;
+	int how, result;
+
+	result = filetable_get(curproc->p_files, fd, &of);
+	if (result) {
+		return result;
+	}
+
+	how = of->of_flags & O_ACCMODE;
+	if ((u->uio_rw == UIO_READ && how == O_WRONLY) ||
+	    (u->uio_rw == UIO_WRITE && how == O_RDONLY)) {
+		openfile_decref(of);
+		return EBADF;
+	}
+
+	if (pos != NULL) {
+		if (!of->of_seekable) {
+			openfile_decref(of);
+			return ESPIPE;
+		}
+		if (*pos < 0) {
+			openfile_decref(of);
+			return EINVAL;
+		}
+	}
+
+#if OPT_MMAP
+	/* Before the filesystem takes any locks; see vm/mmap.c. */
+	result = mmap_prefault(curproc->p_addrspace, u);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+#endif
+
+	resid = u->uio_resid;
+	if (pos != NULL) {
+		/* Positional I/O doesn't need the offset lock. */
+		u->uio_offset = *pos;
+	}
+	else if (of->of_seekable) {
+		lock_acquire(of->of_lock);
+		if (u->uio_rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+			result = VOP_STAT(of->of_vn, &st);
+			if (result) {
+				lock_release(of->of_lock);
+				openfile_decref(of);
+				return result;
+			}
+			of->of_offset = st.st_size;
+		}
+		u->uio_offset = of->of_offset;
+	}
+	else {
+		u->uio_offset = 0;
+	}
+
+#if OPT_MMAP
+	/* Mapped pages can't be read in during the transfer. */
+	curthread->t_mmapnofill = true;
+#endif
+	if (u->uio_rw == UIO_READ) {
+		result = VOP_READ(of->of_vn, u);
+	}
+	else {
+		result = VOP_WRITE(of->of_vn, u);
+	}
+#if OPT_MMAP
+	curthread->t_mmapnofill = false;
+#endif
+
+	if (pos == NULL && of->of_seekable) {
+		/* Even on error, account for whatever got done. */
+		of->of_offset = u->uio_offset;
+		lock_release(of->of_lock);
+	}
+	openfile_decref(of);
+
+	if (result) {
+		return result;
+	}
+	*done = resid - u->uio_resid;
+	return 0;
+}
+
+/*
+ * Transfer NBYTES between the user buffer UBUF and FD, at POS if
+ * it isn't NULL.
+ */
+static
+int
+file_rw(int fd, userptr_t ubuf, size_t nbytes, const off_t *pos,
+	enum uio_rw rw, int *retval)
+{
+	struct iovec iov;
+	struct uio u;
+	size_t done;
+	int result;
+
+	iov.iov_ubase = ubuf;
+	iov.iov_len = nbytes;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_offset = 0;
+	u.uio_resid = nbytes;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curproc->p_addrspace;
+
+	result = file_io(fd, &u, pos, &done);
+	if (result) {
+		return result;
+	}
+	*retval = done;
+	return 0;
+}
+
+/*
+ * Transfer between FD and the IOVCNT buffers described by the user
+ * iovec array UIOV. The array is copied in with a single copyin;
+ * small ones go on the stack.
+ */
+static
+int
+file_rwv(int fd, const_userptr_t uiov, int iovcnt, enum uio_rw rw,
+	 int *retval)
+{
+	struct iovec stackiov[FILE_STACKIOV];
+	struct iovec *iov;
+	struct uio u;
+	size_t total, done;
+	int i, result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+	if (iovcnt <= FILE_STACKIOV) {
+		iov = stackiov;
+	}
+	else {
+		iov = kmalloc(iovcnt * sizeof(*iov));
+		if (iov == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+	if (result) {
+		goto out;
+	}
+
+	total = 0;
+	for (i=0; i<iovcnt; i++) {
+		if (iov[i].iov_len > FILE_MAXIO - total) {
+			result = EINVAL;
+			goto out;
+		}
+		total += iov[i].iov_len;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_offset = 0;
+	u.uio_resid = total;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curproc->p_addrspace;
+
+	result = file_io(fd, &u, NULL, &done);
+	if (result == 0) {
+		*retval = done;
+	}
+
+ out:
+	if (iov != stackiov) {
+		kfree(iov);
+	}
+	return result;
+}
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+	struct openfile *of;
+	char *path;
+	int result;
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(upath, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	result = openfile_open(path, flags, mode, &of);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = filetable_add(curproc->p_files, of, retval);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	return 0;
+}
+
+int
+sys_read(int fd, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+	return file_rw(fd, ubuf, nbytes, NULL, UIO_READ, retval);
+}
+
+int
+sys_write(int fd, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+	return file_rw(fd, ubuf, nbytes, NULL, UIO_WRITE, retval);
+}
+
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return file_rwv(fd, iov, iovcnt, UIO_READ, retval);
+}
+
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return file_rwv(fd, iov, iovcnt, UIO_WRITE, retval);
+}
+
+int
+sys_pread(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+	return file_rw(fd, ubuf, nbytes, &pos, UIO_READ, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+	return file_rw(fd, ubuf, nbytes, &pos, UIO_WRITE, retval);
+}
+
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	off_t newpos;
+	int result;
+
+	result = filetable_get(curproc->p_files, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (!of->of_seekable) {
+		openfile_decref(of);
+		return ESPIPE;
+	}
+
+	lock_acquire(of->of_lock);
+	switch (whence) {
+	    case SEEK_SET:
+		newpos = pos;
+		break;
+	    case SEEK_CUR:
+		newpos = of->of_offset + pos;
+		break;
+	    case SEEK_END:
+		result = VOP_STAT(of->of_vn, &st);
+		if (result) {
+			goto out;
+		}
+		newpos = st.st_size + pos;
+		break;
+	    default:
+		result = EINVAL;
+		goto out;
+	}
+	if (newpos < 0) {
+		result = EINVAL;
+		goto out;
+	}
+	of->of_offset = newpos;
+	*retval = newpos;
+
+ out:
+	lock_release(of->of_lock);
+	openfile_decref(of);
+	return result;
+}
+
+int
+sys_close(int fd)
+{
+	return filetable_close(curproc->p_files, fd);
+}
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+	int result;
+
+	result = filetable_dup2(curproc->p_files, oldfd, newfd);
+	if (result) {
+		return result;
+	}
+	*retval = newfd;
+	return 0;
+}
+
+/*
+ * Copy up to COUNT bytes from INFD to OUTFD through a kernel buffer,
+ * so the data never crosses into user memory. OUTFD is written at
+ * its seek position. If OFFP is NULL, INFD is read at (and advances)
+ * its seek position; otherwise it's read at *OFFP, which is updated,
+ * and its seek position isn't touched.
+ *
+ * Each chunk is a file_io on each side, so other users of the same
+ * open files can interleave with us between chunks.
+ */
+int
+sys_sendfile(int outfd, int infd, userptr_t offp, size_t count,
+	     int *retval)
+{
+	struct iovec iov;
+	struct uio u;
+	char *buf;
+	off_t pos;
+	size_t total, len, got, put;
+	int result;
+
+	if (offp != NULL) {
+		result = copyin(offp, &pos, sizeof(pos));
+		if (result) {
+			return result;
+		}
+	}
+	if (count > FILE_MAXIO) {
+		count = FILE_MAXIO;
+	}
+
+	buf = kmalloc(FILE_COPYCHUNK);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	total = 0;
+	result = 0;
+	while (total < count) {
+		len = count - total;
+		if (len > FILE_COPYCHUNK) {
+			len = FILE_COPYCHUNK;
+		}
+
+		uio_kinit(&iov, &u, buf, len, 0, UIO_READ);
+		result = file_io(infd, &u, offp != NULL ? &pos : NULL, &got);
+		if (result || got == 0) {
+			break;
+		}
+
+		uio_kinit(&iov, &u, buf, got, 0, UIO_WRITE);
+		result = file_io(outfd, &u, NULL, &put);
+		if (offp != NULL) {
+			pos += put;
+		}
+		total += put;
+		if (result || put < got) {
+			break;
+		}
+	}
+	kfree(buf);
+
+	/* Report a partial copy rather than the error that ended it. */
+	if (result && total == 0) {
+		return result;
+	}
+	if (offp != NULL) {
+		result = copyout(&pos, offp, sizeof(pos));
+		if (result) {
+			return result;
+		}
+	}
+	*retval = total;
+	return 0;
+}
+
+int
+sys_fsync(int fd)
+{
+	struct openfile *of;
+	int result;
+
+	result = filetable_get(curproc->p_files, fd, &of);
+	if (result) {
+		return result;
+	}
+#if OPT_MMAP
+	/* Changes made through our mappings count as the file's data. */
+	result = mmap_sync(curproc->p_addrspace, of->of_vn);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+#endif
+	result = VOP_FSYNC(of->of_vn);
+	openfile_decref(of);
+	return result;
+}
+
+#if OPT_MMAP
+/*
+ * ADDR is only a hint, and we ignore it; MAP_FIXED isn't supported.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct openfile *of;
+	vaddr_t va;
+	int how, result;
+
+	(void)addr;
+
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+		return EINVAL;
+	}
+	if (flags & MAP_FIXED) {
+		return EUNIMP;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_files, fd, &of);
+	if (result) {
+		return result;
+	}
+
+	/* Writing to a shared mapping writes the file. */
+	how = of->of_flags & O_ACCMODE;
+	if (how == O_WRONLY ||
+	    (flags == MAP_SHARED && (prot & PROT_WRITE) && how != O_RDWR)) {
+		openfile_decref(of);
+		return EACCES;
+	}
+
+	result = VOP_MMAP(of->of_vn);
+	if (result == 0) {
+		result = mmap_create(curproc->p_addrspace, len, prot, flags,
+				     of->of_vn, offset, &va);
+	}
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	*retval = (int)va;
+	return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	return mmap_remove(curproc->p_addrspace, (vaddr_t)addr, len);
+}
+#endif /* OPT_MMAP */
+
+#else /* !OPT_FDTABLE */
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +568,5 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#endif /* OPT_FDTABLE */
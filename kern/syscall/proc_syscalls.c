@@ -15,6 +15,10 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-fdtable.h"
+#if OPT_FDTABLE
+#include <file.h>
+#endif
 
 /* this implementation of sys__exit does not do anything with the exit code */
 /* this needs to be fixed to get exit() and waitpid() working properly */
@@ -217,6 +221,12 @@ sys_fork(struct trapframe *tf, pid_t *retval)
         return errno;
     }
     childproc->p_addrspace = childas;
+
+#if OPT_FDTABLE
+    // The child shares the parent's open files (and seek positions)
+    filetable_copy(curproc->p_files, childproc->p_files);
+#endif
+
     // deep copy
     memcpy(childtf, tf, sizeof(struct trapframe));
      
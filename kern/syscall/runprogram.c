@@ -46,6 +46,10 @@
 #include <test.h>
  #include <copyinout.h> //
 #include "opt-A2.h"
+#include "opt-fdtable.h"
+#if OPT_FDTABLE
+#include <file.h>
+#endif
 /*
  * Load program "progname" and start running it in usermode.
  * Does not return except on error.
@@ -64,6 +68,14 @@ runprogram(char *progname)
 	vaddr_t entrypoint, stackptr, argvptr;
 	int result, offset;
 
+#if OPT_FDTABLE
+	/* Give the program a stdin, stdout, and stderr. */
+	result = filetable_openstdio(curproc->p_files);
+	if (result) {
+		return result;
+	}
+#endif
+
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
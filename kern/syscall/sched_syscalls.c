@@ -0,0 +1,29 @@
+#include <types.h>
+#include <kern/schedstats.h>
+#include <thread.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Fetch the scheduler statistics for cpu CPUNUM. Returns the number
+ * of cpus, so userlevel can iterate over all of them.
+ */
+int
+sys___schedstats(unsigned cpunum, userptr_t user_stats, int32_t *retval)
+{
+	struct schedstats ss;
+	int result;
+
+	result = thread_getschedstats(cpunum, &ss);
+	if (result) {
+		return result;
+	}
+
+	result = copyout(&ss, user_stats, sizeof(ss));
+	if (result) {
+		return result;
+	}
+
+	*retval = thread_numcpus();
+	return 0;
+}
@@ -0,0 +1,29 @@
+#include <types.h>
+#include <kern/syscallstats.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Fetch the statistics for call number CALLNO. Returns the number of
+ * call numbers, so userlevel can iterate over all of them.
+ */
+int
+sys___syscallstats(int callno, userptr_t user_stats, int32_t *retval)
+{
+	struct syscallstat st;
+	unsigned ncalls;
+	int result;
+
+	result = syscall_getstats(callno, &st, &ncalls);
+	if (result) {
+		return result;
+	}
+
+	result = copyout(&st, user_stats, sizeof(st));
+	if (result) {
+		return result;
+	}
+
+	*retval = ncalls;
+	return 0;
+}
@@ -0,0 +1,359 @@
+/*
+ * aiotest - test of aio_submit and aio_reap.
+ *
+ * aio1: writes a file with a batch of asynchronous writes and reads
+ * it back with asynchronous reads, reaping the reads a few at a time.
+ * Then checks that bad requests are refused, and that submitting
+ * stops with EAGAIN at AIO_MAXPENDING requests and when the kernel
+ * buffer budget is used up.
+ *
+ * Like mm1, this runs in the menu thread and borrows the kernel
+ * process, giving it an address space (one data region, holding the
+ * aiocbs, the events, and the data buffers) and a file table.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/aio.h>
+#include <elf.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <file.h>
+#include <syscall.h>
+#include <vfs.h>
+#include <aio.h>
+#include <test.h>
+
+#define AIOTFILENAME	"aiotest.tmp"
+
+/* Data transfers of a page each */
+#define AIOT_N		4
+
+/* Enough requests to go over the pending limit */
+#define AIOT_MAXCBS	(AIO_MAXPENDING + 1)
+
+/* User memory: a page of aiocbs, a page of events, the data pages */
+#define AIOT_BASE	0x400000
+#define AIOT_CBS	((userptr_t)AIOT_BASE)
+#define AIOT_EVS	((userptr_t)(AIOT_BASE + PAGE_SIZE))
+#define AIOT_DATA(i)	((userptr_t)(AIOT_BASE + (2 + (i)) * PAGE_SIZE))
+#define AIOT_PAGES	(2 + AIOT_N)
+
+/* Somewhere past the end of the file, so reads there move nothing */
+#define AIOT_PASTEOF	((off_t)16 * 1024 * 1024)
+
+static struct aiocb aiot_cbs[AIOT_MAXCBS];
+static struct aio_event aiot_evs[AIOT_MAXCBS];
+static char aiot_buf[PAGE_SIZE];
+
+static
+void
+aiot_fill(unsigned page)
+{
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		aiot_buf[i] = 'A' + (page * 7 + i) % 26;
+	}
+}
+
+static
+void
+aiot_setcb(unsigned n, int fd, int op, userptr_t buf, size_t nbytes,
+	   off_t offset)
+{
+	aiot_cbs[n].aio_fildes = fd;
+	aiot_cbs[n].aio_op = op;
+	aiot_cbs[n].aio_buf = buf;
+	aiot_cbs[n].aio_nbytes = nbytes;
+	aiot_cbs[n].aio_offset = offset;
+	aiot_cbs[n].aio_data = (userptr_t)(n + 1);
+}
+
+/*
+ * Submit the first N aiocbs; hands back how many were queued.
+ */
+static
+int
+aiot_submit(unsigned n, int *got)
+{
+	int err;
+
+	err = copyout(aiot_cbs, AIOT_CBS, n * sizeof(aiot_cbs[0]));
+	if (err) {
+		return err;
+	}
+	return sys_aio_submit(AIOT_CBS, n, got);
+}
+
+/*
+ * Reap N completions, MIN or more at a time, into aiot_evs; each must
+ * have succeeded with COUNT bytes, and each request must turn up
+ * once.
+ */
+static
+bool
+aiot_reap(unsigned n, int min, size_t count)
+{
+	bool seen[AIOT_MAXCBS];
+	unsigned total, i, which;
+	int got, err;
+
+	KASSERT(n <= AIOT_MAXCBS);
+	for (i=0; i<n; i++) {
+		seen[i] = false;
+	}
+	for (total = 0; total < n; total += got) {
+		err = sys_aio_reap(AIOT_EVS, min, n - total, &got);
+		if (err == 0) {
+			err = copyin(AIOT_EVS, aiot_evs,
+				     got * sizeof(aiot_evs[0]));
+		}
+		if (err) {
+			kprintf("aio1: aio_reap: %s\n", strerror(err));
+			return false;
+		}
+		if (got < min || got == 0) {
+			kprintf("aio1: aio_reap got %d, wanted %d\n", got, min);
+			return false;
+		}
+		for (i=0; i<(unsigned)got; i++) {
+			which = (vaddr_t)aiot_evs[i].ae_data - 1;
+			if (which >= n || seen[which]) {
+				kprintf("aio1: Bad completion cookie %p\n",
+					aiot_evs[i].ae_data);
+				return false;
+			}
+			seen[which] = true;
+			if (aiot_evs[i].ae_error != 0 ||
+			    aiot_evs[i].ae_count != count) {
+				kprintf("aio1: Request %u: %s, %u bytes\n",
+					which, strerror(aiot_evs[i].ae_error),
+					(unsigned)aiot_evs[i].ae_count);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*
+ * Write the file a page per request, and read it back.
+ */
+static
+bool
+aiot_data(int fd)
+{
+	unsigned i, j;
+	int got, err;
+
+	for (i=0; i<AIOT_N; i++) {
+		aiot_fill(i);
+		err = copyout(aiot_buf, AIOT_DATA(i), PAGE_SIZE);
+		if (err) {
+			kprintf("aio1: copyout: %s\n", strerror(err));
+			return false;
+		}
+		aiot_setcb(i, fd, AIO_WRITE, AIOT_DATA(i), PAGE_SIZE,
+			   (off_t)i * PAGE_SIZE);
+	}
+	err = aiot_submit(AIOT_N, &got);
+	if (err || got != AIOT_N) {
+		kprintf("aio1: Submitting writes: %s, %d queued\n",
+			strerror(err), err ? 0 : got);
+		return false;
+	}
+	if (!aiot_reap(AIOT_N, AIOT_N, PAGE_SIZE)) {
+		return false;
+	}
+
+	/* Clear the buffers and read back, last page first. */
+	bzero(aiot_buf, PAGE_SIZE);
+	for (i=0; i<AIOT_N; i++) {
+		err = copyout(aiot_buf, AIOT_DATA(i), PAGE_SIZE);
+		if (err) {
+			kprintf("aio1: copyout: %s\n", strerror(err));
+			return false;
+		}
+		aiot_setcb(i, fd, AIO_READ, AIOT_DATA(i), PAGE_SIZE,
+			   (off_t)(AIOT_N - 1 - i) * PAGE_SIZE);
+	}
+	err = aiot_submit(AIOT_N, &got);
+	if (err || got != AIOT_N) {
+		kprintf("aio1: Submitting reads: %s, %d queued\n",
+			strerror(err), err ? 0 : got);
+		return false;
+	}
+	if (!aiot_reap(AIOT_N, 1, PAGE_SIZE)) {
+		return false;
+	}
+
+	for (i=0; i<AIOT_N; i++) {
+		err = copyin(AIOT_DATA(i), aiot_buf, PAGE_SIZE);
+		if (err) {
+			kprintf("aio1: copyin: %s\n", strerror(err));
+			return false;
+		}
+		for (j=0; j<PAGE_SIZE; j++) {
+			if ((unsigned char)aiot_buf[j] !=
+			    (unsigned char)('A' + ((AIOT_N-1-i) * 7 + j) % 26)) {
+				kprintf("aio1: Read back wrong data\n");
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/*
+ * Bad requests, and the limits.
+ */
+static
+bool
+aiot_limits(int fd)
+{
+	unsigned i;
+	int got, err;
+
+	aiot_setcb(0, fd, AIO_WRITE + 1, AIOT_DATA(0), PAGE_SIZE, 0);
+	err = aiot_submit(1, &got);
+	if (err != EINVAL) {
+		kprintf("aio1: Bad operation gave %s\n", strerror(err));
+		return false;
+	}
+	aiot_setcb(0, fd, AIO_READ, AIOT_DATA(0), AIO_MAXIO + 1, 0);
+	err = aiot_submit(1, &got);
+	if (err != EINVAL) {
+		kprintf("aio1: Oversized transfer gave %s\n", strerror(err));
+		return false;
+	}
+
+	/* Empty reads take up a pending slot but no buffer space. */
+	for (i=0; i<AIOT_MAXCBS; i++) {
+		aiot_setcb(i, fd, AIO_READ, AIOT_DATA(0), 0, 0);
+	}
+	err = aiot_submit(AIOT_MAXCBS, &got);
+	if (err || got != AIO_MAXPENDING) {
+		kprintf("aio1: Submitting %u: %s, %d queued\n", AIOT_MAXCBS,
+			strerror(err), err ? 0 : got);
+		return false;
+	}
+	err = aiot_submit(1, &got);
+	if (err != EAGAIN) {
+		kprintf("aio1: Past the pending limit gave %s\n",
+			strerror(err));
+		return false;
+	}
+	if (!aiot_reap(AIO_MAXPENDING, 1, 0)) {
+		return false;
+	}
+
+	/*
+	 * Big reads past EOF hold buffer space until they're reaped
+	 * but never copy anything out. The budget must run out well
+	 * before the pending limit.
+	 */
+	for (i=0; i<AIO_MAXPENDING; i++) {
+		aiot_setcb(i, fd, AIO_READ, AIOT_DATA(0), AIO_MAXIO,
+			   AIOT_PASTEOF);
+	}
+	err = aiot_submit(AIO_MAXPENDING, &got);
+	if (err || got == 0 || got >= AIO_MAXPENDING) {
+		kprintf("aio1: Submitting %u big reads: %s, %d queued\n",
+			AIO_MAXPENDING, strerror(err), err ? 0 : got);
+		if (err == 0) {
+			(void)aiot_reap(got, got, 0);
+		}
+		return false;
+	}
+	return aiot_reap(got, got, 0);
+}
+
+int
+aiotest(int nargs, char **args)
+{
+	struct addrspace *as;
+	struct filetable *ft;
+	struct openfile *of;
+	struct aioctx *ac;
+	char name[32], buf[32];
+	int fd, err, ret = 0;
+
+	if (nargs != 2) {
+		kprintf("Usage: aio1 filesystem:\n");
+		return EINVAL;
+	}
+	snprintf(name, sizeof(name), "%s:%s", args[1], AIOTFILENAME);
+
+	KASSERT(curproc->p_files == NULL);
+	KASSERT(curproc_getas() == NULL);
+	ft = filetable_create();
+	as = as_create();
+	if (ft == NULL || as == NULL) {
+		kprintf("aio1: Out of memory\n");
+		if (ft != NULL) {
+			filetable_destroy(ft);
+		}
+		if (as != NULL) {
+			as_destroy(as);
+		}
+		return ENOMEM;
+	}
+	err = as_define_region(as, AIOT_BASE, AIOT_PAGES * PAGE_SIZE,
+			       PF_R, PF_W, 0);
+	if (err) {
+		kprintf("aio1: as_define_region: %s\n", strerror(err));
+		filetable_destroy(ft);
+		as_destroy(as);
+		return err;
+	}
+	curproc->p_files = ft;
+	curproc_setas(as);
+	as_activate();
+
+	strcpy(buf, name);
+	err = openfile_open(buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &of);
+	if (err == 0) {
+		err = filetable_add(ft, of, &fd);
+		if (err) {
+			openfile_decref(of);
+		}
+	}
+	if (err) {
+		kprintf("aio1: Could not open %s: %s\n", name, strerror(err));
+		ret = err;
+		goto restore;
+	}
+
+	if (!aiot_data(fd) || !aiot_limits(fd)) {
+		ret = EINVAL;
+	}
+
+	(void)sys_close(fd);
+	strcpy(buf, name);
+	vfs_remove(buf);
+
+ restore:
+	/* Anything still in flight finishes on its own. */
+	spinlock_acquire(&curproc->p_lock);
+	ac = curproc->p_aio;
+	curproc->p_aio = NULL;
+	spinlock_release(&curproc->p_lock);
+	if (ac != NULL) {
+		aioctx_release(ac);
+	}
+
+	curproc_setas(NULL);
+	as_activate();
+	as_destroy(as);
+	curproc->p_files = NULL;
+	filetable_destroy(ft);
+
+	kprintf("aio1: %s\n", ret ? "FAILED" : "Passed.");
+	return ret;
+}
@@ -0,0 +1,149 @@
+/*
+ * lhdtest - test of the lhd request queue.
+ *
+ * lhd1: requests are merged with ones they continue or precede (same
+ * direction, up to LHD_MAXMERGE sectors) and otherwise come off the
+ * queue in C-LOOK order. This uses a softc that isn't attached to a
+ * disk; only the queue fields are touched.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <lamebus/lhd.h>
+#include <test.h>
+
+#define NREQS	8
+
+static struct lhd_softc lqtest_lh;
+static struct lhd_request lqtest_reqs[NREQS];
+
+/*
+ * Make request N for NSECT sectors at SECTOR.
+ */
+static
+struct lhd_request *
+lqtest_req(unsigned n, uint32_t sector, uint32_t nsect, bool write)
+{
+	struct lhd_request *lr = &lqtest_reqs[n];
+
+	bzero(lr, sizeof(*lr));
+	lr->lr_sector = sector;
+	lr->lr_nsect = nsect;
+	lr->lr_write = write;
+	return lr;
+}
+
+static
+void
+lqtest_reset(uint32_t headpos)
+{
+	lqtest_lh.lh_queue = NULL;
+	lqtest_lh.lh_cur = NULL;
+	lqtest_lh.lh_headpos = headpos;
+}
+
+/*
+ * Take the next request off the queue and check it's request N,
+ * moving the head past it as the interrupt handler would.
+ */
+static
+bool
+lqtest_next(unsigned n)
+{
+	struct lhd_request *lr;
+
+	lr = lhd_queue_next(&lqtest_lh);
+	if (lr != &lqtest_reqs[n]) {
+		kprintf("lhd1: Got request %d, expected %u\n",
+			lr == NULL ? -1 : (int)(lr - lqtest_reqs), n);
+		return false;
+	}
+	while (lr->lr_merge != NULL) {
+		lr = lr->lr_merge;
+	}
+	lqtest_lh.lh_headpos = lr->lr_sector + lr->lr_nsect;
+	return true;
+}
+
+static
+bool
+lqtest_add(struct lhd_request *lr, bool merged)
+{
+	if (lhd_queue_add(&lqtest_lh, lr) != merged) {
+		kprintf("lhd1: Request %d %s\n", (int)(lr - lqtest_reqs),
+			merged ? "not merged" : "merged");
+		return false;
+	}
+	return true;
+}
+
+/* C-LOOK: from sector 50, serve 60 and 80, then wrap to 10 and 30. */
+static
+bool
+lqtest_clook(void)
+{
+	lqtest_reset(50);
+	return lqtest_add(lqtest_req(0, 10, 1, false), false) &&
+		lqtest_add(lqtest_req(1, 80, 1, false), false) &&
+		lqtest_add(lqtest_req(2, 60, 1, true), false) &&
+		lqtest_add(lqtest_req(3, 30, 1, false), false) &&
+		lqtest_next(2) && lqtest_next(1) &&
+		lqtest_next(0) && lqtest_next(3) &&
+		lhd_queue_next(&lqtest_lh) == NULL;
+}
+
+static
+bool
+lqtest_merge(void)
+{
+	struct lhd_request *r = lqtest_reqs;
+
+	lqtest_reset(0);
+	lqtest_lh.lh_cur = lqtest_req(0, 100, 4, false);
+
+	/* Continues the running request. */
+	if (!lqtest_add(lqtest_req(1, 104, 2, false), true) ||
+	    /* Adjacent, but the other direction. */
+	    !lqtest_add(lqtest_req(2, 106, 1, true), false) ||
+	    !lqtest_add(lqtest_req(3, 200, 2, false), false) ||
+	    /* Front merge: comes just before request 3. */
+	    !lqtest_add(lqtest_req(4, 198, 2, false), true) ||
+	    /* Back merge onto the end of 4's chain. */
+	    !lqtest_add(lqtest_req(5, 202, 1, false), true)) {
+		return false;
+	}
+	if (r[0].lr_merge != &r[1] || r[1].lr_merge != NULL ||
+	    r[4].lr_merge != &r[3] || r[3].lr_merge != &r[5] ||
+	    r[5].lr_merge != NULL || r[2].lr_merge != NULL) {
+		kprintf("lhd1: Merged chains are wrong\n");
+		return false;
+	}
+	lqtest_lh.lh_cur = NULL;
+	lqtest_lh.lh_headpos = 106;
+	if (!lqtest_next(2) || !lqtest_next(4) ||
+	    lhd_queue_next(&lqtest_lh) != NULL) {
+		return false;
+	}
+
+	/* Chains stop growing at LHD_MAXMERGE sectors. */
+	lqtest_reset(0);
+	return lqtest_add(lqtest_req(6, 1000, LHD_MAXMERGE - 1, false),
+			  false) &&
+		lqtest_add(lqtest_req(7, 1000 + LHD_MAXMERGE - 1, 2, false),
+			   false) &&
+		lqtest_next(6) && lqtest_next(7);
+}
+
+int
+lhdqueuetest(int nargs, char **args)
+{
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	ok = lqtest_clook() && lqtest_merge();
+	kprintf("lhd1: %s\n", ok ? "Passed." : "FAILED");
+	return ok ? 0 : EINVAL;
+}
@@ -0,0 +1,206 @@
+/*
+ * mmaptest - tests of file mappings.
+ *
+ * mm1: read() into a mapping of the file being read. The copy out to
+ * the mapping must not have to read in the mapped page while the
+ * filesystem is in the middle of the read; see mmap_prefault.
+ *
+ * This runs in the menu thread, which belongs to the kernel process,
+ * so for the duration it gives that process an address space and a
+ * file table to make the system calls with.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <uio.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <file.h>
+#include <syscall.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define MMFILENAME	"mmaptest.tmp"
+
+/* The file is two pages; page 0 of it gets read into page 1. */
+#define MMPAGES		2
+
+static char mmbuf[MMPAGES * PAGE_SIZE], mmcheck[PAGE_SIZE];
+
+/*
+ * Transfer all of the file NAME to or from mmbuf.
+ */
+static
+int
+mmtest_file(const char *name, enum uio_rw rw)
+{
+	char buf[32];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio u;
+	int err;
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, rw == UIO_WRITE ? O_WRONLY|O_CREAT|O_TRUNC :
+		       O_RDONLY, 0664, &vn);
+	if (err) {
+		return err;
+	}
+	uio_kinit(&iov, &u, mmbuf, sizeof(mmbuf), 0, rw);
+	err = rw == UIO_WRITE ? VOP_WRITE(vn, &u) : VOP_READ(vn, &u);
+	if (err == 0 && u.uio_resid != 0) {
+		err = EIO;
+	}
+	vfs_close(vn);
+	return err;
+}
+
+/*
+ * Whether page PAGE of mmbuf holds what page 0 did at the start.
+ */
+static
+bool
+mmtest_check(unsigned page)
+{
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		if ((unsigned char)mmbuf[page * PAGE_SIZE + i] !=
+		    (unsigned char)('a' + i % 26)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	struct addrspace *as;
+	struct filetable *ft;
+	struct openfile *of;
+	char name[32], buf[32];
+	vaddr_t va;
+	unsigned i;
+	int fd, got, err, ret = 0;
+
+	if (nargs != 2) {
+		kprintf("Usage: mm1 filesystem:\n");
+		return EINVAL;
+	}
+	snprintf(name, sizeof(name), "%s:%s", args[1], MMFILENAME);
+
+	for (i=0; i<sizeof(mmbuf); i++) {
+		mmbuf[i] = (i < PAGE_SIZE ? 'a' : 'A') + i % 26;
+	}
+	err = mmtest_file(name, UIO_WRITE);
+	if (err) {
+		kprintf("mm1: Could not write %s: %s\n", name, strerror(err));
+		return err;
+	}
+
+	KASSERT(curproc->p_files == NULL);
+	KASSERT(curproc_getas() == NULL);
+	ft = filetable_create();
+	as = as_create();
+	if (ft == NULL || as == NULL) {
+		kprintf("mm1: Out of memory\n");
+		if (ft != NULL) {
+			filetable_destroy(ft);
+		}
+		if (as != NULL) {
+			as_destroy(as);
+		}
+		ret = ENOMEM;
+		goto remove;
+	}
+	curproc->p_files = ft;
+	curproc_setas(as);
+	as_activate();
+
+	strcpy(buf, name);
+	err = openfile_open(buf, O_RDWR, 0, &of);
+	if (err == 0) {
+		err = filetable_add(ft, of, &fd);
+		if (err) {
+			openfile_decref(of);
+		}
+	}
+	if (err) {
+		kprintf("mm1: Could not open %s: %s\n", name, strerror(err));
+		ret = err;
+		goto restore;
+	}
+
+	err = sys_mmap(NULL, MMPAGES * PAGE_SIZE, PROT_READ|PROT_WRITE,
+		       MAP_SHARED, fd, 0, &got);
+	if (err) {
+		kprintf("mm1: mmap: %s\n", strerror(err));
+		ret = err;
+		goto close;
+	}
+	va = (vaddr_t)got;
+
+	/* Neither page of the mapping has been touched yet. */
+	err = sys_pread(fd, (userptr_t)(va + PAGE_SIZE), PAGE_SIZE, 0, &got);
+	if (err == 0 && got != PAGE_SIZE) {
+		err = EIO;
+	}
+	if (err == 0) {
+		err = copyin((const_userptr_t)(va + PAGE_SIZE), mmcheck,
+			     PAGE_SIZE);
+	}
+	if (err) {
+		kprintf("mm1: Read into the mapping: %s\n", strerror(err));
+		ret = err;
+		(void)sys_munmap((userptr_t)va, MMPAGES * PAGE_SIZE);
+		goto close;
+	}
+	memcpy(mmbuf + PAGE_SIZE, mmcheck, PAGE_SIZE);
+	if (!mmtest_check(1)) {
+		kprintf("mm1: Mapping got the wrong data\n");
+		ret = EINVAL;
+	}
+
+	/* This writes back the changed page. */
+	err = sys_munmap((userptr_t)va, MMPAGES * PAGE_SIZE);
+	if (err) {
+		kprintf("mm1: munmap: %s\n", strerror(err));
+		ret = err;
+	}
+
+ close:
+	(void)sys_close(fd);
+ restore:
+	curproc_setas(NULL);
+	as_activate();
+	as_destroy(as);
+	curproc->p_files = NULL;
+	filetable_destroy(ft);
+
+	if (ret == 0) {
+		bzero(mmbuf, sizeof(mmbuf));
+		err = mmtest_file(name, UIO_READ);
+		if (err) {
+			kprintf("mm1: Read back: %s\n", strerror(err));
+			ret = err;
+		}
+		else if (!mmtest_check(0) || !mmtest_check(1)) {
+			kprintf("mm1: File has the wrong data\n");
+			ret = EINVAL;
+		}
+	}
+
+ remove:
+	strcpy(buf, name);
+	vfs_remove(buf);
+	kprintf("mm1: %s\n", ret ? "FAILED" : "Passed.");
+	return ret;
+}
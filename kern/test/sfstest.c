@@ -0,0 +1,236 @@
+/*
+ * sfstest - tests of SFS internals.
+ *
+ * sfs1: the buffer cache's error path. A whole-block write whose
+ * copy fails must not overwrite the block with the zero-filled
+ * buffer it got from the cache.
+ *
+ * sfs2: the directory name index. Every name added must come back
+ * as a candidate for its slot (across the table growing), removed
+ * names must not, and free slots come back last in, first out.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define BCFILENAME	"sfstest.tmp"
+
+/* Below USERSPACETOP but never mapped for a kernel thread. */
+#define BADUSERPTR	((userptr_t)0x1000)
+
+/*
+ * Write back everything and shrink the cache to nothing, so the
+ * next access to the file's data block has to go to the disk.
+ */
+static
+int
+bctest_evict(struct vnode *vn)
+{
+	unsigned max;
+	int err;
+
+	err = VOP_FSYNC(vn);
+	if (err) {
+		return err;
+	}
+	max = sfs_buf_getmax();
+	sfs_buf_setmax(1);
+	sfs_buf_setmax(max);
+	return 0;
+}
+
+int
+bufcachetest(int nargs, char **args)
+{
+	static char wbuf[SFS_BLOCKSIZE], rbuf[SFS_BLOCKSIZE];
+	char name[32], buf[32];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio u;
+	unsigned i;
+	int err, ret = 0;
+
+	if (nargs != 2) {
+		kprintf("Usage: sfs1 filesystem:\n");
+		return EINVAL;
+	}
+	snprintf(name, sizeof(name), "%s:%s", args[1], BCFILENAME);
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		wbuf[i] = 'A' + i % 26;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("sfs1: Could not open %s: %s\n", name, strerror(err));
+		return err;
+	}
+
+	uio_kinit(&iov, &u, wbuf, SFS_BLOCKSIZE, 0, UIO_WRITE);
+	err = VOP_WRITE(vn, &u);
+	if (err == 0) {
+		err = bctest_evict(vn);
+	}
+	if (err) {
+		kprintf("sfs1: Write error: %s\n", strerror(err));
+		ret = err;
+		goto out;
+	}
+
+	/* Overwrite the whole block from a pointer that faults. */
+	iov.iov_ubase = BADUSERPTR;
+	iov.iov_len = SFS_BLOCKSIZE;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_offset = 0;
+	u.uio_resid = SFS_BLOCKSIZE;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = UIO_WRITE;
+	u.uio_space = curproc_getas();
+	err = VOP_WRITE(vn, &u);
+	if (err != EFAULT) {
+		kprintf("sfs1: Write from bad pointer gave %s, not %s\n",
+			err ? strerror(err) : "success", strerror(EFAULT));
+		ret = EINVAL;
+		goto out;
+	}
+
+	err = bctest_evict(vn);
+	if (err == 0) {
+		uio_kinit(&iov, &u, rbuf, SFS_BLOCKSIZE, 0, UIO_READ);
+		err = VOP_READ(vn, &u);
+	}
+	if (err) {
+		kprintf("sfs1: Read error: %s\n", strerror(err));
+		ret = err;
+		goto out;
+	}
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		if (u.uio_resid != 0 || rbuf[i] != wbuf[i]) {
+			kprintf("sfs1: Failed write clobbered the block\n");
+			ret = EINVAL;
+			break;
+		}
+	}
+
+ out:
+	vfs_close(vn);
+	strcpy(buf, name);
+	vfs_remove(buf);
+	kprintf("sfs1: %s\n", ret ? "FAILED" : "Passed.");
+	return ret;
+}
+
+/* Enough names that the index grows a few times. */
+#define DHNAMES		1000
+#define DHFREE		40
+
+/*
+ * Whether the index offers SLOT as a candidate for NAME.
+ */
+static
+bool
+dhtest_has(struct sfs_dirhash *dh, const char *name, int slot)
+{
+	void *cursor = NULL;
+	int s;
+
+	while ((s = sfs_dirhash_next(dh, name, &cursor)) >= 0) {
+		if (s == slot) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+dirhashtest(int nargs, char **args)
+{
+	struct sfs_dirhash *dh;
+	char name[16];
+	int i, slot, ret = 0;
+
+	(void)nargs;
+	(void)args;
+
+	dh = sfs_dirhash_create();
+	if (dh == NULL) {
+		kprintf("sfs2: Out of memory\n");
+		return ENOMEM;
+	}
+
+	for (i=0; i<DHNAMES; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (sfs_dirhash_add(dh, name, i)) {
+			kprintf("sfs2: Out of memory\n");
+			ret = ENOMEM;
+			goto out;
+		}
+	}
+	for (i=0; i<DHNAMES; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (!dhtest_has(dh, name, i)) {
+			kprintf("sfs2: %s not found in slot %d\n", name, i);
+			ret = EINVAL;
+			goto out;
+		}
+	}
+
+	/* Take out the even ones; the odd ones must still be there. */
+	for (i=0; i<DHNAMES; i+=2) {
+		snprintf(name, sizeof(name), "file%d", i);
+		sfs_dirhash_remove(dh, name, i);
+	}
+	for (i=0; i<DHNAMES; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (dhtest_has(dh, name, i) != (i % 2 == 1)) {
+			kprintf("sfs2: %s %s after removing the even names\n",
+				name, i % 2 ? "missing" : "still present");
+			ret = EINVAL;
+			goto out;
+		}
+	}
+
+	/* Free slots; more than the initial stack holds. */
+	if (sfs_dirhash_getfree(dh) != -1) {
+		kprintf("sfs2: Free slot before any were added\n");
+		ret = EINVAL;
+		goto out;
+	}
+	for (i=0; i<DHFREE; i++) {
+		if (sfs_dirhash_addfree(dh, i * 2)) {
+			kprintf("sfs2: Out of memory\n");
+			ret = ENOMEM;
+			goto out;
+		}
+	}
+	for (i=DHFREE-1; i>=0; i--) {
+		slot = sfs_dirhash_getfree(dh);
+		if (slot != i * 2 || sfs_dirhash_getfree(dh) != slot) {
+			kprintf("sfs2: Got free slot %d, expected %d\n",
+				slot, i * 2);
+			ret = EINVAL;
+			goto out;
+		}
+		sfs_dirhash_takefree(dh, slot);
+	}
+	if (sfs_dirhash_getfree(dh) != -1) {
+		kprintf("sfs2: Free slot left after taking them all\n");
+		ret = EINVAL;
+	}
+
+ out:
+	sfs_dirhash_destroy(dh);
+	kprintf("sfs2: %s\n", ret ? "FAILED" : "Passed.");
+	return ret;
+}
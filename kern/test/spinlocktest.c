@@ -0,0 +1,167 @@
+/*
+ * Spinlock stress test.
+ *
+ * Runs 1..N threads hammering a single spinlock for a fixed time and
+ * reports, for each thread count, the aggregate throughput and how
+ * evenly the acquisitions were spread across the threads. With the
+ * default test-and-set spinlocks the spread gets worse as CPUs are
+ * added; with "options ticketlock" it should stay close to even.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <spinlock.h>
+#include <test.h>
+
+#define SLT_MAXTHREADS	32
+#define SLT_SECONDS	1
+
+static struct spinlock slt_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned slt_shared;
+static volatile bool slt_stop;
+static volatile unsigned slt_count[SLT_MAXTHREADS];
+static struct semaphore *slt_startsem;
+static struct semaphore *slt_donesem;
+
+static
+void
+slt_thread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	P(slt_startsem);
+	while (!slt_stop) {
+		spinlock_acquire(&slt_lock);
+		slt_shared++;
+		spinlock_release(&slt_lock);
+		slt_count[num]++;
+	}
+	V(slt_donesem);
+}
+
+/*
+ * Run one round with NTHREADS threads. Returns nonzero if mutual
+ * exclusion was violated.
+ */
+static
+int
+slt_round(unsigned nthreads)
+{
+	time_t beforesecs, aftersecs, secs;
+	uint32_t beforensecs, afternsecs, nsecs;
+	struct spinlock_stats ss;
+	unsigned i, total, min, max, ms, persec;
+	char name[16];
+	int result;
+
+	slt_shared = 0;
+	slt_stop = false;
+	for (i=0; i<nthreads; i++) {
+		slt_count[i] = 0;
+	}
+	spinlock_resetstats(&slt_lock);
+
+	for (i=0; i<nthreads; i++) {
+		snprintf(name, sizeof(name), "slt%u", i);
+		result = thread_fork(name, NULL, slt_thread, NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&beforesecs, &beforensecs);
+	for (i=0; i<nthreads; i++) {
+		V(slt_startsem);
+	}
+	clocksleep(SLT_SECONDS);
+	slt_stop = true;
+	for (i=0; i<nthreads; i++) {
+		P(slt_donesem);
+	}
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+
+	total = 0;
+	min = max = slt_count[0];
+	for (i=0; i<nthreads; i++) {
+		total += slt_count[i];
+		if (slt_count[i] < min) {
+			min = slt_count[i];
+		}
+		if (slt_count[i] > max) {
+			max = slt_count[i];
+		}
+	}
+
+	/* avoid 64-bit division */
+	ms = (unsigned)secs * 1000 + nsecs / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+	persec = (total / ms) * 1000 + ((total % ms) * 1000) / ms;
+
+	spinlock_getstats(&slt_lock, &ss);
+	kprintf("%2u threads: %9u acq/s  min %8u  max %8u  fair %3u%%  "
+		"contended %3u%%  spins/wait %u\n",
+		nthreads, persec, min, max,
+		max ? (min * 100) / max : 100,
+		ss.ss_acquires ? (ss.ss_contended * 100) / ss.ss_acquires : 0,
+		ss.ss_contended ? ss.ss_spins / ss.ss_contended : 0);
+
+	if (slt_shared != total) {
+		kprintf("spinlocktest: shared count %u, expected %u\n",
+			slt_shared, total);
+		return 1;
+	}
+	return 0;
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	unsigned n, maxthreads;
+	int failed = 0;
+
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	else {
+		maxthreads = thread_numcpus();
+	}
+	if (maxthreads < 1 || maxthreads > SLT_MAXTHREADS) {
+		kprintf("Usage: sl1 [threads]  (1-%d)\n", SLT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	slt_startsem = sem_create("slt_start", 0);
+	if (slt_startsem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+	slt_donesem = sem_create("slt_done", 0);
+	if (slt_donesem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+
+	kprintf("Starting spinlock test (%s, %u cpus)...\n",
+		OPT_TICKETLOCK ? "ticket" : "test-and-set",
+		thread_numcpus());
+	for (n=1; n<=maxthreads; n++) {
+		failed |= slt_round(n);
+	}
+
+	sem_destroy(slt_donesem);
+	sem_destroy(slt_startsem);
+
+	if (failed) {
+		kprintf("Spinlock test FAILED.\n");
+		return EINVAL;
+	}
+	kprintf("Spinlock test done.\n");
+	return 0;
+}
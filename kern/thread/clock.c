@@ -58,6 +58,11 @@
  */
 static struct wchan *lbolt;
 
+/*
+ * Set once the clock device is attached; gettime() panics before.
+ */
+static bool gettime_ready;
+
 /*
  * Setup.
  */
@@ -70,6 +75,28 @@ hardclock_bootstrap(void)
 	}
 }
 
+void
+gettime_bootstrap(void)
+{
+	gettime_ready = true;
+}
+
+/*
+ * Current time in nanoseconds, or 0 if there is no clock yet.
+ */
+uint64_t
+gettime_nsecs(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!gettime_ready) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
 /*
  * This is called once per second, on one processor, by the timer
  * code.
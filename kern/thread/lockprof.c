@@ -0,0 +1,261 @@
+/*
+ * Lock contention profiler. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockprof.h>
+
+#define LOCKPROF_NAMELEN	24
+#define LOCKPROF_MAXPRINT	64
+
+/*
+ * The global list of records. lockprof_lock itself is deliberately
+ * not profiled.
+ */
+static struct spinlock lockprof_lock = SPINLOCK_INITIALIZER;
+static struct lockprof *lockprof_list;
+
+static const char *const lockprof_kinds[] = {
+	"spin",
+	"lock",
+	"wchan",
+};
+
+////////////////////////////////////////////////////////////
+// Records
+
+static
+void
+lockprof_zero(struct lockprof *lp)
+{
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_spinns = 0;
+	lp->lp_sleeps = 0;
+	lp->lp_sleepns = 0;
+	lp->lp_maxholdns = 0;
+}
+
+void
+lockprof_init(struct lockprof *lp, const char *name, unsigned kind)
+{
+	KASSERT(kind <= LOCKPROF_WCHAN);
+
+	lp->lp_name = name;
+	lp->lp_kind = kind;
+	lockprof_zero(lp);
+	lp->lp_holdstart = 0;
+
+	spinlock_acquire(&lockprof_lock);
+	lp->lp_prev = NULL;
+	lp->lp_next = lockprof_list;
+	if (lockprof_list != NULL) {
+		lockprof_list->lp_prev = lp;
+	}
+	lockprof_list = lp;
+	spinlock_release(&lockprof_lock);
+}
+
+void
+lockprof_cleanup(struct lockprof *lp)
+{
+	spinlock_acquire(&lockprof_lock);
+	if (lp->lp_prev != NULL) {
+		lp->lp_prev->lp_next = lp->lp_next;
+	}
+	else {
+		KASSERT(lockprof_list == lp);
+		lockprof_list = lp->lp_next;
+	}
+	if (lp->lp_next != NULL) {
+		lp->lp_next->lp_prev = lp->lp_prev;
+	}
+	spinlock_release(&lockprof_lock);
+}
+
+void
+lockprof_attach(struct spinlock *lk, const char *name)
+{
+	struct lockprof *lp;
+
+	lp = kmalloc(sizeof(*lp));
+	if (lp == NULL) {
+		/* Not worth failing over; just don't profile it. */
+		return;
+	}
+	lockprof_init(lp, name, LOCKPROF_SPINLOCK);
+	lk->lk_prof = lp;
+}
+
+////////////////////////////////////////////////////////////
+// Events
+
+void
+lockprof_acquired(struct lockprof *lp, bool contended)
+{
+	lp->lp_acquires++;
+	if (contended) {
+		lp->lp_contended++;
+	}
+	lp->lp_holdstart = gettime_nsecs();
+}
+
+void
+lockprof_spun(struct lockprof *lp, bool spun, uint64_t waitstart)
+{
+	lockprof_acquired(lp, spun);
+	if (spun && waitstart != 0 && lp->lp_holdstart > waitstart) {
+		lp->lp_spinns += lp->lp_holdstart - waitstart;
+	}
+}
+
+void
+lockprof_slept(struct lockprof *lp, uint64_t waitstart)
+{
+	uint64_t now;
+
+	lp->lp_sleeps++;
+	now = gettime_nsecs();
+	if (waitstart != 0 && now > waitstart) {
+		lp->lp_sleepns += now - waitstart;
+	}
+}
+
+void
+lockprof_released(struct lockprof *lp)
+{
+	uint64_t now, held;
+
+	if (lp->lp_holdstart == 0) {
+		return;
+	}
+	now = gettime_nsecs();
+	held = now > lp->lp_holdstart ? now - lp->lp_holdstart : 0;
+	if (held > lp->lp_maxholdns) {
+		lp->lp_maxholdns = held;
+	}
+	lp->lp_holdstart = 0;
+}
+
+////////////////////////////////////////////////////////////
+// Reporting
+
+/*
+ * Snapshot of a record, taken so we can print without holding
+ * lockprof_lock (kprintf may sleep) and without the object going
+ * away underneath us.
+ */
+struct lockprof_snap {
+	char ls_name[LOCKPROF_NAMELEN];
+	unsigned ls_kind;
+	unsigned ls_acquires;
+	unsigned ls_contended;
+	uint64_t ls_spinns;
+	unsigned ls_sleeps;
+	uint64_t ls_sleepns;
+	uint64_t ls_maxholdns;
+};
+
+static
+void
+lockprof_snapshot(struct lockprof_snap *ls, const struct lockprof *lp)
+{
+	snprintf(ls->ls_name, sizeof(ls->ls_name), "%s",
+		 lp->lp_name ? lp->lp_name : "(null)");
+	ls->ls_kind = lp->lp_kind;
+	ls->ls_acquires = lp->lp_acquires;
+	ls->ls_contended = lp->lp_contended;
+	ls->ls_spinns = lp->lp_spinns;
+	ls->ls_sleeps = lp->lp_sleeps;
+	ls->ls_sleepns = lp->lp_sleepns;
+	ls->ls_maxholdns = lp->lp_maxholdns;
+}
+
+/*
+ * How contended a record is, for ranking: contended acquires plus
+ * sleeps, which is what actually costs us.
+ */
+static
+unsigned
+lockprof_score(unsigned contended, unsigned sleeps)
+{
+	return contended + sleeps;
+}
+
+void
+lockprof_print(unsigned n)
+{
+	struct lockprof_snap *top;
+	struct lockprof *lp;
+	unsigned i, j, ntop, score, total;
+
+	if (n == 0 || n > LOCKPROF_MAXPRINT) {
+		n = LOCKPROF_MAXPRINT;
+	}
+	top = kmalloc(n * sizeof(*top));
+	if (top == NULL) {
+		kprintf("lockprof: Out of memory\n");
+		return;
+	}
+
+	/* Keep the N highest-scoring records, in order, by insertion. */
+	ntop = 0;
+	total = 0;
+	spinlock_acquire(&lockprof_lock);
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		total++;
+		score = lockprof_score(lp->lp_contended, lp->lp_sleeps);
+		if (score == 0) {
+			continue;
+		}
+		for (i=0; i<ntop; i++) {
+			if (score > lockprof_score(top[i].ls_contended,
+						   top[i].ls_sleeps)) {
+				break;
+			}
+		}
+		if (i == n) {
+			continue;
+		}
+		if (ntop < n) {
+			ntop++;
+		}
+		for (j=ntop-1; j>i; j--) {
+			top[j] = top[j-1];
+		}
+		lockprof_snapshot(&top[i], lp);
+	}
+	spinlock_release(&lockprof_lock);
+
+	kprintf("Lock profile: %u objects, %u contended shown%s\n",
+		total, ntop, gettime_nsecs() != 0 ? "" : " (no times yet)");
+	kprintf("%-24s %-5s %10s %10s %10s %10s %10s %10s\n",
+		"name", "kind", "acquires", "contended", "spin-us",
+		"sleeps", "sleep-us", "maxhold-us");
+	for (i=0; i<ntop; i++) {
+		kprintf("%-24s %-5s %10u %10u %10llu %10u %10llu %10llu\n",
+			top[i].ls_name, lockprof_kinds[top[i].ls_kind],
+			top[i].ls_acquires, top[i].ls_contended,
+			top[i].ls_spinns / 1000,
+			top[i].ls_sleeps,
+			top[i].ls_sleepns / 1000,
+			top[i].ls_maxholdns / 1000);
+	}
+
+	kfree(top);
+}
+
+void
+lockprof_reset(void)
+{
+	struct lockprof *lp;
+
+	spinlock_acquire(&lockprof_lock);
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		lockprof_zero(lp);
+	}
+	spinlock_release(&lockprof_lock);
+}
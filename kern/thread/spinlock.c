@@ -36,11 +36,75 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <clock.h>
+#include <lockprof.h>
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Bounds on the backoff, in delay loop iterations. The
+ * minimum keeps an uncontended acquire from paying anything; the
+ * maximum keeps a waiter from sleeping through many handoffs.
+ */
+#define SPINLOCK_BACKOFF_MIN	4
+#define SPINLOCK_BACKOFF_MAX	1024
+
+#if OPT_TICKETLOCK
+/*
+ * Delay loop iterations per ticket ahead of us. A ticket waiter
+ * knows exactly how many holders it has to wait out, so it backs
+ * off in proportion to that rather than exponentially; exponential
+ * backoff overshoots its turn and leaves the lock idle, and every
+ * waiter behind it then queues up behind the idle time.
+ */
+#define SPINLOCK_BACKOFF_PERTICKET	16
+
+/*
+ * Burn cycles for roughly as long as it takes the holders ahead of
+ * us to get through; AHEAD is the number of tickets before ours.
+ * Once we are next, spin at the minimum delay so the handoff is
+ * picked up promptly.
+ */
+static
+void
+spinlock_ticketbackoff(unsigned ahead)
+{
+	volatile unsigned i;
+	unsigned delay;
+
+	if (ahead > 1) {
+		delay = (ahead - 1) * SPINLOCK_BACKOFF_PERTICKET;
+		if (delay > SPINLOCK_BACKOFF_MAX) {
+			delay = SPINLOCK_BACKOFF_MAX;
+		}
+	}
+	else {
+		delay = SPINLOCK_BACKOFF_MIN;
+	}
+	for (i=0; i<delay; i++) {
+		/* nothing */
+	}
+}
+#else
+/*
+ * Burn some cycles without touching the lock word.
+ */
+static
+void
+spinlock_backoff(unsigned *delay)
+{
+	volatile unsigned i;
+
+	for (i=0; i<*delay; i++) {
+		/* nothing */
+	}
+	if (*delay < SPINLOCK_BACKOFF_MAX) {
+		*delay *= 2;
+	}
+}
+#endif
 
 /*
  * Initialize spinlock.
@@ -48,8 +112,19 @@
 void
 spinlock_init(struct spinlock *lk)
 {
+#if OPT_TICKETLOCK
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
+#else
 	spinlock_data_set(&lk->lk_lock, 0);
+#endif
 	lk->lk_holder = NULL;
+	lk->lk_acquires = 0;
+	lk->lk_contended = 0;
+	lk->lk_spins = 0;
+#if OPT_LOCKPROF
+	lk->lk_prof = NULL;
+#endif
 }
 
 /*
@@ -59,7 +134,12 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
+#if OPT_TICKETLOCK
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
+#else
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+#endif
 }
 
 /*
@@ -73,6 +153,15 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	unsigned spins;
+#if OPT_TICKETLOCK
+	spinlock_data_t ticket, serving;
+#else
+	unsigned delay;
+#endif
+#if OPT_LOCKPROF
+	uint64_t waitstart;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +176,26 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+	spins = 0;
+#if OPT_LOCKPROF
+	waitstart = lk->lk_prof != NULL ? gettime_nsecs() : 0;
+#endif
+
+#if OPT_TICKETLOCK
+	/*
+	 * Take a ticket and wait until it is being served. Only the
+	 * fetch-and-add writes the lock; waiting is read-only, and
+	 * the lock is handed over in the order tickets were taken,
+	 * so no CPU can be starved. The wait is paced by how many
+	 * tickets are still ahead of ours.
+	 */
+	ticket = spinlock_data_fetchadd(&lk->lk_next, 1);
+	while ((serving = spinlock_data_get(&lk->lk_serving)) != ticket) {
+		spinlock_ticketbackoff(ticket - serving);
+		spins++;
+	}
+#else
+	delay = SPINLOCK_BACKOFF_MIN;
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -99,15 +208,30 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+			spinlock_backoff(&delay);
+			spins++;
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+			spinlock_backoff(&delay);
+			spins++;
 			continue;
 		}
 		break;
 	}
+#endif
 
 	lk->lk_holder = mycpu;
+	lk->lk_acquires++;
+	if (spins > 0) {
+		lk->lk_contended++;
+		lk->lk_spins += spins;
+	}
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lockprof_spun(lk->lk_prof, spins > 0, waitstart);
+	}
+#endif
 }
 
 /*
@@ -121,8 +245,19 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	if (lk->lk_prof != NULL) {
+		lockprof_released(lk->lk_prof);
+	}
+#endif
 	lk->lk_holder = NULL;
+#if OPT_TICKETLOCK
+	/* Only the holder writes lk_serving, so no atomic op is needed. */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
+#else
 	spinlock_data_set(&lk->lk_lock, 0);
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +274,29 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+/*
+ * Copy out the lock's counters. This deliberately does not take the
+ * lock (that would count itself); each counter is a single word, so
+ * the snapshot may be slightly stale but not torn.
+ */
+void
+spinlock_getstats(struct spinlock *lk, struct spinlock_stats *ss)
+{
+	ss->ss_acquires = lk->lk_acquires;
+	ss->ss_contended = lk->lk_contended;
+	ss->ss_spins = lk->lk_spins;
+}
+
+/*
+ * Zero the lock's counters.
+ */
+void
+spinlock_resetstats(struct spinlock *lk)
+{
+	spinlock_acquire(lk);
+	lk->lk_acquires = 0;
+	lk->lk_contended = 0;
+	lk->lk_spins = 0;
+	spinlock_release(lk);
+}
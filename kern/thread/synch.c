@@ -38,7 +38,9 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <clock.h>
 #include <synch.h>
+#include "opt-waitmorph.h"
 
 ////////////////////////////////////////////////////////////
 //
@@ -173,6 +175,9 @@ lock_create(const char *name)
 
     spinlock_init(&lock -> lock_sl);
     lock -> held_thread = NULL; // really important!
+#if OPT_LOCKPROF
+    lockprof_init(&lock -> lock_prof, lock -> lock_name, LOCKPROF_LOCK);
+#endif
 
     return lock;
 }
@@ -183,6 +188,9 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
         // add stuff here as needed
+#if OPT_LOCKPROF
+        lockprof_cleanup(&lock -> lock_prof);
+#endif
         spinlock_cleanup(&lock -> lock_sl);
         if (lock -> lock_wchan != NULL)
             wchan_destroy(lock -> lock_wchan);
@@ -194,6 +202,11 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
+#if OPT_LOCKPROF
+    bool slept = false;
+    uint64_t waitstart = 0;
+#endif
+
     // Write this
     KASSERT(lock != NULL);
     /** t_in_interrupt is true if current execution is in an
@@ -208,6 +221,12 @@ lock_acquire(struct lock *lock)
 
     spinlock_acquire(&lock -> lock_sl);
         while (lock -> held_thread != NULL){
+#if OPT_LOCKPROF
+            if (!slept) {
+                slept = true;
+                waitstart = gettime_nsecs();
+            }
+#endif
             wchan_lock(lock -> lock_wchan);      // cannot reverse the
             spinlock_release(&lock -> lock_sl);  // order of these two lines
                 wchan_sleep(lock -> lock_wchan);
@@ -215,6 +234,12 @@ lock_acquire(struct lock *lock)
         }
         
         lock -> held_thread = curthread;
+#if OPT_LOCKPROF
+        if (slept) {
+            lockprof_slept(&lock -> lock_prof, waitstart);
+        }
+        lockprof_acquired(&lock -> lock_prof, slept);
+#endif
     spinlock_release(&lock -> lock_sl);
 
 }
@@ -227,6 +252,9 @@ lock_release(struct lock *lock)
     // ensure the thread that release the lock is the same thread acquired the lock;
     KASSERT(lock_do_i_hold(lock) == true);
     spinlock_acquire(&lock -> lock_sl);
+#if OPT_LOCKPROF
+        lockprof_released(&lock -> lock_prof);
+#endif
         lock -> held_thread = NULL;
         wchan_wakeone(lock -> lock_wchan);
     spinlock_release(&lock -> lock_sl);
@@ -318,7 +346,17 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     KASSERT(lock != NULL);
 
     if (lock_do_i_hold(lock)){
+#if OPT_WAITMORPH
+        /*
+         * Wait morphing: every waiter would wake up only to queue
+         * on the lock we hold, so put them straight on the lock's
+         * wait channel; lock_release then hands the lock over one
+         * waiter at a time instead of all of them stampeding.
+         */
+        wchan_requeue(cv -> cv_wchan, lock -> lock_wchan);
+#else
         wchan_wakeall(cv -> cv_wchan);
+#endif
     }
     else{
         KASSERT("Current condition variable does not hold the lock!");
@@ -37,6 +37,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <clock.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -50,6 +51,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <lockprof.h>
 
 #include "opt-synchprobs.h"
 
@@ -62,6 +64,9 @@ struct wchan {
 	const char *wc_name;		/* name for this channel */
 	struct threadlist wc_threads;	/* list of waiting threads */
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
+#if OPT_LOCKPROF
+	struct lockprof wc_prof;	/* contention profile */
+#endif
 };
 
 /* Master array of CPUs. */
@@ -72,6 +77,25 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+#if OPT_SCHEDSTATS
+/*
+ * Record a run queue length in the histogram. Bucket 0 is for empty
+ * queues; bucket i holds lengths 2^(i-1) through 2^i - 1.
+ */
+static
+void
+schedstats_rqsample(struct cpu *c, unsigned len)
+{
+	unsigned bucket;
+
+	for (bucket = 0; len > 0 && bucket < SCHEDSTATS_RQBUCKETS - 1;
+	     bucket++) {
+		len >>= 1;
+	}
+	c->c_schedstats.ss_rqlen[bucket]++;
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -143,6 +167,15 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+#if OPT_LOCKPROF
+	thread->t_sleepstart = 0;
+#endif
+#if OPT_SCHEDSTATS
+	thread->t_readytime = 0;
+#endif
+#if OPT_MMAP
+	thread->t_mmapnofill = false;
+#endif
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -184,6 +217,12 @@ cpu_create(unsigned hardware_number)
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+#if OPT_SCHEDSTATS
+	bzero(&c->c_schedstats, sizeof(c->c_schedstats));
+#endif
+#if OPT_LOCKPROF
+	lockprof_attach(&c->c_runqueue_lock, "runqueue");
+#endif
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -193,6 +232,9 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+#if OPT_SCHEDSTATS
+	c->c_schedstats.ss_cpu = c->c_number;
+#endif
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -340,6 +382,73 @@ thread_shutdown(void)
 	ipi_broadcast(IPI_OFFLINE);
 }
 
+/*
+ * Return the number of CPUs.
+ */
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+#if OPT_SCHEDSTATS
+/*
+ * Copy out the scheduler statistics for one cpu.
+ */
+int
+thread_getschedstats(unsigned cpunum, struct schedstats *ss)
+{
+	struct cpu *c;
+
+	if (cpunum >= cpuarray_num(&allcpus)) {
+		return EINVAL;
+	}
+	c = cpuarray_get(&allcpus, cpunum);
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	*ss = c->c_schedstats;
+	spinlock_release(&c->c_runqueue_lock);
+
+	return 0;
+}
+
+/*
+ * Print the scheduler statistics for all cpus.
+ */
+void
+thread_printschedstats(void)
+{
+	struct schedstats ss;
+	unsigned i, j;
+
+	for (i=0; thread_getschedstats(i, &ss) == 0; i++) {
+		kprintf("cpu%u: %u switches, %u migrated in, %u out, "
+			"idle %llu ms\n", ss.ss_cpu, ss.ss_switches,
+			ss.ss_migrated_in, ss.ss_migrated_out,
+			ss.ss_idletime / 1000000);
+		kprintf("      latency: %u samples, avg %llu us, max %llu us\n",
+			ss.ss_latcount,
+			ss.ss_latcount ? ss.ss_lattotal / ss.ss_latcount / 1000
+				: 0,
+			ss.ss_latmax / 1000);
+		kprintf("      run queue length:");
+		for (j=0; j<SCHEDSTATS_RQBUCKETS; j++) {
+			if (j == 0) {
+				kprintf(" 0:%u", ss.ss_rqlen[j]);
+			}
+			else if (j == SCHEDSTATS_RQBUCKETS - 1) {
+				kprintf(" %u+:%u", 1U << (j-1), ss.ss_rqlen[j]);
+			}
+			else {
+				kprintf(" %u-%u:%u", 1U << (j-1), (1U << j) - 1,
+					ss.ss_rqlen[j]);
+			}
+		}
+		kprintf("\n");
+	}
+}
+#endif
+
 /*
  * Thread system initialization.
  */
@@ -451,6 +560,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	isidle = targetcpu->c_isidle;
 	threadlist_addtail(&targetcpu->c_runqueue, target);
+#if OPT_SCHEDSTATS
+	target->t_readytime = gettime_nsecs();
+#endif
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -464,6 +576,36 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Make a batch of threads runnable. All the threads on TL must
+ * belong to TARGETCPU; TL is left empty. The run queue lock is taken
+ * once and the cpu is sent at most one IPI no matter how many
+ * threads are in the batch.
+ */
+static
+void
+thread_make_runnable_batch(struct cpu *targetcpu, struct threadlist *tl)
+{
+	struct thread *target;
+	bool isidle;
+
+	spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+	isidle = targetcpu->c_isidle;
+	while ((target = threadlist_remhead(tl)) != NULL) {
+		KASSERT(target->t_cpu == targetcpu);
+		threadlist_addtail(&targetcpu->c_runqueue, target);
+#if OPT_SCHEDSTATS
+		target->t_readytime = gettime_nsecs();
+#endif
+	}
+	if (isidle) {
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+
+	spinlock_release(&targetcpu->c_runqueue_lock);
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -549,6 +691,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
 	int spl;
+#if OPT_SCHEDSTATS
+	uint64_t now;
+#endif
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
 	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
@@ -631,16 +776,43 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+#if OPT_SCHEDSTATS
+	schedstats_rqsample(curcpu->c_self, curcpu->c_runqueue.tl_count);
+#endif
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+#if OPT_SCHEDSTATS
+			now = gettime_nsecs();
+#endif
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+#if OPT_SCHEDSTATS
+			if (now != 0) {
+				curcpu->c_schedstats.ss_idletime +=
+					gettime_nsecs() - now;
+			}
+#endif
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+#if OPT_SCHEDSTATS
+	/* Account the switch, and how long NEXT sat on the run queue. */
+	curcpu->c_schedstats.ss_switches++;
+	now = gettime_nsecs();
+	if (now != 0 && next->t_readytime != 0 && now > next->t_readytime) {
+		curcpu->c_schedstats.ss_latcount++;
+		curcpu->c_schedstats.ss_lattotal += now - next->t_readytime;
+		if (now - next->t_readytime > curcpu->c_schedstats.ss_latmax) {
+			curcpu->c_schedstats.ss_latmax =
+				now - next->t_readytime;
+		}
+	}
+	next->t_readytime = 0;
+#endif
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -857,6 +1029,9 @@ thread_consider_migration(void)
 {
 	unsigned my_count, total_count, one_share, to_send;
 	unsigned i, numcpus;
+#if OPT_SCHEDSTATS
+	unsigned migrated = 0;
+#endif
 	struct cpu *c;
 	struct threadlist victims;
 	struct thread *t;
@@ -925,6 +1100,10 @@ thread_consider_migration(void)
 
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
+#if OPT_SCHEDSTATS
+			c->c_schedstats.ss_migrated_in++;
+			migrated++;
+#endif
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -953,6 +1132,14 @@ thread_consider_migration(void)
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
 
+#if OPT_SCHEDSTATS
+	if (migrated > 0) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		curcpu->c_schedstats.ss_migrated_out += migrated;
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+#endif
+
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
 }
@@ -983,6 +1170,10 @@ wchan_create(const char *name)
 	spinlock_init(&wc->wc_lock);
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+#if OPT_LOCKPROF
+	lockprof_init(&wc->wc_prof, name, LOCKPROF_WCHAN);
+	wc->wc_lock.lk_prof = &wc->wc_prof;
+#endif
 	return wc;
 }
 
@@ -993,6 +1184,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+#if OPT_LOCKPROF
+	lockprof_cleanup(&wc->wc_prof);
+#endif
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
 	kfree(wc);
@@ -1025,6 +1219,10 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+#if OPT_LOCKPROF
+	/* The waker accounts the sleep; the wchan may be gone by then. */
+	curthread->t_sleepstart = gettime_nsecs();
+#endif
 	thread_switch(S_SLEEP, wc);
 }
 
@@ -1039,6 +1237,11 @@ wchan_wakeone(struct wchan *wc)
 	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
 	target = threadlist_remhead(&wc->wc_threads);
+#if OPT_LOCKPROF
+	if (target != NULL) {
+		lockprof_slept(&wc->wc_prof, target->t_sleepstart);
+	}
+#endif
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1060,9 +1263,12 @@ void
 wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct cpu *targetcpu;
+	struct threadlist list, batch, others;
 
 	threadlist_init(&list);
+	threadlist_init(&batch);
+	threadlist_init(&others);
 
 	/*
 	 * Lock the channel and grab all the threads, moving them to a
@@ -1070,6 +1276,9 @@ wchan_wakeall(struct wchan *wc)
 	 */
 	spinlock_acquire(&wc->wc_lock);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+#if OPT_LOCKPROF
+		lockprof_slept(&wc->wc_prof, target->t_sleepstart);
+#endif
 		threadlist_addtail(&list, target);
 	}
 	/*
@@ -1079,13 +1288,70 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Sort by cpu so each run queue lock is taken, and each idle
+	 * cpu is poked, once per wakeall rather than once per thread.
+	 * Each pass peels off the threads belonging to the cpu of the
+	 * first one left on the list. Threads wake on the cpu they
+	 * last ran on, which is where their cache state is.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		targetcpu = target->t_cpu;
+		threadlist_addtail(&batch, target);
+		while ((target = threadlist_remhead(&list)) != NULL) {
+			if (target->t_cpu == targetcpu) {
+				threadlist_addtail(&batch, target);
+			}
+			else {
+				threadlist_addtail(&others, target);
+			}
+		}
+		thread_make_runnable_batch(targetcpu, &batch);
+		while ((target = threadlist_remhead(&others)) != NULL) {
+			threadlist_addtail(&list, target);
+		}
+	}
+
+	threadlist_cleanup(&others);
+	threadlist_cleanup(&batch);
+	threadlist_cleanup(&list);
+}
+
+/*
+ * Move all the threads sleeping on one wait channel to another.
+ *
+ * To avoid lock ordering trouble, the threads are pulled off FROM
+ * onto a private list first, and TO is locked only after FROM has
+ * been released. The threads stay asleep throughout. Nobody can
+ * find them to wake them while they're on the private list; that is
+ * fine for wait morphing, because the caller holds the lock whose
+ * channel TO is, so nothing can wake TO in the meantime anyway.
+ */
+void
+wchan_requeue(struct wchan *from, struct wchan *to)
+{
+	struct thread *target;
+	struct threadlist list;
+
+	KASSERT(from != to);
+
+	threadlist_init(&list);
+
+	spinlock_acquire(&from->wc_lock);
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+#if OPT_LOCKPROF
+		lockprof_slept(&from->wc_prof, target->t_sleepstart);
+		target->t_sleepstart = gettime_nsecs();
+#endif
+		threadlist_addtail(&list, target);
+	}
+	spinlock_release(&from->wc_lock);
+
+	spinlock_acquire(&to->wc_lock);
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
 	}
+	spinlock_release(&to->wc_lock);
 
 	threadlist_cleanup(&list);
 }
@@ -0,0 +1,335 @@
+/*
+ * Pathname component cache ("options namecache").
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or
+ * records that the name doesn't exist (a negative entry). vfs_lookup
+ * and vfs_lookparent walk paths a component at a time through the
+ * cache and only call VOP_LOOKUP on a miss.
+ *
+ * Each entry holds a reference to its directory and (for positive
+ * entries) to the target, so neither can be reclaimed and reused
+ * while the entry exists. The cache is kept small and recycled in
+ * LRU order so it doesn't pin too many vnodes, and the entries for a
+ * filesystem are purged before it is unmounted.
+ *
+ * The VFS operations that change a directory (create, remove,
+ * rename, link, symlink, mkdir, rmdir) invalidate the names they
+ * touch once the change has been made. "." and ".." are never
+ * cached, so renaming a directory doesn't leave stale entries behind.
+ *
+ * A lookup that misses calls VOP_LOOKUP and then enters the result,
+ * and a change to the directory can land in between; entering the
+ * old answer after the change's invalidation would leave it stale.
+ * So every invalidation bumps ncache_gen, and an entry is only made
+ * if ncache_gen hasn't moved since the miss. That is coarse (any
+ * invalidation anywhere costs the racing lookups their entries) but
+ * invalidations are rare next to lookups.
+ *
+ * Everything is protected by ncache_lock, a spinlock; it is only
+ * held to search and update the lists. Entries are allocated before
+ * taking it, and entries being thrown away are unlinked under it and
+ * put on a list to be released (which may reclaim vnodes) after.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Longer names are looked up normally but not cached. */
+#define NCACHE_NAMELEN		32
+
+#define NCACHE_NBUCKETS		64
+#define NCACHE_MAX		256
+
+struct ncentry {
+	struct vnode *nc_dir;			/* directory */
+	struct vnode *nc_vn;			/* target, or NULL */
+	char nc_name[NCACHE_NAMELEN];
+	struct ncentry *nc_hashnext;
+	struct ncentry *nc_lruprev;		/* head is oldest */
+	struct ncentry *nc_lrunext;
+};
+
+static struct spinlock ncache_lock = SPINLOCK_INITIALIZER;
+static struct ncentry *ncache_hash[NCACHE_NBUCKETS];
+static struct ncentry *ncache_lruhead;
+static struct ncentry *ncache_lrutail;
+static unsigned ncache_num;
+static unsigned ncache_gen;
+
+/* Statistics */
+static unsigned ncache_hits;
+static unsigned ncache_neghits;
+static unsigned ncache_misses;
+
+static
+unsigned
+ncache_bucket(struct vnode *dir, const char *name)
+{
+	uint32_t h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % NCACHE_NBUCKETS;
+}
+
+static
+struct ncentry **
+ncache_find(struct vnode *dir, const char *name)
+{
+	struct ncentry **pp;
+
+	pp = &ncache_hash[ncache_bucket(dir, name)];
+	for (; *pp != NULL; pp = &(*pp)->nc_hashnext) {
+		if ((*pp)->nc_dir == dir && !strcmp((*pp)->nc_name, name)) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+ncache_lruremove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		ncache_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		ncache_lrutail = nc->nc_lruprev;
+	}
+}
+
+static
+void
+ncache_lruappend(struct ncentry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = ncache_lrutail;
+	if (ncache_lrutail != NULL) {
+		ncache_lrutail->nc_lrunext = nc;
+	}
+	else {
+		ncache_lruhead = nc;
+	}
+	ncache_lrutail = nc;
+}
+
+/*
+ * Unlink the entry *PP points to and add it to the list *DEAD, to be
+ * freed with ncache_free once ncache_lock is released.
+ */
+static
+void
+ncache_remove(struct ncentry **pp, struct ncentry **dead)
+{
+	struct ncentry *nc = *pp;
+
+	KASSERT(spinlock_do_i_hold(&ncache_lock));
+
+	*pp = nc->nc_hashnext;
+	ncache_lruremove(nc);
+	ncache_num--;
+
+	nc->nc_hashnext = *dead;
+	*dead = nc;
+}
+
+/*
+ * Drop the references held by a list of removed entries and free them.
+ */
+static
+void
+ncache_free(struct ncentry *dead)
+{
+	struct ncentry *nc;
+
+	KASSERT(!spinlock_do_i_hold(&ncache_lock));
+
+	while (dead != NULL) {
+		nc = dead;
+		dead = nc->nc_hashnext;
+
+		VOP_DECREF(nc->nc_dir);
+		if (nc->nc_vn != NULL) {
+			VOP_DECREF(nc->nc_vn);
+		}
+		kfree(nc);
+	}
+}
+
+/*
+ * Look up NAME in DIR. Returns true if there's an entry, in which
+ * case *RET is either a new reference to the target or NULL if the
+ * name is known not to exist. Otherwise *GEN is set, to be passed
+ * to vfs_ncache_enter with the result of looking the name up.
+ */
+bool
+vfs_ncache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+		  unsigned *gen)
+{
+	struct ncentry **pp, *nc;
+
+	spinlock_acquire(&ncache_lock);
+
+	pp = ncache_find(dir, name);
+	if (pp == NULL) {
+		ncache_misses++;
+		*gen = ncache_gen;
+		spinlock_release(&ncache_lock);
+		return false;
+	}
+	nc = *pp;
+
+	ncache_lruremove(nc);
+	ncache_lruappend(nc);
+
+	if (nc->nc_vn != NULL) {
+		ncache_hits++;
+		VOP_INCREF(nc->nc_vn);
+	}
+	else {
+		ncache_neghits++;
+	}
+	*ret = nc->nc_vn;
+
+	spinlock_release(&ncache_lock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR refers to VN (or, if VN is NULL, doesn't
+ * exist), as found after the miss that returned GEN. If anything has
+ * been invalidated since, the answer may be out of date already and
+ * isn't cached. Failing to allocate an entry just means not caching
+ * it either.
+ */
+void
+vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct ncentry **pp, *nc, *old;
+	struct ncentry *dead = NULL;
+	unsigned b;
+
+	if (strlen(name) >= NCACHE_NAMELEN) {
+		return;
+	}
+
+	nc = kmalloc(sizeof(*nc));
+	if (nc == NULL) {
+		return;
+	}
+	VOP_INCREF(dir);
+	nc->nc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+
+	spinlock_acquire(&ncache_lock);
+
+	if (gen != ncache_gen) {
+		/* Raced with a change; throw nc away instead. */
+		spinlock_release(&ncache_lock);
+		nc->nc_hashnext = NULL;
+		ncache_free(nc);
+		return;
+	}
+
+	pp = ncache_find(dir, name);
+	if (pp != NULL) {
+		ncache_remove(pp, &dead);
+	}
+
+	if (ncache_num >= NCACHE_MAX) {
+		old = ncache_lruhead;
+		ncache_remove(ncache_find(old->nc_dir, old->nc_name), &dead);
+	}
+
+	b = ncache_bucket(dir, name);
+	nc->nc_hashnext = ncache_hash[b];
+	ncache_hash[b] = nc;
+	ncache_lruappend(nc);
+	ncache_num++;
+
+	spinlock_release(&ncache_lock);
+
+	ncache_free(dead);
+}
+
+/*
+ * Forget whatever we know about NAME in DIR.
+ */
+void
+vfs_ncache_invalidate(struct vnode *dir, const char *name)
+{
+	struct ncentry **pp;
+	struct ncentry *dead = NULL;
+
+	spinlock_acquire(&ncache_lock);
+	ncache_gen++;
+	pp = ncache_find(dir, name);
+	if (pp != NULL) {
+		ncache_remove(pp, &dead);
+	}
+	spinlock_release(&ncache_lock);
+
+	ncache_free(dead);
+}
+
+/*
+ * Drop all the entries for directories on FS, so it can be
+ * unmounted.
+ */
+void
+vfs_ncache_purgefs(struct fs *fs)
+{
+	struct ncentry **pp;
+	struct ncentry *dead = NULL;
+	unsigned i;
+
+	spinlock_acquire(&ncache_lock);
+	ncache_gen++;
+	for (i=0; i<NCACHE_NBUCKETS; i++) {
+		pp = &ncache_hash[i];
+		while (*pp != NULL) {
+			if ((*pp)->nc_dir->vn_fs == fs) {
+				ncache_remove(pp, &dead);
+			}
+			else {
+				pp = &(*pp)->nc_hashnext;
+			}
+		}
+	}
+	spinlock_release(&ncache_lock);
+
+	ncache_free(dead);
+}
+
+void
+vfs_ncache_printstats(void)
+{
+	unsigned num, hits, neghits, misses;
+
+	/* Don't kprintf with a spinlock held. */
+	spinlock_acquire(&ncache_lock);
+	num = ncache_num;
+	hits = ncache_hits;
+	neghits = ncache_neghits;
+	misses = ncache_misses;
+	spinlock_release(&ncache_lock);
+
+	kprintf("name cache: %u/%u entries, %u hits, %u negative hits, "
+		"%u misses\n", num, NCACHE_MAX, hits, neghits, misses);
+}
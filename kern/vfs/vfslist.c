@@ -87,7 +87,7 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
+/* Lock for knowndevs, mount/unmount/sync, and bootfs (see vfs.h). */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
@@ -571,6 +571,11 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+#if OPT_NAMECACHE
+	/* Cached names hold references to the filesystem's vnodes */
+	vfs_ncache_purgefs(kd->kd_fs);
+#endif
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -619,6 +624,10 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+#if OPT_NAMECACHE
+		vfs_ncache_purgefs(dev->kd_fs);
+#endif
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
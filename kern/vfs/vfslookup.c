@@ -123,6 +123,10 @@ vfs_clearbootfs(void)
 /*
  * Common code to pull the device name, if any, off the front of a
  * path and choose the vnode to begin the name lookup relative to.
+ *
+ * The device table and bootfs_vnode are protected by the vfs
+ * biglock; once we have a reference to the starting vnode the rest
+ * of the lookup is up to the filesystem.
  */
 
 static
@@ -133,8 +137,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -171,7 +173,9 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 		}
 		*subpath = &path[colon+1];
 		
+		vfs_biglock_acquire();
 		result = vfs_getroot(path, startvn);
+		vfs_biglock_release();
 		if (result) {
 			return result;
 		}
@@ -188,11 +192,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		vfs_biglock_acquire();
 		if (bootfs_vnode==NULL) {
+			vfs_biglock_release();
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		vfs_biglock_release();
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -223,6 +230,80 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+#if OPT_NAMECACHE
+/*
+ * Look up one path component NAME in DIR, going through the name
+ * cache.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **retval)
+{
+	unsigned gen;
+	int result;
+
+	/* These depend on where DIR is, not on DIR's contents. */
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return VOP_LOOKUP(dir, name, retval);
+	}
+
+	if (vfs_ncache_lookup(dir, name, retval, &gen)) {
+		return *retval != NULL ? 0 : ENOENT;
+	}
+
+	result = VOP_LOOKUP(dir, name, retval);
+	if (result == 0) {
+		vfs_ncache_enter(dir, name, *retval, gen);
+	}
+	else if (result == ENOENT) {
+		vfs_ncache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Translate PATH relative to DIR a component at a time. Consumes
+ * the caller's reference to DIR.
+ */
+static
+int
+walkpath(struct vnode *dir, char *path, struct vnode **retval)
+{
+	char name[NAME_MAX+1];
+	struct vnode *vn;
+	size_t len;
+	int result;
+
+	while (1) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			*retval = dir;
+			return 0;
+		}
+
+		for (len=0; path[len] != 0 && path[len] != '/'; len++) {
+			/* nothing */
+		}
+		if (len > NAME_MAX) {
+			VOP_DECREF(dir);
+			return ENAMETOOLONG;
+		}
+		memcpy(name, path, len);
+		name[len] = 0;
+		path += len;
+
+		result = lookup_component(dir, name, &vn);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = vn;
+	}
+}
+#endif /* OPT_NAMECACHE */
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -235,11 +316,8 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -252,12 +330,28 @@ vfs_lookparent(char *path, struct vnode **retval,
 		result = EINVAL;
 	}
 	else {
+#if OPT_NAMECACHE
+		/*
+		 * Walk everything up to the last component through
+		 * the name cache, and hand the last component to the
+		 * directory it's in.
+		 */
+		char *last = strrchr(path, '/');
+
+		if (last != NULL) {
+			*last = 0;
+			result = walkpath(startvn, path, &startvn);
+			if (result) {
+				return result;
+			}
+			path = last + 1;
+		}
+#endif
 		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
 	}
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -267,23 +361,22 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+#if OPT_NAMECACHE
+	result = walkpath(startvn, path, retval);
+#else
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
+#endif
 	return result;
 }
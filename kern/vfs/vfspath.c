@@ -74,6 +74,11 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+#if OPT_NAMECACHE
+		if (result == 0) {
+			vfs_ncache_invalidate(dir, name);
+		}
+#endif
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +155,11 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+#if OPT_NAMECACHE
+	if (result == 0) {
+		vfs_ncache_invalidate(dir, name);
+	}
+#endif
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +193,12 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+#if OPT_NAMECACHE
+	if (result == 0) {
+		vfs_ncache_invalidate(olddir, oldname);
+		vfs_ncache_invalidate(newdir, newname);
+	}
+#endif
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +233,11 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+#if OPT_NAMECACHE
+	if (result == 0) {
+		vfs_ncache_invalidate(newdir, newname);
+	}
+#endif
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +265,11 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+#if OPT_NAMECACHE
+	if (result == 0) {
+		vfs_ncache_invalidate(newdir, newname);
+	}
+#endif
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +316,11 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+#if OPT_NAMECACHE
+	if (result == 0) {
+		vfs_ncache_invalidate(parent, name);
+	}
+#endif
 
 	VOP_DECREF(parent);
 
@@ -312,6 +343,11 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+#if OPT_NAMECACHE
+	if (result == 0) {
+		vfs_ncache_invalidate(parent, name);
+	}
+#endif
 
 	VOP_DECREF(parent);
 
@@ -11,6 +11,9 @@
 #include <array.h>
 #include <uw-vmstats.h>
 #include "opt-A3.h"
+#if OPT_MMAP
+#include <mmap.h>
+#endif
 
 #if OPT_A3
 
@@ -35,6 +38,9 @@ as_create(void)
 
 	as->isLoaded = false;
 	as->pt = array_create();
+#if OPT_MMAP
+	as->as_mmaps = NULL;
+#endif
 
 	return as;
 }
@@ -42,6 +48,9 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+#if OPT_MMAP
+	mmap_destroyall(as);
+#endif
 	kfree(as);
 	// array_destroy(as->pt);
 }
@@ -124,7 +133,7 @@ static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
 {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	fastzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
 int
@@ -270,6 +279,13 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+#if OPT_MMAP
+	if (mmap_copy(old, new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
+#endif
 	
 	*ret = new;
 	return 0;
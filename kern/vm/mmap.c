@@ -0,0 +1,571 @@
+/*
+ * File-backed memory regions ("options mmap").
+ *
+ * Each address space has a list of regions created by mmap(). A
+ * region records the vnode (which it holds a reference to), the file
+ * offset it starts at, and for each page the physical page holding
+ * it, if it's been faulted in yet. Pages are read in through
+ * VOP_READ, and so through the buffer cache where there is one, the
+ * first time they're touched, and whatever lies past the end of the
+ * file reads as zeros.
+ *
+ * Pages of writable MAP_SHARED regions are first entered in the TLB
+ * read-only. The first write takes a VM_FAULT_READONLY fault, which
+ * marks the page dirty and makes it writable. Dirty pages are written
+ * back (never past the file's current end) by munmap, by fsync on the
+ * file, and when the address space is destroyed. MAP_PRIVATE pages
+ * are never written back.
+ *
+ * There's no page cache shared between address spaces, so two
+ * processes mapping the same file each get their own copy of the
+ * pages and only see each other's changes once they're written back.
+ *
+ * Pages are never read in while the thread is in the middle of a
+ * read or write system call's VOP_READ or VOP_WRITE (t_mmapnofill).
+ * The filesystem may be holding its locks, or a buffer busy, while
+ * it copies to or from the user buffer, and the VOP_READ to fill the
+ * page could need those same locks (say, read() into a mapping of
+ * the file being read). Such faults fail with EFAULT; the system
+ * calls avoid them by calling mmap_prefault on their buffers before
+ * the transfer starts. Other copyin and copyout faults fill pages as
+ * usual.
+ *
+ * Address spaces belong to one thread, so none of this needs locks.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spl.h>
+#include <uio.h>
+#include <current.h>
+#include <thread.h>
+#include <vnode.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <mmap.h>
+
+/* Mappings are placed top-down starting here, leaving room for the stack */
+#define MMAP_TOP	(USERSTACK - 0x1000000)
+
+struct mmap_region {
+	vaddr_t mr_base;
+	unsigned mr_npages;
+	int mr_prot;			/* PROT_* */
+	int mr_flags;			/* MAP_SHARED or MAP_PRIVATE */
+	struct vnode *mr_vn;
+	off_t mr_offset;		/* file offset of mr_base */
+	paddr_t *mr_pages;		/* physical pages, 0 if not resident */
+	bool *mr_dirty;			/* needs writing back */
+	struct mmap_region *mr_next;
+};
+
+////////////////////////////////////////////////////////////
+//
+// TLB
+
+static
+void
+mmap_tlbload(vaddr_t va, paddr_t pa, bool writable)
+{
+	uint32_t ehi, elo;
+	int spl, index;
+
+	ehi = va;
+	elo = pa | TLBLO_VALID | (writable ? TLBLO_DIRTY : 0);
+
+	spl = splhigh();
+	index = tlb_probe(ehi, 0);
+	if (index >= 0) {
+		tlb_write(ehi, elo, index);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+}
+
+static
+void
+mmap_tlbinval(vaddr_t va)
+{
+	int spl, index;
+
+	spl = splhigh();
+	index = tlb_probe(va, 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+	splx(spl);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Regions
+
+static
+struct mmap_region *
+mmap_region_create(unsigned npages)
+{
+	struct mmap_region *mr;
+	unsigned i;
+
+	mr = kmalloc(sizeof(*mr));
+	if (mr == NULL) {
+		return NULL;
+	}
+	mr->mr_pages = kmalloc(npages * sizeof(mr->mr_pages[0]));
+	mr->mr_dirty = kmalloc(npages * sizeof(mr->mr_dirty[0]));
+	if (mr->mr_pages == NULL || mr->mr_dirty == NULL) {
+		kfree(mr->mr_pages);
+		kfree(mr->mr_dirty);
+		kfree(mr);
+		return NULL;
+	}
+	for (i=0; i<npages; i++) {
+		mr->mr_pages[i] = 0;
+		mr->mr_dirty[i] = false;
+	}
+	mr->mr_npages = npages;
+	mr->mr_next = NULL;
+	return mr;
+}
+
+static
+void
+mmap_region_destroy(struct mmap_region *mr)
+{
+	unsigned i;
+
+	for (i=0; i<mr->mr_npages; i++) {
+		if (mr->mr_pages[i] != 0) {
+			releasepages(mr->mr_pages[i]);
+		}
+	}
+	VOP_DECREF(mr->mr_vn);
+	kfree(mr->mr_pages);
+	kfree(mr->mr_dirty);
+	kfree(mr);
+}
+
+static
+struct mmap_region *
+mmap_find(struct addrspace *as, vaddr_t addr)
+{
+	struct mmap_region *mr;
+
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (addr >= mr->mr_base &&
+		    addr < mr->mr_base + mr->mr_npages * PAGE_SIZE) {
+			return mr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find NPAGES of unused address space below MMAP_TOP and above the
+ * program's own regions.
+ */
+static
+int
+mmap_place(struct addrspace *as, unsigned npages, vaddr_t *ret)
+{
+	struct mmap_region *mr;
+	vaddr_t top, base, floor;
+	size_t len = npages * PAGE_SIZE;
+
+	floor = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	if (as->as_vbase2 + as->as_npages2 * PAGE_SIZE > floor) {
+		floor = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	}
+
+	top = MMAP_TOP;
+ again:
+	if (top - floor < len) {
+		return ENOMEM;
+	}
+	base = top - len;
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (base < mr->mr_base + mr->mr_npages * PAGE_SIZE &&
+		    mr->mr_base < top) {
+			top = mr->mr_base;
+			goto again;
+		}
+	}
+	*ret = base;
+	return 0;
+}
+
+/*
+ * Write page PAGE of MR back to the file if it's dirty, stopping at
+ * the end of the file.
+ */
+static
+int
+mmap_writeback(struct mmap_region *mr, unsigned page)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	off_t pos;
+	size_t len;
+	int result;
+
+	if (!mr->mr_dirty[page]) {
+		return 0;
+	}
+
+	result = VOP_STAT(mr->mr_vn, &st);
+	if (result) {
+		return result;
+	}
+	pos = mr->mr_offset + (off_t)page * PAGE_SIZE;
+	if (pos < st.st_size) {
+		len = PAGE_SIZE;
+		if (st.st_size - pos < PAGE_SIZE) {
+			len = st.st_size - pos;
+		}
+		uio_kinit(&iov, &u,
+			  (void *)PADDR_TO_KVADDR(mr->mr_pages[page]),
+			  len, pos, UIO_WRITE);
+		result = VOP_WRITE(mr->mr_vn, &u);
+		if (result) {
+			return result;
+		}
+	}
+	mr->mr_dirty[page] = false;
+	return 0;
+}
+
+/*
+ * Write back all of MR's dirty pages. If INVAL, also drop them from
+ * the TLB so the next write faults and marks them dirty again.
+ */
+static
+int
+mmap_region_sync(struct mmap_region *mr, bool inval)
+{
+	unsigned i;
+	int result;
+
+	if (mr->mr_flags != MAP_SHARED) {
+		return 0;
+	}
+	for (i=0; i<mr->mr_npages; i++) {
+		if (!mr->mr_dirty[i]) {
+			continue;
+		}
+		result = mmap_writeback(mr, i);
+		if (result) {
+			return result;
+		}
+		if (inval) {
+			mmap_tlbinval(mr->mr_base + i * PAGE_SIZE);
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+int
+mmap_create(struct addrspace *as, size_t len, int prot, int flags,
+	    struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct mmap_region *mr;
+	unsigned npages;
+	vaddr_t base;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > MMAP_TOP) {
+		return ENOMEM;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	result = mmap_place(as, npages, &base);
+	if (result) {
+		return result;
+	}
+
+	mr = mmap_region_create(npages);
+	if (mr == NULL) {
+		return ENOMEM;
+	}
+	VOP_INCREF(vn);
+	mr->mr_base = base;
+	mr->mr_prot = prot;
+	mr->mr_flags = flags;
+	mr->mr_vn = vn;
+	mr->mr_offset = offset;
+
+	mr->mr_next = as->as_mmaps;
+	as->as_mmaps = mr;
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * Partial unmapping isn't supported: every region that overlaps
+ * [ADDR, ADDR+LEN) must lie entirely inside it.
+ */
+int
+mmap_remove(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct mmap_region **mrp, *mr;
+	vaddr_t end;
+	unsigned i;
+	int result;
+
+	if (addr % PAGE_SIZE != 0 || len == 0) {
+		return EINVAL;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+	if (end < addr) {
+		return EINVAL;
+	}
+
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (mr->mr_base < end &&
+		    addr < mr->mr_base + mr->mr_npages * PAGE_SIZE &&
+		    (mr->mr_base < addr ||
+		     mr->mr_base + mr->mr_npages * PAGE_SIZE > end)) {
+			return EINVAL;
+		}
+	}
+
+	mrp = &as->as_mmaps;
+	while (*mrp != NULL) {
+		mr = *mrp;
+		if (mr->mr_base < addr || mr->mr_base >= end) {
+			mrp = &mr->mr_next;
+			continue;
+		}
+		result = mmap_region_sync(mr, false);
+		if (result) {
+			return result;
+		}
+		for (i=0; i<mr->mr_npages; i++) {
+			if (mr->mr_pages[i] != 0) {
+				mmap_tlbinval(mr->mr_base + i * PAGE_SIZE);
+			}
+		}
+		*mrp = mr->mr_next;
+		mmap_region_destroy(mr);
+	}
+	return 0;
+}
+
+int
+mmap_sync(struct addrspace *as, struct vnode *vn)
+{
+	struct mmap_region *mr;
+	int result;
+
+	if (as == NULL) {
+		return 0;
+	}
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (mr->mr_vn != vn) {
+			continue;
+		}
+		result = mmap_region_sync(mr, true);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read in page PAGE of MR, if it isn't in already.
+ */
+static
+int
+mmap_fill(struct mmap_region *mr, unsigned page)
+{
+	struct iovec iov;
+	struct uio u;
+	paddr_t pa;
+	void *kva;
+	int result;
+
+	if (mr->mr_pages[page] != 0) {
+		return 0;
+	}
+	pa = getppages(1);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	kva = (void *)PADDR_TO_KVADDR(pa);
+	uio_kinit(&iov, &u, kva, PAGE_SIZE,
+		  mr->mr_offset + (off_t)page * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(mr->mr_vn, &u);
+	if (result) {
+		releasepages(pa);
+		return result;
+	}
+	/* Past EOF reads as zeros */
+	bzero((char *)kva + (PAGE_SIZE - u.uio_resid), u.uio_resid);
+	mr->mr_pages[page] = pa;
+	return 0;
+}
+
+int
+mmap_prefault(struct addrspace *as, const struct uio *uio)
+{
+	struct mmap_region *mr;
+	vaddr_t start, end, mrend;
+	unsigned i, page, lastpage;
+	int result;
+
+	if (as == NULL || uio->uio_segflg == UIO_SYSSPACE) {
+		return 0;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		start = (vaddr_t)uio->uio_iov[i].iov_ubase;
+		end = start + uio->uio_iov[i].iov_len;
+		if (end <= start) {
+			/* Empty, or wraps; the copy will sort it out. */
+			continue;
+		}
+		for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+			mrend = mr->mr_base + mr->mr_npages * PAGE_SIZE;
+			if (end <= mr->mr_base || start >= mrend) {
+				continue;
+			}
+			page = 0;
+			if (start > mr->mr_base) {
+				page = (start - mr->mr_base) / PAGE_SIZE;
+			}
+			lastpage = mr->mr_npages;
+			if (end < mrend) {
+				lastpage = DIVROUNDUP(end - mr->mr_base,
+						      PAGE_SIZE);
+			}
+			for (; page < lastpage; page++) {
+				result = mmap_fill(mr, page);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+bool
+mmap_fault(struct addrspace *as, int faulttype, vaddr_t addr, int *result)
+{
+	struct mmap_region *mr;
+	unsigned page;
+	paddr_t pa;
+	bool writable;
+
+	mr = mmap_find(as, addr);
+	if (mr == NULL) {
+		return false;
+	}
+	page = (addr - mr->mr_base) / PAGE_SIZE;
+
+	if (faulttype != VM_FAULT_READ && (mr->mr_prot & PROT_WRITE) == 0) {
+		*result = EFAULT;
+		return true;
+	}
+
+	if (mr->mr_pages[page] == 0) {
+		if (curthread->t_mmapnofill) {
+			/* Copying inside VOP_READ/VOP_WRITE; see above. */
+			*result = EFAULT;
+			return true;
+		}
+		*result = mmap_fill(mr, page);
+		if (*result) {
+			return true;
+		}
+	}
+	pa = mr->mr_pages[page];
+
+	if (faulttype != VM_FAULT_READ && mr->mr_flags == MAP_SHARED) {
+		mr->mr_dirty[page] = true;
+	}
+
+	/*
+	 * Shared pages are writable only once they're dirty, so we
+	 * find out when they get written.
+	 */
+	if (mr->mr_flags == MAP_SHARED) {
+		writable = mr->mr_dirty[page];
+	}
+	else {
+		writable = (mr->mr_prot & PROT_WRITE) != 0;
+	}
+
+	mmap_tlbload(addr & PAGE_FRAME, pa, writable);
+	*result = 0;
+	return true;
+}
+
+int
+mmap_copy(struct addrspace *old, struct addrspace *new)
+{
+	struct mmap_region *omr, *mr;
+	unsigned i;
+
+	for (omr = old->as_mmaps; omr != NULL; omr = omr->mr_next) {
+		mr = mmap_region_create(omr->mr_npages);
+		if (mr == NULL) {
+			return ENOMEM;
+		}
+		VOP_INCREF(omr->mr_vn);
+		mr->mr_base = omr->mr_base;
+		mr->mr_prot = omr->mr_prot;
+		mr->mr_flags = omr->mr_flags;
+		mr->mr_vn = omr->mr_vn;
+		mr->mr_offset = omr->mr_offset;
+		mr->mr_next = new->as_mmaps;
+		new->as_mmaps = mr;
+
+		for (i=0; i<omr->mr_npages; i++) {
+			if (omr->mr_pages[i] == 0) {
+				continue;
+			}
+			mr->mr_pages[i] = getppages(1);
+			if (mr->mr_pages[i] == 0) {
+				return ENOMEM;
+			}
+			memmove((void *)PADDR_TO_KVADDR(mr->mr_pages[i]),
+				(const void *)PADDR_TO_KVADDR(omr->mr_pages[i]),
+				PAGE_SIZE);
+			mr->mr_dirty[i] = omr->mr_dirty[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Called from as_destroy. The address space may not be the current
+ * one, so leave the TLB alone; as_activate flushes it anyway.
+ */
+void
+mmap_destroyall(struct addrspace *as)
+{
+	struct mmap_region *mr;
+
+	while (as->as_mmaps != NULL) {
+		mr = as->as_mmaps;
+		as->as_mmaps = mr->mr_next;
+		/* Nobody to report an error to. */
+		(void)mmap_region_sync(mr, false);
+		mmap_region_destroy(mr);
+	}
+}